@@ -0,0 +1,85 @@
+/* mimx-format.h -- layout of the mimx table files
+ * Copyright (C) 2011 Daiki Ueno <ueno@unixuser.org>
+ * Copyright (C) 2011 Red Hat, Inc.
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+#ifndef MIMX_FORMAT_H
+#define MIMX_FORMAT_H
+
+#include <stdint.h>
+
+/* A mimx table is a read-only file which is mapped as is.  All the
+   integers are little-endian, and every part starts at an offset
+   aligned to 8 bytes:
+
+   - the header below,
+   - BLOCKS: for each block of BLOCK_SIZE keys, the offset of its
+     first key in KEYS,
+   - KEYS: the sorted keys, front-coded within each block; a key is
+     the number of bytes shared with the previous key of the block
+     (0 for the first one), the number of bytes that follow, and the
+     bytes themselves,
+   - ENTRIES: a MimxEntry for each key, in the same order,
+   - POOL: the phrases, in UTF-8.
+
+   The keys of a table converted from an ibus-table are the codes of
+   the m0, m1, ... columns, and those of a table converted from a
+   scim-tables are the characters of the key, as MIMX_SCIM tells.
+   RANK is the position of the entry in the order of the candidates
+   of the source table, and the candidates are chosen among the
+   matches as the source table does.  */
+#define MIMX_MAGIC "MIMXTBL"
+#define MIMX_VERSION 1
+#define MIMX_BLOCK_SIZE 16
+
+#define MIMX_SCIM 0x1		/* converted from a scim-tables */
+
+struct _MimxHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t flags;
+  uint32_t mlen;		/* max_key_length */
+  uint32_t n_entries;
+  uint32_t block_size;
+  uint32_t n_blocks;
+  uint64_t blocks;
+  uint64_t keys, keys_size;
+  uint64_t entries;
+  uint64_t pool, pool_size;
+};
+typedef struct _MimxHeader MimxHeader;
+
+struct _MimxEntry {
+  uint32_t phrase;		/* offset in POOL */
+  uint32_t rank;
+  uint32_t freq;
+  uint16_t plen;		/* length of the phrase in bytes */
+  uint8_t mlen;			/* length of the key */
+  uint8_t reserved;
+};
+typedef struct _MimxEntry MimxEntry;
+
+#ifdef WORDS_BIGENDIAN
+#define MIMX16(x) __builtin_bswap16 (x)
+#define MIMX32(x) __builtin_bswap32 (x)
+#define MIMX64(x) __builtin_bswap64 (x)
+#else
+#define MIMX16(x) (x)
+#define MIMX32(x) (x)
+#define MIMX64(x) (x)
+#endif
+
+#endif	/* MIMX_FORMAT_H */
@@ -0,0 +1,103 @@
+/* mimx-match-bench.c -- measure the kernels comparing key prefixes
+ * Copyright (C) 2011 Daiki Ueno <ueno@unixuser.org>
+ * Copyright (C) 2011 Red Hat, Inc.
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif	/* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mimx-match.h"
+
+#define N_PREFIXES 16384	/* as many as a chunk of a scan */
+#define N_ROUNDS 2000
+
+static double
+now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Print the entries per second which each kernel compares, for the
+   keys of random lengths made of 16 letters, and check that the
+   kernels agree.  */
+int
+main (int argc, char **argv)
+{
+  static uint64_t prefixes[N_PREFIXES];
+  static uint64_t expected[N_PREFIXES / 64], matches[N_PREFIXES / 64];
+  const MimxMatchKernel *kernel;
+  unsigned char key[MIMX_PREFIX_SIZE];
+  int len = argc > 1 ? atoi (argv[1]) : 2;
+  int i, j, status = 0;
+
+  if (len < 1 || len > MIMX_PREFIX_SIZE)
+    {
+      fprintf (stderr, "Usage: %s [1-%d]\n", argv[0], MIMX_PREFIX_SIZE);
+      return 1;
+    }
+
+  srand (1);
+  for (i = 0; i < N_PREFIXES; i++)
+    {
+      unsigned char buf[MIMX_PREFIX_SIZE];
+      int klen = 1 + rand () % MIMX_PREFIX_SIZE;
+
+      for (j = 0; j < klen; j++)
+	buf[j] = 'a' + rand () % 16;
+      prefixes[i] = mimx_match_prefix (buf, klen);
+    }
+  memcpy (key, &prefixes[0], sizeof key);
+
+  mimx_match_kernels[0].func (prefixes, N_PREFIXES,
+			      mimx_match_prefix (key, len),
+			      mimx_match_mask (len), expected);
+
+  for (kernel = mimx_match_kernels; kernel->name; kernel++)
+    {
+      double start, elapsed;
+
+      if (!(*kernel->supported) ())
+	{
+	  printf ("%-8s unsupported\n", kernel->name);
+	  continue;
+	}
+
+      start = now ();
+      for (i = 0; i < N_ROUNDS; i++)
+	(*kernel->func) (prefixes, N_PREFIXES, mimx_match_prefix (key, len),
+			 mimx_match_mask (len), matches);
+      elapsed = now () - start;
+
+      if (memcmp (matches, expected, sizeof matches))
+	{
+	  printf ("%-8s MISMATCH\n", kernel->name);
+	  status = 1;
+	  continue;
+	}
+      printf ("%-8s %.0f entries/s\n", kernel->name,
+	      (double) N_PREFIXES * N_ROUNDS / elapsed);
+    }
+  return status;
+}
@@ -0,0 +1,162 @@
+/* mimx-match.c -- batched comparison of key prefixes
+ * Copyright (C) 2011 Daiki Ueno <ueno@unixuser.org>
+ * Copyright (C) 2011 Red Hat, Inc.
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif	/* HAVE_CONFIG_H */
+
+#include <string.h>
+
+#include "mimx-match.h"
+
+#if defined __x86_64__ && defined __GNUC__
+#define MATCH_X86 1
+#include <immintrin.h>
+#endif
+
+uint64_t
+mimx_match_prefix (const unsigned char *key, int len)
+{
+  uint64_t prefix = 0;
+  int i;
+
+  for (i = 0; i < len && i < MIMX_PREFIX_SIZE; i++)
+    prefix |= (uint64_t) key[i] << (8 * i);
+  return prefix;
+}
+
+/* Return the mask of the bits of the first LEN bytes of a prefix.  */
+uint64_t
+mimx_match_mask (int len)
+{
+  if (len >= MIMX_PREFIX_SIZE)
+    return ~(uint64_t) 0;
+  return ((uint64_t) 1 << (8 * len)) - 1;
+}
+
+static void
+match_scalar (const uint64_t *prefixes, int n, uint64_t key, uint64_t mask,
+	      uint64_t *matches)
+{
+  int i;
+
+  memset (matches, 0, sizeof (uint64_t) * ((n + 63) / 64));
+  for (i = 0; i < n; i++)
+    if ((prefixes[i] & mask) == key)
+      matches[i / 64] |= (uint64_t) 1 << (i % 64);
+}
+
+static int
+supported_always (void)
+{
+  return 1;
+}
+
+#ifdef MATCH_X86
+/* SSE2 has no 64-bit comparison, so a prefix matches if both of its
+   32-bit halves do.  */
+static void
+match_sse2 (const uint64_t *prefixes, int n, uint64_t key, uint64_t mask,
+	    uint64_t *matches)
+{
+  __m128i k = _mm_set1_epi64x ((long long) key);
+  __m128i m = _mm_set1_epi64x ((long long) mask);
+  int i;
+
+  memset (matches, 0, sizeof (uint64_t) * ((n + 63) / 64));
+  for (i = 0; i + 16 <= n; i += 16)
+    {
+      uint64_t bits = 0;
+      int j;
+
+      for (j = 0; j < 16; j += 2)
+	{
+	  __m128i p = _mm_loadu_si128 ((const __m128i *) (prefixes + i + j));
+	  __m128i eq = _mm_cmpeq_epi32 (_mm_and_si128 (p, m), k);
+
+	  eq = _mm_and_si128 (eq, _mm_shuffle_epi32 (eq,
+						     _MM_SHUFFLE (2, 3, 0, 1)));
+	  bits |= (uint64_t) _mm_movemask_pd (_mm_castsi128_pd (eq)) << j;
+	}
+      matches[i / 64] |= bits << (i % 64);
+    }
+  for (; i < n; i++)
+    if ((prefixes[i] & mask) == key)
+      matches[i / 64] |= (uint64_t) 1 << (i % 64);
+}
+
+__attribute__ ((target ("avx2")))
+static void
+match_avx2 (const uint64_t *prefixes, int n, uint64_t key, uint64_t mask,
+	    uint64_t *matches)
+{
+  __m256i k = _mm256_set1_epi64x ((long long) key);
+  __m256i m = _mm256_set1_epi64x ((long long) mask);
+  int i;
+
+  memset (matches, 0, sizeof (uint64_t) * ((n + 63) / 64));
+  for (i = 0; i + 16 <= n; i += 16)
+    {
+      uint64_t bits = 0;
+      int j;
+
+      for (j = 0; j < 16; j += 4)
+	{
+	  __m256i p = _mm256_loadu_si256 ((const __m256i *)
+					  (prefixes + i + j));
+	  __m256i eq = _mm256_cmpeq_epi64 (_mm256_and_si256 (p, m), k);
+
+	  bits |= (uint64_t) _mm256_movemask_pd (_mm256_castsi256_pd (eq))
+	    << j;
+	}
+      matches[i / 64] |= bits << (i % 64);
+    }
+  for (; i < n; i++)
+    if ((prefixes[i] & mask) == key)
+      matches[i / 64] |= (uint64_t) 1 << (i % 64);
+}
+
+static int
+supported_avx2 (void)
+{
+  return __builtin_cpu_supports ("avx2");
+}
+#endif	/* MATCH_X86 */
+
+const MimxMatchKernel mimx_match_kernels[] =
+  {
+    { "scalar", match_scalar, supported_always },
+#ifdef MATCH_X86
+    { "sse2", match_sse2, supported_always },
+    { "avx2", match_avx2, supported_avx2 },
+#endif
+    { NULL, NULL, NULL }
+  };
+
+/* Return the fastest kernel which the processor supports.  */
+MimxMatchFunc
+mimx_match_select (void)
+{
+  MimxMatchFunc func = NULL;
+  const MimxMatchKernel *kernel;
+
+  for (kernel = mimx_match_kernels; kernel->name; kernel++)
+    if ((*kernel->supported) ())
+      func = kernel->func;
+  return func;
+}
@@ -0,0 +1,49 @@
+/* mimx-match.h -- batched comparison of key prefixes
+ * Copyright (C) 2011 Daiki Ueno <ueno@unixuser.org>
+ * Copyright (C) 2011 Red Hat, Inc.
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+#ifndef MIMX_MATCH_H
+#define MIMX_MATCH_H
+
+#include <stdint.h>
+
+/* The prefix of a key is its first MIMX_PREFIX_SIZE bytes, padded with
+   0, with the first byte in the least significant bits.  */
+#define MIMX_PREFIX_SIZE 8
+
+/* Set the bit I % 64 of MATCHES[I / 64] if the prefix PREFIXES[I],
+   with the bits of MASK, is KEY, and clear it otherwise, for I from 0
+   to N - 1.  */
+typedef void (*MimxMatchFunc) (const uint64_t *prefixes, int n,
+			       uint64_t key, uint64_t mask,
+			       uint64_t *matches);
+
+struct _MimxMatchKernel {
+  const char *name;
+  MimxMatchFunc func;
+  int (*supported) (void);
+};
+typedef struct _MimxMatchKernel MimxMatchKernel;
+
+/* the kernels from the slowest to the fastest, ending with NULL */
+extern const MimxMatchKernel mimx_match_kernels[];
+
+uint64_t mimx_match_prefix (const unsigned char *key, int len);
+uint64_t mimx_match_mask (int len);
+MimxMatchFunc mimx_match_select (void);
+
+#endif	/* MIMX_MATCH_H */
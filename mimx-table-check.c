@@ -0,0 +1,1144 @@
+/* mimx-table-check.c -- check the candidates of libmimx-table
+ * Copyright (C) 2011 Daiki Ueno <ueno@unixuser.org>
+ * Copyright (C) 2011 Red Hat, Inc.
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif	/* HAVE_CONFIG_H */
+
+#include <ctype.h>
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <m17n.h>
+#include <sqlite3.h>
+
+/* The tables are written to a temporary directory, opened in input
+   contexts as the input methods do, and the candidates of their
+   lookups compared with those expected:
+
+   - an ibus-table and a scim-table opened together give the union of
+     their candidates, ranked by the length of their keys and then by
+     frequency whichever table they come from, and those of the
+     ibus-table, opened first, in place of the same texts of the
+     scim-table;
+
+   - the key index of a generated scim-table finds what a scan of all
+     its entries finds, with a limit and with wildcards, and its keys
+     with a typo come after the exact ones;
+
+   - the lookups of the keys typed one by one, then undone, give the
+     candidates of a fresh lookup;
+
+   - the paging mode ends up with the candidates of a single lookup;
+
+   - a mimx table converted from a table gives its candidates, and a
+     truncated one gives none;
+
+   - a candidate learned comes first.
+
+   The module is the first argument, or else $MIMX_TABLE_MODULE, and
+   mimx-table-convert the second, or else $MIMX_TABLE_CONVERT; without
+   it, the mimx tables are not checked.  */
+
+typedef MPlist *(*ModuleFunc) (MPlist *args);
+
+struct _Phrase {
+  const char *key, *phrase;
+  int freq;
+};
+typedef struct _Phrase Phrase;
+
+/* the ibus-table streams its candidates by key length, and the
+   scim-table by frequency, so that merging them as they come puts "Z"
+   of the scim-table before "W" and "Y" of the ibus-table */
+static const Phrase ibus_phrases[] =
+  {
+    { "a", "S", 5 },
+    { "ab", "X", 10 },
+    { "abc", "Y", 1 },
+    { "b", "Q", 7 },
+    { NULL, NULL, 0 }
+  };
+
+static const Phrase scim_phrases[] =
+  {
+    { "abcd", "Z", 100 },
+    { "ab", "X", 50 },
+    { "a", "W", 3 },
+    { NULL, NULL, 0 }
+  };
+
+struct _Check {
+  const char *preedit;
+  int max_candidates;
+  const char *expected[8];
+};
+typedef struct _Check Check;
+
+static const Check checks[] =
+  {
+    { "a", 0, { "S", "W", "X", "Y", "Z", NULL } },
+    /* each table gives its own first two: "S" and "X", then "Z" and
+       "X" again */
+    { "a", 2, { "S", "X", NULL } },
+    { "ab", 0, { "X", "Y", "Z", NULL } },
+    { NULL, 0, { NULL } }
+  };
+
+/* the generated tables: every key of 1 to 4 of the letters "abcd", in
+   order of length, with the phrase "pN" for the Nth of them and
+   frequencies spread over 0 to 96 */
+#define GEN_MLEN 4
+#define N_GEN_PHRASES (4 + 16 + 64 + 256)
+
+static Phrase gen_phrases[N_GEN_PHRASES + 1];
+static char gen_keys[N_GEN_PHRASES][GEN_MLEN + 1];
+static char gen_texts[N_GEN_PHRASES][8];
+
+/* the preedits looked up in the generated tables, and those typed
+   one by one, then undone */
+static const char *const gen_preedits[] =
+  { "a", "ab", "abc", "abcd", "b", "ca", "dcb", "ddd", "abx", NULL };
+static const char *const typed_preedits[] =
+  { "a", "ab", "abc", "abcd", "abc", "ab", "a", NULL };
+
+struct _Module {
+  ModuleFunc init, open, lookup, more, learn, fini;
+};
+typedef struct _Module Module;
+
+/* an input context, and the groups of the candidates it shows */
+struct _Context {
+  Module *module;
+  MInputContext ic;
+  MPlist *groups;
+};
+typedef struct _Context Context;
+
+static void
+make_gen_phrases (void)
+{
+  int n = 0, len, i, j;
+
+  for (len = 1; len <= GEN_MLEN; len++)
+    for (i = 0; i < 1 << (2 * len); i++, n++)
+      {
+	for (j = 0; j < len; j++)
+	  gen_keys[n][j] = 'a' + ((i >> (2 * (len - 1 - j))) & 3);
+	gen_keys[n][len] = '\0';
+	sprintf (gen_texts[n], "p%d", n);
+	gen_phrases[n].key = gen_keys[n];
+	gen_phrases[n].phrase = gen_texts[n];
+	gen_phrases[n].freq = (n * 7919) % 97;
+      }
+  gen_phrases[n].key = NULL;
+}
+
+static int
+write_ibus (const char *file, const Phrase *phrases)
+{
+  sqlite3 *db;
+  char *sql;
+  int i, rc;
+
+  if (sqlite3_open (file, &db) != SQLITE_OK)
+    return -1;
+  rc = sqlite3_exec (db,
+		     "CREATE TABLE ime (attr TEXT, val TEXT);"
+		     "INSERT INTO ime VALUES ('max_key_length', '4');"
+		     "CREATE TABLE phrases (id INTEGER PRIMARY KEY,"
+		     " mlen INTEGER, clen INTEGER, m0 INTEGER, m1 INTEGER,"
+		     " m2 INTEGER, m3 INTEGER, category INTEGER, phrase TEXT,"
+		     " freq INTEGER, user_freq INTEGER);"
+		     "BEGIN;",
+		     NULL, NULL, NULL);
+  for (i = 0; rc == SQLITE_OK && phrases[i].key; i++)
+    {
+      const char *key = phrases[i].key;
+      int m[4] = { 0, 0, 0, 0 }, j;
+
+      /* the letters are coded from 1 */
+      for (j = 0; key[j]; j++)
+	m[j] = key[j] - 'a' + 1;
+      sql = sqlite3_mprintf ("INSERT INTO phrases (mlen, clen, m0, m1, m2,"
+			     " m3, category, phrase, freq, user_freq)"
+			     " VALUES (%d, %d, %d, %d, %d, %d, 0, %Q, %d, 0)",
+			     (int) strlen (key),
+			     (int) strlen (phrases[i].phrase),
+			     m[0], m[1], m[2], m[3], phrases[i].phrase,
+			     phrases[i].freq);
+      rc = sql ? sqlite3_exec (db, sql, NULL, NULL, NULL) : SQLITE_NOMEM;
+      sqlite3_free (sql);
+    }
+  if (rc == SQLITE_OK)
+    rc = sqlite3_exec (db, "COMMIT;", NULL, NULL, NULL);
+  sqlite3_close (db);
+  return rc == SQLITE_OK ? 0 : -1;
+}
+
+static void
+put_uint (FILE *fp, unsigned int val, int size)
+{
+  int i;
+
+  for (i = 0; i < size; i++)
+    fputc ((val >> (8 * i)) & 0xFF, fp);
+}
+
+static int
+write_scim (const char *file, const Phrase *phrases)
+{
+  FILE *fp = fopen (file, "wb");
+  int i, size = 0;
+
+  if (!fp)
+    return -1;
+  for (i = 0; phrases[i].key; i++)
+    size += 4 + strlen (phrases[i].key) + strlen (phrases[i].phrase);
+
+  fputs ("SCIM_Generic_Table_Phrase_Library_BINARY\nVERSION_1_0\n"
+	 "MAX_KEY_LENGTH = 8\nBEGIN_TABLE\n", fp);
+  put_uint (fp, size, 4);
+  for (i = 0; phrases[i].key; i++)
+    {
+      fputc (0x80 | strlen (phrases[i].key), fp);
+      fputc (strlen (phrases[i].phrase), fp);
+      put_uint (fp, phrases[i].freq, 2);
+      fputs (phrases[i].key, fp);
+      fputs (phrases[i].phrase, fp);
+    }
+  fputs ("END_TABLE\n", fp);
+  return fclose (fp) == 0 ? 0 : -1;
+}
+
+/* Copy the first SIZE bytes of the file FROM to TO, or all of them if
+   SIZE is negative.  */
+static int
+copy_file (const char *from, const char *to, long size)
+{
+  FILE *in = fopen (from, "rb"), *out = in ? fopen (to, "wb") : NULL;
+  int c;
+
+  if (!out)
+    {
+      if (in)
+	fclose (in);
+      return -1;
+    }
+  for (; size != 0 && (c = getc (in)) != EOF; size--)
+    putc (c, out);
+  fclose (in);
+  return fclose (out) == 0 ? 0 : -1;
+}
+
+static MPlist *
+call (ModuleFunc func, MInputContext *ic, MPlist *args)
+{
+  MPlist *plist = mplist (), *result;
+
+  mplist_add (plist, Mt, ic);
+  for (; args && mplist_key (args) != Mnil; args = mplist_next (args))
+    mplist_add (plist, mplist_key (args), mplist_value (args));
+  result = (*func) (plist);
+  m17n_object_unref (plist);
+  return result;
+}
+
+static MText *
+make_text (const char *str)
+{
+  return mtext_from_data (str, strlen (str), MTEXT_FORMAT_UTF_8);
+}
+
+/* Write the ASCII characters of MT to BUF of SIZE bytes, and the others
+   as "?".  */
+static const char *
+text_string (MText *mt, char *buf, int size)
+{
+  int i, len = mtext_len (mt);
+
+  for (i = 0; i < len && i < size - 1; i++)
+    {
+      int c = mtext_ref_char (mt, i);
+
+      buf[i] = c > 0 && c < 0x80 ? c : '?';
+    }
+  buf[i] = '\0';
+  return buf;
+}
+
+/* Return the index of MT among the generated phrases, or -1.  */
+static int
+gen_index (MText *mt)
+{
+  char buf[16];
+  int n;
+
+  text_string (mt, buf, sizeof buf);
+  if (buf[0] != 'p' || !isdigit ((unsigned char) buf[1]))
+    return -1;
+  n = atoi (buf + 1);
+  return n < N_GEN_PHRASES ? n : -1;
+}
+
+/* Return the integer of the word S: a number, or "?C" for the
+   character C as in MIM.  */
+static long
+word_integer (const char *s)
+{
+  return *s == '?' ? (unsigned char) s[1] : strtol (s, NULL, 10);
+}
+
+static int
+is_integer (const char *s)
+{
+  return isdigit ((unsigned char) *s) || (*s == '?' && s[1]);
+}
+
+/* Start an input context of MODULE in CONTEXT, and call "open" with
+   the words of SPEC, as in the "open" lines of mimx-table-replay: a
+   word followed by an integer is an option, and by another word a
+   table.  Return 0, or -1 if SPEC is malformed.  */
+static int
+open_context (Context *context, Module *module, const char *spec)
+{
+  MPlist *args, *actions;
+  char buf[1024], *s, *next;
+  int status = 0;
+
+  memset (context, 0, sizeof *context);
+  context->module = module;
+  context->ic.plist = mplist ();
+  context->ic.preedit = mtext ();
+  call (module->init, &context->ic, NULL);
+
+  snprintf (buf, sizeof buf, "%s", spec);
+  args = mplist ();
+  for (s = strtok (buf, " "); s; s = next)
+    {
+      next = strtok (NULL, " ");
+      if (is_integer (s))
+	{
+	  mplist_add (args, Minteger, (void *) word_integer (s));
+	  continue;
+	}
+      if (!next)
+	{
+	  fprintf (stderr, "malformed arguments of open: %s\n", spec);
+	  status = -1;
+	  break;
+	}
+      mplist_add (args, Msymbol, msymbol (s));
+      if (is_integer (next))
+	mplist_add (args, Minteger, (void *) word_integer (next));
+      else
+	{
+	  MText *mt = make_text (next);
+
+	  mplist_add (args, Mtext, mt);
+	  m17n_object_unref (mt);
+	}
+      next = strtok (NULL, " ");
+    }
+  if (status == 0)
+    {
+      actions = call (module->open, &context->ic, args);
+      if (actions)
+	m17n_object_unref (actions);
+    }
+  m17n_object_unref (args);
+  return status;
+}
+
+static void
+close_context (Context *context)
+{
+  call (context->module->fini, &context->ic, NULL);
+  if (context->groups)
+    m17n_object_unref (context->groups);
+  m17n_object_unref (context->ic.plist);
+  m17n_object_unref (context->ic.preedit);
+}
+
+/* Return the candidates added by the ACTIONS of a lookup or of
+   "more", as a flat list without the preedit, and keep their groups
+   in CONTEXT as those it shows.  */
+static MPlist *
+get_candidates (Context *context, MPlist *actions)
+{
+  MPlist *p, *group, *candidates = mplist ();
+
+  for (p = actions; p && mplist_key (p) != Mnil; p = mplist_next (p))
+    {
+      MPlist *groups = mplist_value (p);
+
+      if (mplist_key (p) != Mplist || mplist_key (groups) != Mplist)
+	continue;
+      if (context->groups)
+	m17n_object_unref (context->groups);
+      context->groups = groups;
+      m17n_object_ref (groups);
+      for (; mplist_key (groups) != Mnil; groups = mplist_next (groups))
+	for (group = mplist_value (groups); mplist_key (group) != Mnil;
+	     group = mplist_next (group))
+	  mplist_add (candidates, Mtext, mplist_value (group));
+      break;
+    }
+  context->ic.candidate_list = context->groups;
+
+  /* the first candidate is the preedit */
+  if (mplist_key (candidates) != Mnil)
+    mplist_pop (candidates);
+  return candidates;
+}
+
+/* Look up PREEDIT in CONTEXT, and return its candidates.  */
+static MPlist *
+lookup_preedit (Context *context, const char *preedit)
+{
+  MPlist *args, *actions, *candidates;
+
+  m17n_object_unref (context->ic.preedit);
+  context->ic.preedit = make_text (preedit);
+  if (context->groups)
+    {
+      m17n_object_unref (context->groups);
+      context->groups = NULL;
+    }
+  context->ic.candidate_list = NULL;
+
+  args = mplist ();
+  mplist_add (args, Msymbol, msymbol ("init"));
+  mplist_add (args, Msymbol, msymbol ("select"));
+  actions = call (context->module->lookup, &context->ic, args);
+  m17n_object_unref (args);
+  candidates = get_candidates (context, actions);
+  if (actions)
+    m17n_object_unref (actions);
+  return candidates;
+}
+
+/* Select the candidate INDEX of CONTEXT, counting the preedit as the
+   first, and return all the candidates once "more" has added those of
+   the next group, or NULL if it adds none.  */
+static MPlist *
+more_candidates (Context *context, int index)
+{
+  MPlist *actions, *candidates;
+
+  context->ic.candidate_index = index;
+  actions = call (context->module->more, &context->ic, NULL);
+  if (!actions)
+    return NULL;
+  candidates = get_candidates (context, actions);
+  m17n_object_unref (actions);
+  return candidates;
+}
+
+/* Record the candidate MT as chosen in CONTEXT.  */
+static void
+learn_candidate (Context *context, MText *mt)
+{
+  MPlist *actions;
+
+  m17n_object_unref (context->ic.preedit);
+  context->ic.preedit = mtext_dup (mt);
+  actions = call (context->module->learn, &context->ic, NULL);
+  if (actions)
+    m17n_object_unref (actions);
+}
+
+/* Return the candidates which a new input context of MODULE, opened as
+   SPEC, gives for PREEDIT.  */
+static MPlist *
+lookup_fresh (Module *module, const char *spec, const char *preedit)
+{
+  Context context;
+  MPlist *candidates;
+
+  if (open_context (&context, module, spec) < 0)
+    return mplist ();
+  candidates = lookup_preedit (&context, preedit);
+  close_context (&context);
+  return candidates;
+}
+
+/* Return 0 if the candidates GOT are EXPECTED, or else report it for
+   the lookup of PREEDIT in WHAT and return -1.  */
+static int
+compare_candidates (const char *what, const char *preedit, MPlist *got,
+		    MPlist *expected)
+{
+  char buf1[64], buf2[64];
+  int i;
+
+  for (i = 1; mplist_key (got) != Mnil && mplist_key (expected) != Mnil;
+       i++, got = mplist_next (got), expected = mplist_next (expected))
+    if (mtext_cmp (mplist_value (got), mplist_value (expected)) != 0)
+      {
+	fprintf (stderr, "%s: lookup of \"%s\": candidate %d is \"%s\","
+		 " not \"%s\"\n", what, preedit, i,
+		 text_string (mplist_value (got), buf1, sizeof buf1),
+		 text_string (mplist_value (expected), buf2, sizeof buf2));
+	return -1;
+      }
+  if (mplist_key (got) != Mnil || mplist_key (expected) != Mnil)
+    {
+      fprintf (stderr, "%s: lookup of \"%s\": %s candidates than"
+	       " expected\n", what, preedit,
+	       mplist_key (got) != Mnil ? "more" : "fewer");
+      return -1;
+    }
+  return 0;
+}
+
+/* Return the position of MT in CANDIDATES, or -1.  */
+static int
+find_candidate (MPlist *candidates, MText *mt)
+{
+  int i;
+
+  for (i = 0; mplist_key (candidates) != Mnil;
+       i++, candidates = mplist_next (candidates))
+    if (mtext_cmp (mplist_value (candidates), mt) == 0)
+      return i;
+  return -1;
+}
+
+/* Return 1 if a prefix of KEY matches PATTERN, in which "?" is any
+   character and "*" any number of them.  */
+static int
+match_prefix (const char *pattern, const char *key)
+{
+  if (!*pattern)
+    return 1;
+  if (*pattern == '*')
+    return match_prefix (pattern + 1, key)
+      || (*key && match_prefix (pattern, key + 1));
+  if (!*key || (*pattern != '?' && *pattern != *key))
+    return 0;
+  return match_prefix (pattern + 1, key + 1);
+}
+
+/* Order the generated phrases at the indexes A and B as a scim-table
+   does: by frequency, then longer keys first, then by table order.  */
+static int
+cmp_gen_phrases (const void *a, const void *b)
+{
+  int ia = *(const int *) a, ib = *(const int *) b;
+  const Phrase *pa = &gen_phrases[ia], *pb = &gen_phrases[ib];
+
+  if (pa->freq != pb->freq)
+    return pb->freq - pa->freq;
+  if (strlen (pa->key) != strlen (pb->key))
+    return (int) strlen (pb->key) - (int) strlen (pa->key);
+  return ia - ib;
+}
+
+/* Return the candidates of PREEDIT in the generated scim-table, as a
+   scan of all its entries finds them: the keys starting with PREEDIT
+   which are no longer than XLEN, or than the shortest of them, up to
+   MAX (all if MAX is 0).  */
+static MPlist *
+scan_gen_scim (const char *preedit, int xlen, int max)
+{
+  MPlist *candidates = mplist ();
+  int matches[N_GEN_PHRASES], n = 0, n_kept = 0, kmin = GEN_MLEN, i;
+
+  for (i = 0; i < N_GEN_PHRASES; i++)
+    if (match_prefix (preedit, gen_phrases[i].key))
+      {
+	matches[n++] = i;
+	if ((int) strlen (gen_phrases[i].key) < kmin)
+	  kmin = strlen (gen_phrases[i].key);
+      }
+  if (xlen < kmin)
+    xlen = kmin;
+  for (i = 0; i < n; i++)
+    if ((int) strlen (gen_phrases[matches[i]].key) <= xlen)
+      matches[n_kept++] = matches[i];
+  qsort (matches, n_kept, sizeof (int), cmp_gen_phrases);
+  for (i = 0; i < n_kept && (!max || i < max); i++)
+    {
+      MText *mt = make_text (gen_phrases[matches[i]].phrase);
+
+      mplist_add (candidates, Mtext, mt);
+      m17n_object_unref (mt);
+    }
+  return candidates;
+}
+
+/* Return the fewest edits from a prefix of KEY to WORD.  */
+static int
+prefix_distance (const char *key, const char *word)
+{
+  int row[64], len = strlen (word), i, j, diag, best;
+
+  for (j = 0; j <= len; j++)
+    row[j] = j;
+  best = row[len];
+  for (i = 0; key[i]; i++)
+    {
+      diag = row[0];
+      row[0] = i + 1;
+      for (j = 1; j <= len; j++)
+	{
+	  int cost = diag + (key[i] != word[j - 1]);
+
+	  diag = row[j];
+	  if (row[j] + 1 < cost)
+	    cost = row[j] + 1;
+	  if (row[j - 1] + 1 < cost)
+	    cost = row[j - 1] + 1;
+	  row[j] = cost;
+	}
+      if (row[len] < best)
+	best = row[len];
+    }
+  return best;
+}
+
+/* Open the tables in a new input context as CHECK says, look up its
+   preedit, and return 0 if the candidates are those expected.  */
+static int
+run_check (Module *module, const Check *check, const char *ibus_file,
+	   const char *scim_file)
+{
+  MPlist *candidates, *expected;
+  char spec[1024];
+  int i, status;
+
+  /* xlen, which takes all the keys of the tables, max_candidates, no
+     paging, and a long wait for the tables to be loaded */
+  snprintf (spec, sizeof spec, "ibus %s scim %s 4 %d 0 load-wait 10000",
+	    ibus_file, scim_file, check->max_candidates);
+  candidates = lookup_fresh (module, spec, check->preedit);
+
+  expected = mplist ();
+  for (i = 0; check->expected[i]; i++)
+    {
+      MText *mt = make_text (check->expected[i]);
+
+      mplist_add (expected, Mtext, mt);
+      m17n_object_unref (mt);
+    }
+  snprintf (spec, sizeof spec, "union with max_candidates %d",
+	    check->max_candidates);
+  status = compare_candidates (spec, check->preedit, candidates, expected);
+  m17n_object_unref (expected);
+  m17n_object_unref (candidates);
+  return status;
+}
+
+/* Check that the key index of the generated scim-table FILE finds what
+   a scan finds, with and without a limit, and with wildcards.  */
+static int
+check_index (Module *module, const char *file)
+{
+  static const char *const patterns[] =
+    { "a?c", "?b", "ab*d", "a*", "d?", NULL };
+  static const int limits[] = { 0, 1, 5 };
+  Context context;
+  MPlist *candidates, *expected;
+  char spec[1024], what[64];
+  int status = 0, i, j, xlen;
+
+  for (xlen = 2; xlen <= 4; xlen += 2)
+    for (j = 0; j < sizeof limits / sizeof *limits; j++)
+      {
+	snprintf (spec, sizeof spec, "scim %s %d %d 0 load-wait 10000",
+		  file, xlen, limits[j]);
+	snprintf (what, sizeof what, "scim with xlen %d and"
+		  " max_candidates %d", xlen, limits[j]);
+	if (open_context (&context, module, spec) < 0)
+	  return -1;
+	for (i = 0; gen_preedits[i]; i++)
+	  {
+	    candidates = lookup_preedit (&context, gen_preedits[i]);
+	    expected = scan_gen_scim (gen_preedits[i], xlen, limits[j]);
+	    if (compare_candidates (what, gen_preedits[i], candidates,
+				    expected) < 0)
+	      status = -1;
+	    m17n_object_unref (candidates);
+	    m17n_object_unref (expected);
+	  }
+	close_context (&context);
+      }
+
+  snprintf (spec, sizeof spec, "scim %s 2 0 0 load-wait 10000"
+	    " single-wildcard ?? multi-wildcard ?*", file);
+  if (open_context (&context, module, spec) < 0)
+    return -1;
+  for (i = 0; patterns[i]; i++)
+    {
+      candidates = lookup_preedit (&context, patterns[i]);
+      expected = scan_gen_scim (patterns[i], 2, 0);
+      if (compare_candidates ("scim with wildcards", patterns[i],
+			      candidates, expected) < 0)
+	status = -1;
+      m17n_object_unref (candidates);
+      m17n_object_unref (expected);
+    }
+  close_context (&context);
+  return status;
+}
+
+/* Check that a fuzzy lookup in the generated scim-table FILE gives
+   the candidates of the exact keys first, then only others of keys
+   within an edit, and some for a preedit with a typo.  */
+static int
+check_fuzzy (Module *module, const char *file)
+{
+  static const char *const preedits[] = { "abc", "abx", "xbcd", NULL };
+  Context context;
+  MPlist *candidates, *exact, *p;
+  char spec[1024], buf[64];
+  int status = 0, i, n, n_exact;
+
+  snprintf (spec, sizeof spec, "scim %s 2 0 0 load-wait 10000 fuzzy 1",
+	    file);
+  if (open_context (&context, module, spec) < 0)
+    return -1;
+  for (i = 0; preedits[i]; i++)
+    {
+      candidates = lookup_preedit (&context, preedits[i]);
+      exact = scan_gen_scim (preedits[i], 2, 0);
+      n_exact = mplist_length (exact);
+      for (n = 0, p = candidates; mplist_key (p) != Mnil;
+	   n++, p = mplist_next (p))
+	{
+	  int index = gen_index (mplist_value (p));
+	  int position = find_candidate (exact, mplist_value (p));
+
+	  if (n < n_exact ? position == n
+	      : position < 0 && index >= 0
+	      && prefix_distance (gen_phrases[index].key, preedits[i]) <= 1)
+	    continue;
+	  fprintf (stderr, "fuzzy scim: lookup of \"%s\": candidate %d"
+		   " \"%s\" is not expected there\n", preedits[i], n + 1,
+		   text_string (mplist_value (p), buf, sizeof buf));
+	  status = -1;
+	  break;
+	}
+      if (mplist_key (p) == Mnil && n <= n_exact)
+	{
+	  fprintf (stderr, "fuzzy scim: lookup of \"%s\": no keys with a"
+		   " typo\n", preedits[i]);
+	  status = -1;
+	}
+      m17n_object_unref (candidates);
+      m17n_object_unref (exact);
+    }
+  close_context (&context);
+  return status;
+}
+
+/* Check that the lookups of the keys typed one by one in an input
+   context opened as SPEC, then undone, give the candidates of a fresh
+   lookup in FRESH_SPEC, which opens a copy of the same table so that
+   the results cached for the first are not shared.  */
+static int
+check_narrowing (Module *module, const char *what, const char *spec,
+		 const char *fresh_spec)
+{
+  Context context;
+  MPlist *candidates, *expected;
+  int status = 0, i;
+
+  if (open_context (&context, module, spec) < 0)
+    return -1;
+  for (i = 0; typed_preedits[i]; i++)
+    {
+      candidates = lookup_preedit (&context, typed_preedits[i]);
+      expected = lookup_fresh (module, fresh_spec, typed_preedits[i]);
+      if (mplist_key (expected) == Mnil)
+	{
+	  fprintf (stderr, "%s: lookup of \"%s\": no candidates\n", what,
+		   typed_preedits[i]);
+	  status = -1;
+	}
+      else if (compare_candidates (what, typed_preedits[i], candidates,
+				   expected) < 0)
+	status = -1;
+      m17n_object_unref (candidates);
+      m17n_object_unref (expected);
+    }
+  close_context (&context);
+  return status;
+}
+
+/* Check that an input context opened as SPEC, in the paging mode,
+   adds the candidates of PREEDIT a group at a time as the last one is
+   selected, up to those of a fresh lookup in FULL_SPEC.  With
+   SAME_ORDER 0, they only have to be the same candidates.  */
+static int
+check_paging (Module *module, const char *what, const char *spec,
+	      const char *full_spec, const char *preedit, int same_order)
+{
+  Context context;
+  MPlist *candidates, *more, *expected, *p;
+  int status = 0, n_groups = 1, n;
+
+  if (open_context (&context, module, spec) < 0)
+    return -1;
+  candidates = lookup_preedit (&context, preedit);
+  while ((n = mplist_length (candidates)) > 0
+	 && (more = more_candidates (&context, n)))
+    {
+      m17n_object_unref (candidates);
+      candidates = more;
+      n_groups++;
+    }
+  close_context (&context);
+
+  expected = lookup_fresh (module, full_spec, preedit);
+  if (n_groups < 3)
+    {
+      fprintf (stderr, "%s: lookup of \"%s\": only %d groups added\n",
+	       what, preedit, n_groups);
+      status = -1;
+    }
+  else if (same_order)
+    status = compare_candidates (what, preedit, candidates, expected);
+  else
+    {
+      for (p = candidates, n = 0; mplist_key (p) != Mnil;
+	   p = mplist_next (p), n++)
+	if (find_candidate (expected, mplist_value (p)) < 0
+	    || find_candidate (candidates, mplist_value (p)) != n)
+	  break;
+      if (mplist_key (p) != Mnil || n != mplist_length (expected))
+	{
+	  fprintf (stderr, "%s: lookup of \"%s\": not the candidates of"
+		   " a single lookup\n", what, preedit);
+	  status = -1;
+	}
+    }
+  m17n_object_unref (candidates);
+  m17n_object_unref (expected);
+  return status;
+}
+
+/* Convert the generated table FILE of TYPE to the mimx table MIMX with
+   CONVERT, and check that it gives the same candidates, with and
+   without a limit, and that a copy of its first half, TRUNCATED, gives
+   none.  */
+static int
+check_mimx (Module *module, const char *convert, const char *type,
+	    const char *file, const char *mimx, const char *truncated)
+{
+  static const int limits[] = { 0, 5 };
+  Context source, converted;
+  MPlist *candidates, *expected;
+  char spec[1024], what[64], *command;
+  FILE *fp;
+  long size;
+  int status = 0, i, j, rc;
+
+  command = sqlite3_mprintf ("'%s' %s '%s' '%s'", convert, type, file,
+			     mimx);
+  rc = command ? system (command) : -1;
+  sqlite3_free (command);
+  if (rc != 0)
+    {
+      fprintf (stderr, "cannot convert %s to %s\n", file, mimx);
+      return -1;
+    }
+
+  for (j = 0; j < sizeof limits / sizeof *limits; j++)
+    {
+      snprintf (spec, sizeof spec, "%s %s 2 %d 0 load-wait 10000", type,
+		file, limits[j]);
+      if (open_context (&source, module, spec) < 0)
+	return -1;
+      snprintf (spec, sizeof spec, "mimx %s 2 %d 0 load-wait 10000", mimx,
+		limits[j]);
+      if (open_context (&converted, module, spec) < 0)
+	{
+	  close_context (&source);
+	  return -1;
+	}
+      snprintf (what, sizeof what, "mimx from %s with max_candidates %d",
+		type, limits[j]);
+      for (i = 0; gen_preedits[i]; i++)
+	{
+	  candidates = lookup_preedit (&converted, gen_preedits[i]);
+	  expected = lookup_preedit (&source, gen_preedits[i]);
+	  if (compare_candidates (what, gen_preedits[i], candidates,
+				  expected) < 0)
+	    status = -1;
+	  m17n_object_unref (candidates);
+	  m17n_object_unref (expected);
+	}
+      close_context (&converted);
+      close_context (&source);
+    }
+
+  fp = fopen (mimx, "rb");
+  size = fp && fseek (fp, 0, SEEK_END) == 0 ? ftell (fp) : -1;
+  if (fp)
+    fclose (fp);
+  if (size <= 0 || copy_file (mimx, truncated, size / 2) < 0)
+    return -1;
+  snprintf (spec, sizeof spec, "mimx %s 2 0 0 load-wait 10000", truncated);
+  candidates = lookup_fresh (module, spec, "a");
+  if (mplist_key (candidates) != Mnil)
+    {
+      fprintf (stderr, "truncated mimx from %s: lookup of \"a\":"
+	       " candidates\n", type);
+      status = -1;
+    }
+  m17n_object_unref (candidates);
+  return status;
+}
+
+/* Check that the last candidate of PREEDIT in an input context opened
+   as SPEC comes first once it is learned, or with BY_LENGTH first
+   among those of keys as long, and in a new input context too.  */
+static int
+check_learning (Module *module, const char *what, const char *spec,
+		const char *preedit, int by_length)
+{
+  Context context;
+  MPlist *candidates, *p;
+  MText *chosen;
+  int status = 0, first = 0, index, klen;
+
+  if (open_context (&context, module, spec) < 0)
+    return -1;
+  candidates = lookup_preedit (&context, preedit);
+  if (mplist_length (candidates) < 2)
+    {
+      fprintf (stderr, "%s: lookup of \"%s\": too few candidates\n", what,
+	       preedit);
+      m17n_object_unref (candidates);
+      close_context (&context);
+      return -1;
+    }
+  for (p = candidates; mplist_key (mplist_next (p)) != Mnil;
+       p = mplist_next (p))
+    ;
+  chosen = mplist_value (p);
+  m17n_object_ref (chosen);
+  index = gen_index (chosen);
+  klen = index < 0 ? 0 : strlen (gen_phrases[index].key);
+
+  /* the first candidate of a key as long */
+  for (p = candidates; by_length && mplist_key (p) != Mnil;
+       p = mplist_next (p), first++)
+    {
+      index = gen_index (mplist_value (p));
+      if (index >= 0 && (int) strlen (gen_phrases[index].key) >= klen)
+	break;
+    }
+  m17n_object_unref (candidates);
+
+  learn_candidate (&context, chosen);
+  candidates = lookup_preedit (&context, preedit);
+  if (find_candidate (candidates, chosen) != first)
+    {
+      fprintf (stderr, "%s: lookup of \"%s\": the candidate learned is"
+	       " not number %d\n", what, preedit, first + 1);
+      status = -1;
+    }
+  m17n_object_unref (candidates);
+  close_context (&context);
+
+  candidates = lookup_fresh (module, spec, preedit);
+  if (find_candidate (candidates, chosen) != first)
+    {
+      fprintf (stderr, "%s: lookup of \"%s\" in a new input context: the"
+	       " candidate learned is not number %d\n", what, preedit,
+	       first + 1);
+      status = -1;
+    }
+  m17n_object_unref (candidates);
+  m17n_object_unref (chosen);
+  return status;
+}
+
+int
+main (int argc, char **argv)
+{
+  char dir[] = "/tmp/mimx-table-check.XXXXXX";
+  const char *file = argc > 1 ? argv[1] : getenv ("MIMX_TABLE_MODULE");
+  const char *convert = argc > 2 ? argv[2] : getenv ("MIMX_TABLE_CONVERT");
+  char *ibus_file, *scim_file, *gen_ibus, *gen_scim, *copy_ibus;
+  char *copy_scim, *learn_ibus, *learn_scim, *mimx_ibus, *mimx_scim;
+  char *copy_mimx, *truncated, *command;
+  char spec[1024], fresh_spec[1024];
+  Module module;
+  void *handle;
+  int i, status = 0;
+
+  if (!file)
+    {
+      fprintf (stderr, "Usage: %s MODULE [CONVERT]\n", argv[0]);
+      return 1;
+    }
+  if (!mkdtemp (dir))
+    {
+      perror (dir);
+      return 1;
+    }
+  /* the learned counts and the index cache stay in the directory */
+  setenv ("XDG_DATA_HOME", dir, 1);
+  setenv ("XDG_CACHE_HOME", dir, 1);
+  unsetenv ("MIMX_TABLE_MEMORY");
+
+  /* the copies of the generated tables are other tables for the
+     module, whose results and learned counts are their own */
+  make_gen_phrases ();
+  ibus_file = sqlite3_mprintf ("%s/check.db", dir);
+  scim_file = sqlite3_mprintf ("%s/check.bin", dir);
+  gen_ibus = sqlite3_mprintf ("%s/gen.db", dir);
+  gen_scim = sqlite3_mprintf ("%s/gen.bin", dir);
+  copy_ibus = sqlite3_mprintf ("%s/copy.db", dir);
+  copy_scim = sqlite3_mprintf ("%s/copy.bin", dir);
+  learn_ibus = sqlite3_mprintf ("%s/learn.db", dir);
+  learn_scim = sqlite3_mprintf ("%s/learn.bin", dir);
+  mimx_ibus = sqlite3_mprintf ("%s/gen-ibus.mimx", dir);
+  mimx_scim = sqlite3_mprintf ("%s/gen-scim.mimx", dir);
+  copy_mimx = sqlite3_mprintf ("%s/copy.mimx", dir);
+  truncated = sqlite3_mprintf ("%s/truncated.mimx", dir);
+  if (!ibus_file || !scim_file || !gen_ibus || !gen_scim || !copy_ibus
+      || !copy_scim || !learn_ibus || !learn_scim || !mimx_ibus
+      || !mimx_scim || !copy_mimx || !truncated
+      || write_ibus (ibus_file, ibus_phrases) < 0
+      || write_scim (scim_file, scim_phrases) < 0
+      || write_ibus (gen_ibus, gen_phrases) < 0
+      || write_scim (gen_scim, gen_phrases) < 0
+      || copy_file (gen_ibus, copy_ibus, -1) < 0
+      || copy_file (gen_scim, copy_scim, -1) < 0
+      || copy_file (gen_ibus, learn_ibus, -1) < 0
+      || copy_file (gen_scim, learn_scim, -1) < 0)
+    {
+      fprintf (stderr, "cannot write the tables in %s\n", dir);
+      return 1;
+    }
+
+  M17N_INIT ();
+  handle = dlopen (file, RTLD_NOW | RTLD_LOCAL);
+  if (!handle)
+    {
+      fprintf (stderr, "%s\n", dlerror ());
+      return 1;
+    }
+  module.init = (ModuleFunc) dlsym (handle, "init");
+  module.open = (ModuleFunc) dlsym (handle, "open");
+  module.lookup = (ModuleFunc) dlsym (handle, "lookup");
+  module.more = (ModuleFunc) dlsym (handle, "more");
+  module.learn = (ModuleFunc) dlsym (handle, "learn");
+  module.fini = (ModuleFunc) dlsym (handle, "fini");
+  if (!module.init || !module.open || !module.lookup || !module.more
+      || !module.learn || !module.fini)
+    {
+      fprintf (stderr, "%s: not a libmimx-table module\n", file);
+      return 1;
+    }
+
+  for (i = 0; checks[i].preedit; i++)
+    if (run_check (&module, &checks[i], ibus_file, scim_file) < 0)
+      status = 1;
+
+  if (check_index (&module, gen_scim) < 0
+      || check_fuzzy (&module, gen_scim) < 0)
+    status = 1;
+
+  snprintf (spec, sizeof spec, "ibus %s 2 0 0 load-wait 10000", gen_ibus);
+  snprintf (fresh_spec, sizeof fresh_spec, "ibus %s 2 0 0 load-wait 10000",
+	    copy_ibus);
+  if (check_narrowing (&module, "narrowing ibus", spec, fresh_spec) < 0)
+    status = 1;
+  snprintf (spec, sizeof spec, "scim %s 3 0 0 load-wait 10000", gen_scim);
+  snprintf (fresh_spec, sizeof fresh_spec, "scim %s 3 0 0 load-wait 10000",
+	    copy_scim);
+  if (check_narrowing (&module, "narrowing scim", spec, fresh_spec) < 0)
+    status = 1;
+
+  snprintf (spec, sizeof spec, "ibus %s 3 0 1 load-wait 10000", gen_ibus);
+  snprintf (fresh_spec, sizeof fresh_spec, "ibus %s 3 0 0 load-wait 10000",
+	    copy_ibus);
+  if (check_paging (&module, "paging ibus", spec, fresh_spec, "a", 1) < 0)
+    status = 1;
+  snprintf (spec, sizeof spec, "scim %s 4 0 1 load-wait 10000", gen_scim);
+  snprintf (fresh_spec, sizeof fresh_spec, "scim %s 4 0 0 load-wait 10000",
+	    copy_scim);
+  if (check_paging (&module, "paging scim", spec, fresh_spec, "a", 1) < 0)
+    status = 1;
+  /* the tables of a union give a group at a time, which is ranked with
+     the candidates left from the groups before, so that the order may
+     differ from that of a single lookup */
+  snprintf (spec, sizeof spec, "ibus %s scim %s 3 0 1 load-wait 10000",
+	    gen_ibus, scim_file);
+  snprintf (fresh_spec, sizeof fresh_spec,
+	    "ibus %s scim %s 3 0 0 load-wait 10000", copy_ibus, scim_file);
+  if (check_paging (&module, "paging union", spec, fresh_spec, "a", 0) < 0)
+    status = 1;
+
+  if (convert)
+    {
+      if (check_mimx (&module, convert, "ibus", gen_ibus, mimx_ibus,
+		      truncated) < 0
+	  || check_mimx (&module, convert, "scim", gen_scim, mimx_scim,
+			 truncated) < 0)
+	status = 1;
+      snprintf (spec, sizeof spec, "mimx %s 2 0 0 load-wait 10000",
+		mimx_ibus);
+      snprintf (fresh_spec, sizeof fresh_spec,
+		"mimx %s 2 0 0 load-wait 10000", copy_mimx);
+      if (copy_file (mimx_ibus, copy_mimx, -1) < 0
+	  || check_narrowing (&module, "narrowing mimx", spec,
+			      fresh_spec) < 0)
+	status = 1;
+    }
+  else
+    fprintf (stderr, "no mimx-table-convert: the mimx tables are not"
+	     " checked\n");
+
+  snprintf (spec, sizeof spec, "scim %s 3 0 0 load-wait 10000", learn_scim);
+  if (check_learning (&module, "learning scim", spec, "ab", 0) < 0)
+    status = 1;
+  snprintf (spec, sizeof spec, "ibus %s 2 0 0 load-wait 10000", learn_ibus);
+  if (check_learning (&module, "learning ibus", spec, "ab", 1) < 0)
+    status = 1;
+  M17N_FINI ();
+
+  sqlite3_free (ibus_file);
+  sqlite3_free (scim_file);
+  sqlite3_free (gen_ibus);
+  sqlite3_free (gen_scim);
+  sqlite3_free (copy_ibus);
+  sqlite3_free (copy_scim);
+  sqlite3_free (learn_ibus);
+  sqlite3_free (learn_scim);
+  sqlite3_free (mimx_ibus);
+  sqlite3_free (mimx_scim);
+  sqlite3_free (copy_mimx);
+  sqlite3_free (truncated);
+  /* the tables, the index cache, the learned counts and the
+     directories which the module has made */
+  command = sqlite3_mprintf ("rm -rf '%s'", dir);
+  if (command && system (command) != 0)
+    fprintf (stderr, "cannot remove %s\n", dir);
+  sqlite3_free (command);
+  return status;
+}
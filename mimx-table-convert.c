@@ -0,0 +1,449 @@
+/* mimx-table-convert.c -- convert ibus-table and scim-tables to mimx tables
+ * Copyright (C) 2011 Daiki Ueno <ueno@unixuser.org>
+ * Copyright (C) 2011 Red Hat, Inc.
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif	/* HAVE_CONFIG_H */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include <sqlite3.h>
+
+#include "mimx-format.h"
+
+#define MLEN 4		/* max key length */
+
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#define CLAMP(x, low, high)  (((x) > (high)) ? (high) : (((x) < (low)) ? (low) : (x)))
+#define ALIGN8(x) (((x) + 7) & ~(uint64_t) 7)
+
+/* an entry of the source table; KEY and PHRASE point into DATA of the
+   converter, or into a block allocated for the entry */
+struct _Entry {
+  const unsigned char *key;
+  int klen;
+  const unsigned char *phrase;
+  int plen;
+  uint32_t freq;
+  uint32_t rank;
+  void *data;
+};
+typedef struct _Entry Entry;
+
+struct _Converter {
+  uint32_t flags;
+  int mlen;
+  Entry *entries;
+  int n_entries, n_allocated_entries;
+
+  /* content of a scim-tables */
+  unsigned char *data;
+};
+typedef struct _Converter Converter;
+
+static Entry *
+add_entry (Converter *conv)
+{
+  Entry *entry;
+
+  if (conv->n_entries == conv->n_allocated_entries)
+    {
+      int n_allocated_entries = conv->n_allocated_entries
+	? conv->n_allocated_entries * 2 : 1024;
+
+      entry = realloc (conv->entries, sizeof (Entry) * n_allocated_entries);
+      if (!entry)
+	return NULL;
+      conv->entries = entry;
+      conv->n_allocated_entries = n_allocated_entries;
+    }
+  entry = &conv->entries[conv->n_entries++];
+  memset (entry, 0, sizeof *entry);
+  return entry;
+}
+
+/* Read the phrases of an ibus-table in the order of the candidates,
+   as LOOKUP_STATEMENT of the module orders them.  */
+static int
+read_ibus (Converter *conv, const char *file)
+{
+  sqlite3 *db;
+  sqlite3_stmt *stmt = NULL;
+  sqlite3_str *str;
+  char *sql;
+  int i, rc;
+
+  rc = sqlite3_open_v2 (file, &db, SQLITE_OPEN_READONLY, NULL);
+  if (rc)
+    {
+      fprintf (stderr, "can't open %s: %s\n", file, sqlite3_errmsg (db));
+      sqlite3_close (db);
+      return -1;
+    }
+
+  conv->mlen = MLEN;
+  rc = sqlite3_prepare_v2 (db,
+			   "SELECT val FROM ime WHERE attr = \"max_key_length\"",
+			   -1, &stmt, NULL);
+  if (rc == SQLITE_OK && sqlite3_step (stmt) == SQLITE_ROW)
+    conv->mlen = CLAMP(sqlite3_column_int (stmt, 0), 1, 99);
+  sqlite3_finalize (stmt);
+
+  str = sqlite3_str_new (db);
+  sqlite3_str_appendall (str, "SELECT mlen, freq, phrase");
+  for (i = 0; i < conv->mlen; i++)
+    sqlite3_str_appendf (str, ", m%d", i);
+  sqlite3_str_appendall (str,
+			 " FROM phrases"
+			 " ORDER BY mlen ASC, user_freq DESC, freq DESC, id ASC");
+  sql = sqlite3_str_finish (str);
+  if (!sql)
+    goto fail;
+  rc = sqlite3_prepare_v2 (db, sql, -1, &stmt, NULL);
+  sqlite3_free (sql);
+  if (rc != SQLITE_OK)
+    {
+      fprintf (stderr, "can't read %s: %s\n", file, sqlite3_errmsg (db));
+      goto fail;
+    }
+
+  while ((rc = sqlite3_step (stmt)) == SQLITE_ROW)
+    {
+      const unsigned char *text = sqlite3_column_text (stmt, 2);
+      int klen = CLAMP(sqlite3_column_int (stmt, 0), 0, conv->mlen);
+      int plen = text ? strlen ((const char *)text) : 0;
+      unsigned char *data;
+      Entry *entry;
+
+      /* a row without a key never matches, and a phrase must fit in
+	 MimxEntry */
+      if (klen == 0 || plen > UINT16_MAX)
+	continue;
+
+      entry = add_entry (conv);
+      data = malloc (klen + plen);
+      if (!entry || !data)
+	{
+	  free (data);
+	  goto fail;
+	}
+      for (i = 0; i < klen; i++)
+	data[i] = sqlite3_column_int (stmt, 3 + i);
+      memcpy (data + klen, text, plen);
+      entry->key = data;
+      entry->klen = klen;
+      entry->phrase = data + klen;
+      entry->plen = plen;
+      entry->freq = sqlite3_column_int (stmt, 1);
+      entry->rank = conv->n_entries - 1;
+      entry->data = data;
+    }
+  if (rc != SQLITE_DONE)
+    {
+      fprintf (stderr, "can't read %s: %s\n", file, sqlite3_errmsg (db));
+      goto fail;
+    }
+  sqlite3_finalize (stmt);
+  sqlite3_close (db);
+  return 0;
+
+ fail:
+  sqlite3_finalize (stmt);
+  sqlite3_close (db);
+  return -1;
+}
+
+static int
+cmp_scim_entries (const void *a, const void *b)
+{
+  const Entry *ea = a, *eb = b;
+
+  if (ea->freq != eb->freq)
+    return ea->freq < eb->freq ? 1 : -1;
+  if (ea->klen != eb->klen)
+    return eb->klen - ea->klen;
+  return ea->key < eb->key ? -1 : ea->key > eb->key;
+}
+
+/* Read the entries of a scim-tables, and rank them in the order of
+   the candidates, as cmp_entries of the module does.  */
+static int
+read_scim (Converter *conv, const char *file)
+{
+  char buf[4096];
+  long start_pos, end_pos;
+  uint32_t size = 0, offset;
+  FILE *fp;
+  int i;
+
+  conv->flags |= MIMX_SCIM;
+
+  fp = fopen (file, "rb");
+  if (!fp)
+    {
+      perror (file);
+      return -1;
+    }
+
+  while (fgets (buf, sizeof buf, fp))
+    {
+      if (strncmp ("###", buf, 3) == 0)
+	continue;
+      if (strncmp ("MAX_KEY_LENGTH", buf, 14) == 0)
+	{
+	  char *p = strrchr (buf, '\n');
+
+	  if (!p)
+	    continue;
+	  *p-- = '\0';
+	  while (p >= buf && *p >= '0' && *p <= '9')
+	    p--;
+	  conv->mlen = strtoul (p + 1, NULL, 10);
+	  continue;
+	}
+      if (strncmp ("BEGIN_TABLE", buf, 11) == 0)
+	{
+	  unsigned char bytes[4];
+
+	  if (fread (bytes, 4, 1, fp) != 1)
+	    break;
+	  size = bytes[0] | bytes[1] << 8 | bytes[2] << 16
+	    | (uint32_t) bytes[3] << 24;
+	  start_pos = ftell (fp);
+	  if (fseek (fp, 0, SEEK_END) < 0)
+	    break;
+	  end_pos = ftell (fp);
+	  if (size >= end_pos - start_pos
+	      || fseek (fp, start_pos, SEEK_SET) < 0)
+	    break;
+	  conv->data = malloc (size);
+	  if (conv->data && fread (conv->data, size, 1, fp) != 1)
+	    {
+	      free (conv->data);
+	      conv->data = NULL;
+	    }
+	  break;
+	}
+    }
+  fclose (fp);
+
+  if (!conv->data)
+    {
+      fprintf (stderr, "%s is not a scim table\n", file);
+      return -1;
+    }
+  if (!conv->mlen)
+    conv->mlen = MLEN;
+  conv->mlen = CLAMP(conv->mlen, 1, 99);
+
+  for (offset = 0; offset + 4 <= size;)
+    {
+      unsigned char *data = &conv->data[offset];
+      int klen = *data & 0x3F;
+      int plen = *(data + 1);
+      Entry *entry;
+
+      if (offset + 4 + klen + plen > size)
+	break;
+      if (klen > 0 && klen <= conv->mlen)
+	{
+	  entry = add_entry (conv);
+	  if (!entry)
+	    return -1;
+	  entry->key = data + 4;
+	  entry->klen = klen;
+	  entry->phrase = data + 4 + klen;
+	  entry->plen = plen;
+	  entry->freq = data[2] | data[3] << 8;
+	}
+      offset += 4 + klen + plen;
+    }
+
+  /* the entries are in the order of their offsets, which is the last
+     key of the order */
+  qsort (conv->entries, conv->n_entries, sizeof (Entry), cmp_scim_entries);
+  for (i = 0; i < conv->n_entries; i++)
+    conv->entries[i].rank = i;
+  return 0;
+}
+
+static int
+cmp_keys (const void *a, const void *b)
+{
+  const Entry *ea = a, *eb = b;
+  int rc = memcmp (ea->key, eb->key, MIN(ea->klen, eb->klen));
+
+  if (rc != 0)
+    return rc;
+  if (ea->klen != eb->klen)
+    return ea->klen - eb->klen;
+  return ea->rank < eb->rank ? -1 : ea->rank > eb->rank;
+}
+
+static void
+put_u16 (unsigned char *p, uint16_t v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+}
+
+static void
+put_u32 (unsigned char *p, uint32_t v)
+{
+  put_u16 (p, v);
+  put_u16 (p + 2, v >> 16);
+}
+
+static void
+put_u64 (unsigned char *p, uint64_t v)
+{
+  put_u32 (p, v);
+  put_u32 (p + 4, v >> 32);
+}
+
+/* Write the entries, sorted by key, as a mimx table to FILE.  The
+   whole file is built in memory first.  */
+static int
+write_mimx (Converter *conv, const char *file)
+{
+  uint64_t n_blocks, blocks, keys, keys_size, entries, pool, pool_size, size;
+  unsigned char *mem, *p, *k, *e, *s;
+  FILE *fp;
+  int i, rc;
+
+  qsort (conv->entries, conv->n_entries, sizeof (Entry), cmp_keys);
+
+  n_blocks = (conv->n_entries + MIMX_BLOCK_SIZE - 1) / MIMX_BLOCK_SIZE;
+  keys_size = pool_size = 0;
+  for (i = 0; i < conv->n_entries; i++)
+    {
+      keys_size += 2 + conv->entries[i].klen;
+      pool_size += conv->entries[i].plen;
+    }
+  if (pool_size > UINT32_MAX)
+    {
+      fprintf (stderr, "too many phrases\n");
+      return -1;
+    }
+
+  blocks = ALIGN8 (sizeof (MimxHeader));
+  keys = ALIGN8 (blocks + sizeof (uint32_t) * n_blocks);
+  entries = ALIGN8 (keys + keys_size);
+  pool = entries + sizeof (MimxEntry) * conv->n_entries;
+  size = pool + pool_size;
+
+  mem = calloc (size, 1);
+  if (!mem)
+    return -1;
+
+  memcpy (mem + offsetof (MimxHeader, magic), MIMX_MAGIC,
+	  sizeof MIMX_MAGIC);
+  put_u32 (mem + offsetof (MimxHeader, version), MIMX_VERSION);
+  put_u32 (mem + offsetof (MimxHeader, flags), conv->flags);
+  put_u32 (mem + offsetof (MimxHeader, mlen), conv->mlen);
+  put_u32 (mem + offsetof (MimxHeader, n_entries), conv->n_entries);
+  put_u32 (mem + offsetof (MimxHeader, block_size), MIMX_BLOCK_SIZE);
+  put_u32 (mem + offsetof (MimxHeader, n_blocks), n_blocks);
+  put_u64 (mem + offsetof (MimxHeader, blocks), blocks);
+  put_u64 (mem + offsetof (MimxHeader, keys), keys);
+  put_u64 (mem + offsetof (MimxHeader, keys_size), keys_size);
+  put_u64 (mem + offsetof (MimxHeader, entries), entries);
+  put_u64 (mem + offsetof (MimxHeader, pool), pool);
+  put_u64 (mem + offsetof (MimxHeader, pool_size), pool_size);
+
+  k = mem + keys;
+  e = mem + entries;
+  s = mem + pool;
+  for (i = 0; i < conv->n_entries; i++)
+    {
+      const Entry *entry = &conv->entries[i];
+      int shared = 0;
+
+      if (i % MIMX_BLOCK_SIZE == 0)
+	put_u32 (mem + blocks + sizeof (uint32_t) * (i / MIMX_BLOCK_SIZE),
+		 k - (mem + keys));
+      else
+	{
+	  const Entry *prev = &conv->entries[i - 1];
+
+	  while (shared < MIN(entry->klen, prev->klen)
+		 && entry->key[shared] == prev->key[shared])
+	    shared++;
+	}
+      *k++ = shared;
+      *k++ = entry->klen - shared;
+      memcpy (k, entry->key + shared, entry->klen - shared);
+      k += entry->klen - shared;
+
+      p = e + sizeof (MimxEntry) * i;
+      put_u32 (p + offsetof (MimxEntry, phrase), s - (mem + pool));
+      put_u32 (p + offsetof (MimxEntry, rank), entry->rank);
+      put_u32 (p + offsetof (MimxEntry, freq), entry->freq);
+      put_u16 (p + offsetof (MimxEntry, plen), entry->plen);
+      p[offsetof (MimxEntry, mlen)] = entry->klen;
+      memcpy (s, entry->phrase, entry->plen);
+      s += entry->plen;
+    }
+
+  fp = fopen (file, "wb");
+  if (!fp)
+    {
+      perror (file);
+      free (mem);
+      return -1;
+    }
+  rc = fwrite (mem, size, 1, fp) == 1 ? 0 : -1;
+  if (fclose (fp) != 0)
+    rc = -1;
+  if (rc < 0)
+    perror (file);
+  free (mem);
+  return rc;
+}
+
+int
+main (int argc, char **argv)
+{
+  Converter conv;
+  int i, rc;
+
+  if (argc != 4
+      || (strcmp (argv[1], "ibus") != 0 && strcmp (argv[1], "scim") != 0))
+    {
+      fprintf (stderr, "Usage: %s ibus|scim INPUT OUTPUT\n", argv[0]);
+      return 2;
+    }
+
+  memset (&conv, 0, sizeof conv);
+  if (strcmp (argv[1], "ibus") == 0)
+    rc = read_ibus (&conv, argv[2]);
+  else
+    rc = read_scim (&conv, argv[2]);
+  if (rc == 0)
+    rc = write_mimx (&conv, argv[3]);
+
+  for (i = 0; i < conv.n_entries; i++)
+    free (conv.entries[i].data);
+  free (conv.entries);
+  free (conv.data);
+  return rc == 0 ? 0 : 1;
+}
@@ -0,0 +1,499 @@
+/* mimx-table-replay.c -- replay keystroke traces against libmimx-table
+ * Copyright (C) 2011 Daiki Ueno <ueno@unixuser.org>
+ * Copyright (C) 2011 Red Hat, Inc.
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif	/* HAVE_CONFIG_H */
+
+#include <ctype.h>
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <m17n.h>
+
+/* The module is called as the input methods of this package do: "open"
+   once, "lookup" with the preedit after each key, "more" when a
+   candidate of the last group is selected, and "learn" before a
+   commit.  A trace is a text file of the lines:
+
+   open TYPE FILE [TYPE FILE...] [INTEGER...] [OPTION INTEGER...]
+				call "open" with the arguments
+   ic N                         switch to the input context N (0-15),
+				calling "init" if it is new
+   type STRING                  insert each character of STRING, and
+				look up the preedit after each of them
+   backspace                    delete the last character, and look
+				up the preedit again, as undo does
+   more INDEX                   select the candidate INDEX
+   choose INDEX                 learn the candidate INDEX of the last
+				lookup and commit it
+   commit                       learn the preedit and commit it
+   fini                         call "fini" for the input context
+
+   Empty lines and lines starting with "#" are ignored.  The latency
+   of each call is measured, and the percentiles of each kind of call
+   are printed as tab-separated values.  With -b, the replay fails if
+   the 99th percentile of the lookups is above BUDGET microseconds.  */
+
+#define MAX_CONTEXTS 16
+
+typedef MPlist *(*ModuleFunc) (MPlist *args);
+
+enum
+  {
+    OP_INIT,
+    OP_OPEN,
+    OP_LOOKUP,
+    OP_MORE,
+    OP_LEARN,
+    OP_FINI,
+    N_OPS
+  };
+
+static const char *op_names[N_OPS] =
+  { "init", "open", "lookup", "more", "learn", "fini" };
+
+struct _Samples {
+  double *data;
+  size_t n, n_allocated;
+};
+typedef struct _Samples Samples;
+
+struct _Replay {
+  ModuleFunc init, open, lookup, more, learn, fini;
+  MInputContext *contexts[MAX_CONTEXTS];
+  MPlist *candidates[MAX_CONTEXTS];	/* of the last lookup */
+  char keys[MAX_CONTEXTS][256];		/* typed since the last commit */
+  MInputContext *ic;
+  int cur;
+  Samples samples[N_OPS];
+};
+typedef struct _Replay Replay;
+
+static double
+now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void
+add_sample (Samples *samples, double usec)
+{
+  if (samples->n == samples->n_allocated)
+    {
+      size_t n_allocated = samples->n_allocated
+	? samples->n_allocated * 2 : 1024;
+      double *data = realloc (samples->data, sizeof (double) * n_allocated);
+
+      if (!data)
+	return;
+      samples->data = data;
+      samples->n_allocated = n_allocated;
+    }
+  samples->data[samples->n++] = usec;
+}
+
+/* Call FUNC with the input context of REPLAY followed by ARGS, and
+   record its latency as OP.  */
+static MPlist *
+call (Replay *replay, int op, ModuleFunc func, MPlist *args)
+{
+  MPlist *plist = mplist (), *result;
+  double start;
+
+  mplist_add (plist, Mt, replay->ic);
+  for (; args && mplist_key (args) != Mnil; args = mplist_next (args))
+    mplist_add (plist, mplist_key (args), mplist_value (args));
+
+  start = now ();
+  result = (*func) (plist);
+  add_sample (&replay->samples[op], now () - start);
+
+  m17n_object_unref (plist);
+  return result;
+}
+
+/* Keep the candidates added by the actions of a lookup or "more", as
+   a flat list.  */
+static void
+keep_candidates (Replay *replay, MPlist *actions)
+{
+  MPlist *p, *group, *candidates = NULL;
+
+  for (p = actions; p && mplist_key (p) != Mnil; p = mplist_next (p))
+    {
+      MPlist *groups = mplist_value (p);
+
+      if (mplist_key (p) != Mplist || mplist_key (groups) != Mplist)
+	continue;
+      candidates = mplist ();
+      for (; mplist_key (groups) != Mnil; groups = mplist_next (groups))
+	for (group = mplist_value (groups); mplist_key (group) != Mnil;
+	     group = mplist_next (group))
+	  mplist_add (candidates, Mtext, mplist_value (group));
+      break;
+    }
+
+  if (candidates || !actions)
+    {
+      if (replay->candidates[replay->cur])
+	m17n_object_unref (replay->candidates[replay->cur]);
+      replay->candidates[replay->cur] = candidates;
+    }
+}
+
+static void
+lookup (Replay *replay)
+{
+  MPlist *args = mplist (), *actions;
+
+  mplist_add (args, Msymbol, msymbol ("ascii"));
+  mplist_add (args, Msymbol, msymbol ("select"));
+  actions = call (replay, OP_LOOKUP, replay->lookup, args);
+  m17n_object_unref (args);
+  keep_candidates (replay, actions);
+  if (actions)
+    m17n_object_unref (actions);
+}
+
+static void
+set_preedit (Replay *replay, MText *mt)
+{
+  m17n_object_unref (replay->ic->preedit);
+  replay->ic->preedit = mt;
+}
+
+/* Set the preedit to the first LEN bytes of the typed keys, and look
+   it up.  */
+static void
+lookup_keys (Replay *replay, int len)
+{
+  set_preedit (replay, mtext_from_data (replay->keys[replay->cur], len,
+					MTEXT_FORMAT_UTF_8));
+  lookup (replay);
+}
+
+static void
+commit (Replay *replay)
+{
+  MPlist *actions = call (replay, OP_LEARN, replay->learn, NULL);
+
+  if (actions)
+    m17n_object_unref (actions);
+  set_preedit (replay, mtext ());
+  replay->keys[replay->cur][0] = '\0';
+  keep_candidates (replay, NULL);
+}
+
+/* Make the input context CUR current, creating it if it is new.  */
+static int
+switch_context (Replay *replay, int cur)
+{
+  MPlist *actions;
+
+  replay->cur = cur;
+  if (!replay->contexts[cur])
+    {
+      replay->contexts[cur] = calloc (1, sizeof (MInputContext));
+      if (!replay->contexts[cur])
+	return -1;
+      replay->contexts[cur]->plist = mplist ();
+      replay->contexts[cur]->preedit = mtext ();
+      replay->keys[cur][0] = '\0';
+      replay->ic = replay->contexts[cur];
+      actions = call (replay, OP_INIT, replay->init, NULL);
+      if (actions)
+	m17n_object_unref (actions);
+    }
+  replay->ic = replay->contexts[cur];
+  return 0;
+}
+
+static void
+fini_context (Replay *replay)
+{
+  MPlist *actions = call (replay, OP_FINI, replay->fini, NULL);
+
+  if (actions)
+    m17n_object_unref (actions);
+  keep_candidates (replay, NULL);
+  m17n_object_unref (replay->ic->plist);
+  m17n_object_unref (replay->ic->preedit);
+  free (replay->ic);
+  replay->contexts[replay->cur] = NULL;
+  replay->ic = NULL;
+}
+
+static int
+replay_line (Replay *replay, char *line, const char *file, int lineno)
+{
+  char *command, *arg;
+  MPlist *args, *actions;
+
+  command = strtok (line, " \t\n");
+  if (!command || *command == '#')
+    return 0;
+  arg = strtok (NULL, " \t\n");
+
+  if (strcmp (command, "ic") == 0 && arg)
+    {
+      int cur = atoi (arg);
+
+      if (cur < 0 || cur >= MAX_CONTEXTS)
+	goto error;
+      return switch_context (replay, cur);
+    }
+
+  if (!replay->ic && switch_context (replay, 0) < 0)
+    return -1;
+
+  if (strcmp (command, "open") == 0 && arg)
+    {
+      char *s = arg;
+      MText *mt;
+
+      /* a word followed by a number is an option, and by another word
+	 a table */
+      args = mplist ();
+      while (s)
+	{
+	  char *next;
+
+	  if (isdigit ((unsigned char) *s) || *s == '-')
+	    {
+	      mplist_add (args, Minteger, (void *) strtol (s, NULL, 10));
+	      s = strtok (NULL, " \t\n");
+	      continue;
+	    }
+	  mplist_add (args, Msymbol, msymbol (s));
+	  next = strtok (NULL, " \t\n");
+	  if (!next)
+	    {
+	      m17n_object_unref (args);
+	      goto error;
+	    }
+	  if (isdigit ((unsigned char) *next) || *next == '-')
+	    mplist_add (args, Minteger, (void *) strtol (next, NULL, 10));
+	  else
+	    {
+	      mt = mtext_from_data (next, strlen (next), MTEXT_FORMAT_UTF_8);
+	      mplist_add (args, Mtext, mt);
+	      m17n_object_unref (mt);
+	    }
+	  s = strtok (NULL, " \t\n");
+	}
+      actions = call (replay, OP_OPEN, replay->open, args);
+      m17n_object_unref (args);
+      if (actions)
+	m17n_object_unref (actions);
+    }
+  else if (strcmp (command, "type") == 0 && arg)
+    {
+      char *keys = replay->keys[replay->cur];
+      int len = strlen (keys), i;
+
+      if (len + strlen (arg) >= sizeof replay->keys[0])
+	goto error;
+      strcpy (keys + len, arg);
+      for (i = len + 1; keys[i - 1]; i++)
+	if ((keys[i] & 0xC0) != 0x80)
+	  lookup_keys (replay, i);
+    }
+  else if (strcmp (command, "backspace") == 0)
+    {
+      char *keys = replay->keys[replay->cur];
+      int len = strlen (keys), i;
+
+      if (len == 0)
+	return 0;
+      while (--len > 0 && (keys[len] & 0xC0) == 0x80)
+	;
+      keys[len] = '\0';
+
+      /* undo replays the keys which are left */
+      for (i = 1; i <= len; i++)
+	if ((keys[i] & 0xC0) != 0x80)
+	  lookup_keys (replay, i);
+      if (len == 0)
+	{
+	  set_preedit (replay, mtext ());
+	  keep_candidates (replay, NULL);
+	}
+    }
+  else if (strcmp (command, "more") == 0 && arg)
+    {
+      replay->ic->candidate_list = replay->candidates[replay->cur];
+      replay->ic->candidate_index = atoi (arg);
+      actions = call (replay, OP_MORE, replay->more, NULL);
+      if (actions)
+	{
+	  keep_candidates (replay, actions);
+	  m17n_object_unref (actions);
+	}
+    }
+  else if (strcmp (command, "choose") == 0 && arg)
+    {
+      MPlist *candidates = replay->candidates[replay->cur];
+      int i = atoi (arg);
+
+      for (; candidates && mplist_key (candidates) != Mnil && i > 0;
+	   candidates = mplist_next (candidates), i--)
+	;
+      if (candidates && mplist_key (candidates) == Mtext)
+	set_preedit (replay, mtext_dup (mplist_value (candidates)));
+      commit (replay);
+    }
+  else if (strcmp (command, "commit") == 0)
+    commit (replay);
+  else if (strcmp (command, "fini") == 0)
+    fini_context (replay);
+  else
+    goto error;
+  return 0;
+
+ error:
+  fprintf (stderr, "%s:%d: invalid line\n", file, lineno);
+  return -1;
+}
+
+static int
+cmp_samples (const void *a, const void *b)
+{
+  double da = *(const double *) a, db = *(const double *) b;
+
+  return da < db ? -1 : da > db;
+}
+
+/* Return the sample of SAMPLES at the percentile P, by nearest rank.  */
+static double
+percentile (const Samples *samples, double p)
+{
+  size_t rank = (size_t) (p / 100 * samples->n + 0.999999);
+
+  if (rank < 1)
+    rank = 1;
+  return samples->data[rank - 1];
+}
+
+static void
+usage (const char *program)
+{
+  fprintf (stderr, "Usage: %s [-r REPEAT] [-b BUDGET] MODULE TRACE...\n",
+	   program);
+  exit (1);
+}
+
+int
+main (int argc, char **argv)
+{
+  Replay replay;
+  void *module;
+  const char *program = argv[0];
+  int repeat = 1, i, r, status = 0;
+  double budget = 0;
+
+  for (; argc > 2 && argv[1][0] == '-'; argv += 2, argc -= 2)
+    if (strcmp (argv[1], "-r") == 0)
+      repeat = atoi (argv[2]);
+    else if (strcmp (argv[1], "-b") == 0)
+      budget = atof (argv[2]);
+    else
+      usage (program);
+  if (argc < 3 || repeat < 1 || budget < 0)
+    usage (program);
+
+  M17N_INIT ();
+  memset (&replay, 0, sizeof replay);
+
+  module = dlopen (argv[1], RTLD_NOW | RTLD_LOCAL);
+  if (!module)
+    {
+      fprintf (stderr, "%s\n", dlerror ());
+      return 1;
+    }
+  replay.init = (ModuleFunc) dlsym (module, "init");
+  replay.open = (ModuleFunc) dlsym (module, "open");
+  replay.lookup = (ModuleFunc) dlsym (module, "lookup");
+  replay.more = (ModuleFunc) dlsym (module, "more");
+  replay.learn = (ModuleFunc) dlsym (module, "learn");
+  replay.fini = (ModuleFunc) dlsym (module, "fini");
+  if (!replay.init || !replay.open || !replay.lookup || !replay.more
+      || !replay.learn || !replay.fini)
+    {
+      fprintf (stderr, "%s: not a libmimx-table module\n", argv[1]);
+      return 1;
+    }
+
+  for (r = 0; r < repeat && status == 0; r++)
+    for (i = 2; i < argc && status == 0; i++)
+      {
+	FILE *fp = fopen (argv[i], "r");
+	char line[1024];
+	int lineno = 0;
+
+	if (!fp)
+	  {
+	    perror (argv[i]);
+	    status = 1;
+	    break;
+	  }
+	while (status == 0 && fgets (line, sizeof line, fp))
+	  if (replay_line (&replay, line, argv[i], ++lineno) < 0)
+	    status = 1;
+	fclose (fp);
+
+	/* every trace starts with fresh input contexts */
+	for (replay.cur = 0; replay.cur < MAX_CONTEXTS; replay.cur++)
+	  if (replay.contexts[replay.cur])
+	    {
+	      replay.ic = replay.contexts[replay.cur];
+	      fini_context (&replay);
+	    }
+	replay.cur = 0;
+      }
+
+  printf ("op\tcount\tp50_us\tp90_us\tp99_us\tmax_us\n");
+  for (i = 0; i < N_OPS; i++)
+    {
+      Samples *samples = &replay.samples[i];
+
+      if (!samples->n)
+	continue;
+      qsort (samples->data, samples->n, sizeof (double), cmp_samples);
+      printf ("%s\t%zu\t%.1f\t%.1f\t%.1f\t%.1f\n", op_names[i], samples->n,
+	      percentile (samples, 50), percentile (samples, 90),
+	      percentile (samples, 99), samples->data[samples->n - 1]);
+      if (i == OP_LOOKUP && budget > 0
+	  && percentile (samples, 99) > budget)
+	{
+	  fprintf (stderr, "%s: p99 of lookups %.1f us over budget %.1f us\n",
+		   program, percentile (samples, 99), budget);
+	  status = 1;
+	}
+      free (samples->data);
+    }
+
+  M17N_FINI ();
+  return status;
+}
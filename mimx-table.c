@@ -28,15 +28,44 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#endif	/* HAVE_SYS_INOTIFY_H */
 
 #include <m17n.h>
 #include <sqlite3.h>
 
+#include "mimx-format.h"
+#include "mimx-match.h"
+
 #undef DEBUG
 #define MLEN 4		/* max key length */
 #define XLEN 2
 #define MAX_CANDIDATES 0	/* unlimited */
+#define PAGE_SIZE 10		/* candidates in a group */
+#define LOAD_WAIT 50		/* milliseconds to wait for a loading table */
+#define SCAN_THREADS 0		/* as many as the processors */
+#define MAX_SOURCES 8		/* tables merged in an input context */
+#define FUZZY 0			/* no fuzzy lookup */
+#define FUZZY_MAX_DISTANCE 2
+#define PREFETCH 0		/* no prefetch */
+#define PREFETCH_KEYS 8		/* next keys looked up ahead */
+
+#define DIM(x) (sizeof (x) / sizeof (*x))
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#define CLAMP(x, low, high)  (((x) > (high)) ? (high) : (((x) < (low)) ? (low) : (x)))
+#define ALIGN8(x) (((x) + 7) & ~(size_t) 7)
 
 static const struct {
   int c, n;
@@ -66,34 +95,276 @@ static const struct {
 static int phrase_enc_dict[128];
 static int phrase_dec_dict[128];
 
+typedef struct _Table Table;
 typedef struct _TableContext TableContext;
-typedef MPlist *(*TableFunc) (TableContext *context, MPlist *args);
 
+/* LOOKUP sets up the cursor of the context over the matches of the
+   preedit, and FETCH adds up to N of them (all if N is 0) to
+   CANDIDATES, returning how many were added.  */
 struct _TableDescription {
   const char *name;
-  TableFunc open;
-  TableFunc lookup;
+  int (*open) (Table *table);
+  void (*close) (Table *table);
+  int (*lookup) (TableContext *context);
+  int (*fetch) (TableContext *context, MPlist *candidates, int n);
 };
 typedef struct _TableDescription TableDescription;
 
+/* offsets of the entries of scim-tables whose keys have the same
+   length.  PREFIXES holds the prefix of each key, as mimx-match.h
+   tells, if the key index cannot be used.  */
 struct _TableOffsetArray {
   int cap, len;
   int *data;
+  uint64_t *prefixes;
 };
 typedef struct _TableOffsetArray TableOffsetArray;
 
-struct _TableContext {
+/* sorted index of scim-tables keys.  Each key is packed into N_WORDS
+   64-bit words, KEY_CODES_PER_WORD codes of KEY_CODE_BITS each from
+   the most significant bit, so that comparing words as integers
+   compares keys lexicographically.  Shorter keys are padded with 0,
+   which is not used as a code.  The word following the key holds the
+   offset of the entry in content.
+
+   The entries whose keys share the first D codes form a group, for D
+   up to POSTING_DEPTH.  POSTINGS[D - 1] lists the positions of each
+   group in the order of the candidates, and KMIN[D - 1] holds the
+   shortest key length of the group at the position where it starts,
+   so that looking up a short key, which matches many entries, does
+   not need to look at all of them.  */
+#define POSTING_DEPTH 2
+
+struct _TableKeyIndex {
+  int n_words;
+  int len;
+  uint64_t *data;
+  int *postings[POSTING_DEPTH];
+  unsigned char *kmin[POSTING_DEPTH];
+};
+typedef struct _TableKeyIndex TableKeyIndex;
+
+#define KEY_CODE_BITS 7
+#define KEY_CODE_MAX ((1 << KEY_CODE_BITS) - 1)
+#define KEY_CODES_PER_WORD (64 / KEY_CODE_BITS)
+
+/* prepared statement of a kind, keyed by the number of key columns
+   constrained and the positions of the single wildcards among them */
+enum _TableStatementKind {
+  LOOKUP_STATEMENT,
+  LEARNED_LOOKUP_STATEMENT,
+  MIN_MLEN_STATEMENT,
+  ROWS_STATEMENT
+};
+typedef enum _TableStatementKind TableStatementKind;
+
+struct _TableStatement {
+  TableStatementKind kind;
+  int len;
+  uint64_t wildcards;
+  sqlite3_stmt *stmt;
+};
+typedef struct _TableStatement TableStatement;
+
+struct _TableStatementCache {
+  TableStatement *stmts;
+  int n_stmts, n_allocated_stmts;
+};
+typedef struct _TableStatementCache TableStatementCache;
+
+/* M-texts of the phrases recently added to the candidates, keyed by
+   the id of the row (ibus-table) or the offset of the entry in content
+   (scim-tables).  The cache is direct-mapped: a phrase replaces the
+   one in its slot.  */
+#define PHRASE_CACHE_BITS 12
+#define PHRASE_CACHE_SIZE (1 << PHRASE_CACHE_BITS)
+
+struct _TablePhrase {
+  int key;
+  MText *mt;
+};
+typedef struct _TablePhrase TablePhrase;
+
+/* the candidates of a lookup, kept in a cache shared by all the input
+   contexts and keyed by the serials of the tables, the preedit, xlen,
+   max_candidates, the fuzzy distance and the wildcards.  The least
+   recently used results are dropped once the cache holds more than
+   RESULT_CACHE_MAX_CANDIDATES candidates.  */
+#define RESULT_CACHE_BUCKETS 512
+#define RESULT_CACHE_MAX_CANDIDATES 32768
+
+typedef struct _TableResult TableResult;
+struct _TableResult {
+  unsigned int serials[MAX_SOURCES];	/* of the tables looked up */
+  int n_serials;
+  int xlen, max_candidates, fuzzy;
+  int single_wildcard, multi_wildcard;
+  char *key;
+  int len;
+  uint64_t hash;
+  MPlist *candidates;
+  int n;
+  TableResult *next;		/* in the bucket */
+  TableResult *lru_prev, *lru_next;
+};
+
+struct _TableResultCache {
+  TableResult *buckets[RESULT_CACHE_BUCKETS];
+  TableResult *lru_head, *lru_tail;	/* the most recently used first */
+  int n_candidates;
+  unsigned long hits, misses;
+};
+typedef struct _TableResultCache TableResultCache;
+
+/* how many times the user has chosen each phrase of a table, kept in
+   memory and appended to a log under $XDG_DATA_HOME/mimx-table, named
+   after the hash of the table's canonical path.  A line of the log is
+   a count and a phrase, separated by a tab.  The log is compacted into
+   a line per phrase when the table is loaded.  */
+#define LEARN_BUCKETS 1024
+
+typedef struct _TableLearned TableLearned;
+struct _TableLearned {
+  TableLearned *next;
+  int count;
+  int len;
+  char phrase[];
+};
+
+/* The choices are written by a thread in batches of LEARN_FLUSH_BATCH,
+   or LEARN_FLUSH_INTERVAL seconds after it has seen the first of
+   them, so that the input contexts never wait for the disk.  */
+#define LEARN_FLUSH_BATCH 16
+#define LEARN_FLUSH_INTERVAL 2
+
+typedef struct _LearnRecord LearnRecord;
+struct _LearnRecord {
+  LearnRecord *next;
+  char *log;
+  int len;
+  char phrase[];
+};
+
+struct _LearnFlusher {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+
+  /* held along with the lock of a log, which only locks it against
+     the other processes */
+  pthread_mutex_t log_mutex;
+
+  pthread_t thread;
+  int running, stop;
+  LearnRecord *head, **tail;
+  int n_pending;
+};
+typedef struct _LearnFlusher LearnFlusher;
+
+/* The files of the tables are watched by a thread, which marks a
+   table CHANGED when its file is written or renamed over.  It watches
+   the directory of the file, so that a file replaced by a new one is
+   still seen, and an event on WAKE stops it.  */
+typedef struct _TableWatch TableWatch;
+struct _TableWatch {
+  TableWatch *next;
+  Table *table;
+  int wd;
+};
+
+struct _TableWatcher {
+  pthread_mutex_t mutex;
+  pthread_t thread;
+  int running;
+  int fd;
+  int wake;
+  TableWatch *watches;
+};
+typedef struct _TableWatcher TableWatcher;
+
+/* The prefetch thread looks up ahead for one input context at a time,
+   BUSY, and then PENDING, for the preedit KEY of LEN bytes which
+   PENDING has looked up last.  A lookup sets CANCELLED, which the
+   thread checks between the keys it looks up.  */
+struct _TablePrefetcher {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  pthread_t thread;
+  int running, stop;
+  TableContext *pending, *busy;
+  unsigned char key[256];
+  int len;
+  int cancelled;
+};
+typedef struct _TablePrefetcher TablePrefetcher;
+
+/* counters of the lookups of a table or an input context, collected
+   when MIMX_TABLE_STATS is set in the environment or once "stats" has
+   been called.  NS is the time spent in each phase, in nanoseconds;
+   the phases before STATS_LOOKUP are parts of the lookups and of
+   "more".  */
+enum
+  {
+    STATS_PREPARE,		/* preparing SQL statements */
+    STATS_STEP,			/* stepping SQL statements */
+    STATS_SCAN,			/* searching and scanning the entries */
+    STATS_SORT,			/* sorting the matches */
+    STATS_DECODE,		/* making M-texts of the phrases */
+    STATS_PAGINATE,		/* grouping the candidates */
+    STATS_LOOKUP,		/* the whole of lookup */
+    STATS_MORE,			/* the whole of more */
+    N_STATS_PHASES
+  };
+
+struct _TableStats {
+  uint64_t lookups;
+  uint64_t cache_hits;		/* lookups answered by the result cache */
+  uint64_t prefetch_hits;	/* lookups answered by a prefetch */
+  uint64_t queries;		/* SQL statements run, as widening */
+  uint64_t rows;		/* ibus-table rows stepped or narrowed */
+  uint64_t entries;		/* scim-tables and mimx entries looked at */
+  uint64_t candidates;		/* candidates returned */
+  uint64_t evictions;		/* tables evicted over the memory budget */
+  uint64_t ns[N_STATS_PHASES];
+};
+typedef struct _TableStats TableStats;
+
+/* options of a table given to open */
+#define TABLE_MEMORY 0x1	/* ibus-table: mirror the database in memory */
+
+/* status of a table, which is loaded on a worker thread, and loaded
+   again if it has been evicted to keep the memory under the budget */
+enum
+  {
+    TABLE_LOADING,
+    TABLE_READY,
+    TABLE_FAILED,
+    TABLE_EVICTED
+  };
+
+/* an opened table, shared among the input contexts which use the
+   same file with the same backend and options */
+struct _Table {
   const TableDescription *desc;
-  MInputContext *ic;
-  MConverter *converter;
+  char *file;			/* canonical path */
+  int flags;
+  int refcount;
+  unsigned int serial;		/* unique among the tables ever opened */
+  Table *next;
 
   int mlen;
-  int xlen;
-  int max_candidates;
+  int single_wildcard, multi_wildcard;
+  TablePhrase *phrases;
+
+  /* the counts of the phrases chosen by the user, and their log.
+     LEARN_SERIAL counts the choices made since the table was opened.  */
+  TableLearned **learned;
+  int n_learned;
+  char *learn_log;
+  unsigned int learn_serial;
 
   /* ibus-table */
-  char *file;
   sqlite3 *db;
+  TableStatementCache stmts;
 
   /* scim-tables */
   FILE *fp;
@@ -102,22 +373,451 @@ struct _TableContext {
   unsigned char *content;
   int content_size;
   TableOffsetArray *offsets;
+  TableKeyIndex index;
+
+  /* index cache file mapped in place of offsets and index, and
+     whether it has been found corrupt and removed */
+  void *index_mem;
+  size_t index_memlen;
+  int index_dropped;
+
+  /* mimx: the parts of the file mapped at mem */
+  const MimxHeader *mimx;
+  const uint32_t *mimx_blocks;
+  const unsigned char *mimx_keys;
+  const MimxEntry *mimx_entries;
+  const unsigned char *mimx_pool;
+
+  /* the worker thread running the open function of DESC, until it is
+     joined.  It sets STATUS with MUTEX held and broadcasts COND; the
+     input contexts do not use the other fields until they see
+     TABLE_READY.  CANCELLED asks the open function to give up.  */
+  pthread_t loader;
+  int has_loader;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int status;
+  int cancelled;
+
+  /* CHANGED is set by the watcher thread when the file has changed.
+     The table is then loaded again into RELOAD, which takes its place
+     once it is ready: the input contexts move to it at their next
+     lookup, and this one is released when the last has left it.  */
+  int changed;
+  Table *reload;
+
+  /* the value of the lookup clock at the last lookup in the table,
+     by which the idle tables are evicted first, and the bytes it
+     adds to the memory of the tables outside SQLite: those of its
+     files and index once it is loaded, and those of its phrase cache
+     once it is allocated */
+  unsigned long used;
+  size_t memory;
+
+  TableStats stats;
+};
+
+/* a row of an ibus-table lookup kept for narrowing, with the times
+   the user had chosen it then; CODES holds the mlen key codes,
+   followed by the NUL-terminated PHRASE */
+struct _TableRow {
+  int id, mlen, count, user_freq, freq;
+  unsigned char *codes;
+  char *phrase;
+};
+typedef struct _TableRow TableRow;
+
+/* a node of the sorted keys of a table walked as a trie: the range
+   [LO, HI) of the keys which share their first DEPTH bytes */
+struct _TableNode {
+  int depth, lo, hi;
+};
+typedef struct _TableNode TableNode;
+
+/* the result of a lookup for KEY, kept so that the lookup for a key
+   extending it only needs to narrow it down */
+struct _TableState {
+  char *key;
+  int len;
+
+  /* scim-tables and mimx: range of the key index, or for a key with
+     wildcards, the nodes matching it and whether a multi wildcard
+     ends it */
+  int lo, hi;
+  TableNode *nodes;
+  int n_nodes, any;
+
+  /* ibus-table: positions in the rows of the context */
+  int *rows;
+  int n_rows;
+};
+typedef struct _TableState TableState;
+
+#define MAX_STATES 16
+#define MAX_STATE_ROWS 128
+#define MIN_STATE_LEN 2
+
+/* the matches of the last lookup which have not been added to the
+   candidates yet.  REMAINING is the number of candidates which may
+   still be added, or -1 if unlimited.  */
+struct _TableCursor {
+  int remaining;
+  int pos, end;
+
+  /* scim-tables: the selected entries at OFFSETS in the arena, or the
+     entries at POSTINGS whose keys are at most KMAX long */
+  int *offsets;
+  const int *postings;
+  int kmax;
+
+  /* ibus-table: the rows at POSITIONS whose mlen is less than BOUND,
+     or the rows of STMT, positioned on a row if HAS_ROW, of which
+     N_STEPPED have been stepped */
+  const int *positions;
+  int bound;
+  sqlite3_stmt *stmt;
+  int has_row, n_stepped;
+
+  /* the last candidate added: the length of its key, its frequency,
+     the times the user has chosen it and the hash of its text, by
+     which the candidates of several tables are merged */
+  int mlen, freq, count;
+  uint64_t hash;
+};
+typedef struct _TableCursor TableCursor;
+
+/* the matches of a lookup made ahead for KEY, after a lookup for its
+   prefix, in the table of SERIAL.  OFFSETS holds those of the cursor,
+   which are copied to the arena of the lookup which takes them.  */
+struct _TablePrefetched {
+  char key[256];
+  int len;
+  unsigned int serial;
+  TableCursor cursor;
+  int *offsets;
+};
+typedef struct _TablePrefetched TablePrefetched;
+
+/* a candidate of a table merged with others, with what it is ranked
+   by: the length of its key, the times the user has chosen it and its
+   frequency, then the order of the tables and the order in which the
+   candidates were taken from them */
+struct _TableMerged {
+  MText *mt;
+  int count, freq, mlen;
+  int source, pos;
+};
+typedef struct _TableMerged TableMerged;
+
+/* a candidate added by a fetch, whose M-text is made at the end of
+   the fetch: MT if the phrase cache has it, or else from the SIZE
+   bytes at START in the pending texts of the context */
+struct _TablePending {
+  int key;
+  MText *mt;
+  size_t start, size;
+};
+typedef struct _TablePending TablePending;
+
+/* the texts of the candidates merged from several tables, to drop the
+   duplicates; an open-addressing set in the arena */
+struct _TableSeen {
+  uint64_t hash;
+  MText *mt;
+};
+typedef struct _TableSeen TableSeen;
+
+/* the counts of the phrases which the user has chosen among the
+   matches of a lookup, in LEARNED, as they are selected: an
+   open-addressing set in the arena of the offsets of the entries with
+   a count, shared by the copies of the selection */
+struct _TableChosen {
+  Table *learned;
+  int *offsets, *counts;
+  int n, n_allocated;
+};
+typedef struct _TableChosen TableChosen;
+
+/* scratch memory of a lookup, released all at once when the next
+   lookup starts.  If a lookup needs more than the current chunk, new
+   chunks are chained in front of it, and they are merged into one on
+   reset, so that once the chunk has grown to the working set of the
+   lookups, they do not allocate any more.  USED counts the bytes
+   handed out since the reset, and LAST is the last allocation, which
+   can grow in place.  */
+#define ARENA_CHUNK_SIZE 4096
+#define ARENA_MAX_CHUNK_SIZE (1 << 20)
+
+struct _TableArenaChunk {
+  struct _TableArenaChunk *next;
+  size_t size, used;
+  uint64_t data[];
+};
+typedef struct _TableArenaChunk TableArenaChunk;
+
+struct _TableArena {
+  TableArenaChunk *chunks;
+  size_t used;
+  void *last;
+};
+typedef struct _TableArena TableArena;
+
+struct _TableContext {
+  MInputContext *ic;
+  MConverter *converter;
+  Table *table;
+
+  int xlen;
+  int max_candidates;
+  int paging;
+  int load_wait;
+  int scan_threads;
+  int fuzzy;
+  int single_wildcard, multi_wildcard;
+
+  /* with a budget of PREFETCH microseconds of CPU time, the keys
+     which likely follow the preedit are looked up ahead in SHADOW on
+     the prefetch thread, and their matches kept in PREFETCHED, which
+     only that thread and the lookups touch, with its mutex held.
+     SHADOW has no input context, and looks up KEY instead of the
+     preedit, without counting it.  */
+  int prefetch;
+  TableContext *shadow;
+  TablePrefetched *prefetched;
+  int n_prefetched;
+  int speculative;
+  unsigned char key[256];
+  int key_len;
+
+  /* the candidates added by the current fetch, and the texts of those
+     which the phrase cache does not have, copied one after another so
+     that they are checked as UTF-8 at once */
+  TablePending *pending;
+  int n_pending, n_allocated_pending;
+  unsigned char *pending_text;
+  size_t pending_size, allocated_pending_text;
+
+  /* statements stepped by the cursor, which are not shared with the
+     other contexts */
+  TableStatementCache stmts;
+  TableCursor cursor;
+  TableArena arena;
+
+  /* in the paging mode, the candidates added so far, preceded by the
+     preedit */
+  MPlist *candidates;
+
+  /* states of the preceding lookups, from the shortest key */
+  TableState states[MAX_STATES];
+  int n_states;
+  TableRow *rows;
+  int n_rows;
+
+  /* the serial and the learn_serial of the table whose choices ranked
+     the rows when they were kept, which sort them again once the user
+     has chosen another phrase */
+  unsigned int rows_serial, rows_learn_serial;
+
+  /* ibus-table: the key of the last lookup which queried the
+     candidates, if QUERIED_LEN is not 0, and the number of candidates
+     stepped if they have run dry or are more than MAX_STATE_ROWS, or
+     else -1, by which the next lookup guesses whether the rows of a
+     key extending it are few enough to be kept for narrowing */
+  unsigned char queried[256];
+  int queried_len, queried_rows;
+
+  /* when open is given several tables, each has a context of its own
+     in SOURCES, chained by NEXT, whose PARENT is this one.  TABLE is
+     then the first of them, in which the choices are learned, and the
+     cursor of this context walks the candidates merged from the
+     sources in MERGED, which holds a reference to each of their
+     M-texts.  READY tells whether the table of a source was ready for
+     the last lookup.  */
+  TableContext *sources;
+  TableContext *next;
+  TableContext *parent;
+  int ready;
+  TableMerged *merged;
+  TableSeen *seen;
+  int n_seen, n_allocated_seen;
+
+  /* the input contexts are chained from CONTEXTS, so that a table
+     evicted from memory can be dropped from all of those using it */
+  TableContext *next_context;
+
+  TableStats stats;
 };
 
-static MPlist *open_ibus (TableContext *context, MPlist *args);
-static MPlist *lookup_ibus (TableContext *context, MPlist *args);
-static MPlist *open_scim (TableContext *context, MPlist *args);
-static MPlist *lookup_scim (TableContext *context, MPlist *args);
+static int open_ibus (Table *table);
+static void close_ibus (Table *table);
+static int lookup_ibus (TableContext *context);
+static int fetch_ibus (TableContext *context, MPlist *candidates, int n);
+static int open_scim (Table *table);
+static void close_scim (Table *table);
+static int lookup_scim (TableContext *context);
+static int fetch_scim (TableContext *context, MPlist *candidates, int n);
+static int open_mimx (Table *table);
+static void close_mimx (Table *table);
+static int lookup_mimx (TableContext *context);
+static int fetch_mimx (TableContext *context, MPlist *candidates, int n);
+static int wait_table (Table *table, long timeout);
+static void release_table (Table *table);
+static void purge_results (unsigned int serial);
+static int learned_count (Table *table, const unsigned char *phrase, int len);
+static void stop_learn_flusher (void);
+static void stop_table_watcher (void);
+static void stop_prefetcher (void);
+static void stop_prefetch (TableContext *context);
+static void stop_scan_pool (void);
+static void clear_states (TableContext *context);
+static void free_context (TableContext *context);
 
 static const TableDescription table_descriptions[] =
   {
-    { "ibus", open_ibus, lookup_ibus },
-    { "scim", open_scim, lookup_scim }
+    { "ibus", open_ibus, close_ibus, lookup_ibus, fetch_ibus },
+    { "scim", open_scim, close_scim, lookup_scim, fetch_scim },
+    { "mimx", open_mimx, close_mimx, lookup_mimx, fetch_mimx }
+  };
+
+/* tables opened in this process */
+static Table *tables;
+static unsigned int table_serial;
+static TableContext *contexts;
+
+/* the bytes which the tables may use, from MIMX_TABLE_MEMORY in
+   kilobytes, or 0 if unlimited, the bytes used by the tables which
+   are ready outside SQLite, and the clock counting the lookups */
+static size_t memory_budget;
+static size_t tables_memory;
+static unsigned long lookup_clock;
+
+static TableResultCache result_cache;
+
+static LearnFlusher learn_flusher =
+  {
+    PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+    PTHREAD_MUTEX_INITIALIZER
+  };
+
+static TablePrefetcher table_prefetcher =
+  {
+    PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_COND_INITIALIZER
+  };
+
+#ifdef HAVE_SYS_INOTIFY_H
+static TableWatcher table_watcher =
+  {
+    PTHREAD_MUTEX_INITIALIZER
+  };
+#endif	/* HAVE_SYS_INOTIFY_H */
+
+/* whether the counters are collected, and where they are written:
+   stderr if STATS_FILE is NULL */
+static int stats_enabled;
+static const char *stats_file;
+
+static const char *stats_phase_names[N_STATS_PHASES] =
+  {
+    "prepare", "step", "scan", "sort", "decode", "paginate", "lookup", "more"
   };
 
+/* Add N to the counter FIELD of CONTEXT and of its table.  When the
+   counters are not collected, this and the timers below cost a
+   branch.  */
+#define STATS_ADD(context, field, n)				\
+  do								\
+    {								\
+      if (__builtin_expect (stats_enabled, 0)			\
+	  && !(context)->speculative)				\
+	{							\
+	  (context)->stats.field += (n);			\
+	  if ((context)->table)					\
+	    (context)->table->stats.field += (n);		\
+	}							\
+    }								\
+  while (0)
+
+/* Start a timer in START, and add the time since to the phase PHASE
+   of CONTEXT.  */
+#define STATS_START(start)					\
+  ((start) = __builtin_expect (stats_enabled, 0) ? clock_ns () : 0)
+#define STATS_STOP(context, phase, start)			\
+  do								\
+    {								\
+      if (__builtin_expect (stats_enabled, 0))			\
+	{							\
+	  uint64_t stats_ns = clock_ns () - (start);		\
+								\
+	  STATS_ADD (context, ns[phase], stats_ns);		\
+	}							\
+    }								\
+  while (0)
+
+static uint64_t
+clock_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* the CPU time of the calling thread, in nanoseconds */
+static uint64_t
+thread_cpu_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Write STATS of SCOPE, an input context or a table using TABLE, as a
+   line of NAME=VALUE to the file of MIMX_TABLE_STATS.  */
+static void
+write_stats (const char *scope, const Table *table, const TableStats *stats)
+{
+  FILE *fp = stats_file ? fopen (stats_file, "a") : stderr;
+  int i;
+
+  if (!fp)
+    return;
+  fprintf (fp, "mimx-table: %s %s %s lookups=%llu cache_hits=%llu"
+	   " prefetch_hits=%llu queries=%llu rows=%llu entries=%llu"
+	   " candidates=%llu evictions=%llu",
+	   scope, table ? table->desc->name : "-", table ? table->file : "-",
+	   (unsigned long long) stats->lookups,
+	   (unsigned long long) stats->cache_hits,
+	   (unsigned long long) stats->prefetch_hits,
+	   (unsigned long long) stats->queries,
+	   (unsigned long long) stats->rows,
+	   (unsigned long long) stats->entries,
+	   (unsigned long long) stats->candidates,
+	   (unsigned long long) stats->evictions);
+  for (i = 0; i < N_STATS_PHASES; i++)
+    fprintf (fp, " %s_ns=%llu", stats_phase_names[i],
+	     (unsigned long long) stats->ns[i]);
+  fputc ('\n', fp);
+  if (fp != stderr)
+    fclose (fp);
+}
+
+/* Return 1 if the loading of TABLE is cancelled.  The open functions
+   check this between their steps.  */
+static int
+table_cancelled (Table *table)
+{
+  return __atomic_load_n (&table->cancelled, __ATOMIC_RELAXED);
+}
+
 static MSymbol Mtable, Mibus, Mscim;
 static int initialized = 0;
 
+/* the kernel comparing key prefixes which the processor supports */
+static MimxMatchFunc match_prefixes;
+
 static void
 init_phrase_dict (void)
 {
@@ -134,31 +834,174 @@ init_phrase_dict (void)
     }
 }
 
-static int
-encode_phrase (const unsigned char *phrase, int **m)
+static void *
+arena_alloc (TableArena *arena, size_t size)
 {
-  const unsigned char *p;
+  TableArenaChunk *chunk = arena->chunks;
+  void *p;
 
-  if (m)
+  size = ALIGN8 (size);
+  if (!chunk || chunk->size - chunk->used < size)
     {
-      *m = calloc (sizeof (int), strlen ((const char *)phrase));
-      if (!*m)
-	return -1;
+      size_t chunk_size = chunk ? chunk->size * 2 : ARENA_CHUNK_SIZE;
+
+      chunk_size = MAX(chunk_size, size);
+      chunk = malloc (sizeof (TableArenaChunk) + chunk_size);
+      if (!chunk)
+	return NULL;
+      chunk->size = chunk_size;
+      chunk->used = 0;
+      chunk->next = arena->chunks;
+      arena->chunks = chunk;
     }
+  p = (char *) chunk->data + chunk->used;
+  chunk->used += size;
+  arena->used += size;
+  arena->last = p;
+  return p;
+}
 
-  for (p = phrase; *p != '\0'; p++)
+/* Resize PTR, allocated from ARENA with OLD_SIZE bytes, to SIZE bytes.
+   The last allocation grows in place if the chunk has room.  */
+static void *
+arena_realloc (TableArena *arena, void *ptr, size_t old_size, size_t size)
+{
+  TableArenaChunk *chunk = arena->chunks;
+  void *p;
+
+  if (ptr && ptr == arena->last
+      && (char *) ptr + ALIGN8 (size) <= (char *) chunk->data + chunk->size)
     {
-      if (*p >= 128 || phrase_enc_dict[(int)*p] == -1)
+      chunk->used = (char *) ptr - (char *) chunk->data + ALIGN8 (size);
+      arena->used += ALIGN8 (size) - ALIGN8 (old_size);
+      return ptr;
+    }
+
+  p = arena_alloc (arena, size);
+  if (p && ptr)
+    memcpy (p, ptr, MIN(old_size, size));
+  return p;
+}
+
+static void
+arena_free (TableArena *arena)
+{
+  while (arena->chunks)
+    {
+      TableArenaChunk *chunk = arena->chunks;
+
+      arena->chunks = chunk->next;
+      free (chunk);
+    }
+  arena->used = 0;
+  arena->last = NULL;
+}
+
+static void
+arena_reset (TableArena *arena)
+{
+  TableArenaChunk *chunk = arena->chunks;
+
+  if (chunk && chunk->next)
+    {
+      size_t size = 0;
+
+      for (; chunk; chunk = chunk->next)
+	size += chunk->size;
+      arena_free (arena);
+      size = MIN(size, ARENA_MAX_CHUNK_SIZE);
+      chunk = malloc (sizeof (TableArenaChunk) + size);
+      if (chunk)
 	{
-	  free (*m);
-	  return -1;
+	  chunk->size = size;
+	  chunk->next = NULL;
 	}
+      arena->chunks = chunk;
+    }
+  if (chunk)
+    chunk->used = 0;
+  arena->used = 0;
+  arena->last = NULL;
+}
+
+static int
+encode_phrase (TableArena *arena, const unsigned char *phrase, int **m)
+{
+  const unsigned char *p;
+
+  *m = arena_alloc (arena, sizeof (int) * strlen ((const char *)phrase));
+  if (!*m)
+    return -1;
+
+  for (p = phrase; *p != '\0'; p++)
+    {
+      if (*p >= 128 || phrase_enc_dict[(int)*p] == -1)
+	return -1;
       (*m)[p - phrase] = phrase_enc_dict[(int)*p];
     }
 
   return 0;
 }
 
+/* the codes of the single and multi wildcards in a key */
+#define WILDCARD_ONE -1
+#define WILDCARD_ANY -2
+
+/* Return the wildcard which the byte C of a key is in CONTEXT, or
+   0.  */
+static int
+wildcard (TableContext *context, int c)
+{
+  Table *table = context->table;
+
+  if (c == (context->single_wildcard ? context->single_wildcard
+	    : table->single_wildcard))
+    return WILDCARD_ONE;
+  if (c == (context->multi_wildcard ? context->multi_wildcard
+	    : table->multi_wildcard))
+    return WILDCARD_ANY;
+  return 0;
+}
+
+/* Set *PATTERN to the LEN bytes of KEY, or their codes if CODES, with
+   the wildcards replaced by WILDCARD_ONE and WILDCARD_ANY.  The multi
+   wildcards at the end are dropped, as a lookup matches the keys which
+   start with the rest.  Return the length of the pattern, 0 if KEY has
+   no wildcard, or -1 if it has nothing else or a byte no key has.  */
+static int
+encode_pattern (TableContext *context, const unsigned char *key, int len,
+		int codes, int **pattern)
+{
+  int i, n_codes = 0;
+
+  for (i = 0; i < len && !wildcard (context, key[i]); i++)
+    ;
+  if (i == len)
+    return 0;
+
+  *pattern = arena_alloc (&context->arena, sizeof (int) * (len + 1));
+  if (!*pattern)
+    return -1;
+  for (i = 0; i < len; i++)
+    {
+      int c = wildcard (context, key[i]);
+
+      if (!c)
+	{
+	  if (key[i] >= 128 || phrase_enc_dict[key[i]] <= 0)
+	    return -1;
+	  c = codes ? phrase_enc_dict[key[i]] : key[i];
+	  n_codes++;
+	}
+      (*pattern)[i] = c;
+    }
+  if (!n_codes)
+    return -1;
+  while ((*pattern)[len - 1] == WILDCARD_ANY)
+    len--;
+  return len;
+}
+
 #if 0
 static int
 decode_phrase (const int *m, size_t mlen, unsigned char **phrase)
@@ -216,67 +1059,317 @@ get_context (MInputContext *ic)
   return NULL;
 }
 
-MPlist *
-init (MPlist *args)
+static void
+finalize_statements (TableStatementCache *cache)
 {
-  MInputContext *ic = mplist_value (args);
-  TableContext *context;
-
-  fflush (stderr);
-  if (! initialized++)
-    {
-      init_phrase_dict ();
-      Mtable = msymbol (" table");
-      Mibus = msymbol ("ibus");
-      Mscim = msymbol ("scim");
-    }
-
-  context = calloc (sizeof (TableContext), 1);
-  context->ic = ic;
-  context->converter = mconv_buffer_converter (Mcoding_utf_8, NULL, 0);
+  int i;
 
-  if (context)
-    mplist_push (ic->plist, Mtable, context);
-  return NULL;
+  for (i = 0; i < cache->n_stmts; i++)
+    sqlite3_finalize (cache->stmts[i].stmt);
+  free (cache->stmts);
+  memset (cache, 0, sizeof *cache);
 }
 
-MPlist *
-fini (MPlist *args)
+static void
+clear_cursor (TableContext *context)
 {
-  MInputContext *ic = mplist_value (args);
-  TableContext *context = get_context (ic);
+  TableCursor *cursor = &context->cursor;
+  TableContext *source;
 
-  if (context)
+  int i;
+
+  if (cursor->stmt)
+    sqlite3_reset (cursor->stmt);
+  for (i = 0; context->merged && i < cursor->end; i++)
+    m17n_object_unref (context->merged[i].mt);
+  context->merged = NULL;
+  memset (cursor, 0, sizeof *cursor);
+
+  if (context->candidates)
     {
-      if (context->db)
-	sqlite3_close (context->db);
-      mconv_free_converter (context->converter);
-      if (context->mem)
-	munmap (context->mem, context->memlen);
-      if (context->fp)
-	{
-	  fclose (context->fp);
-	  context->fp = NULL;
-	}
-      free (context->file);
-      free (context);
+      m17n_object_unref (context->candidates);
+      context->candidates = NULL;
     }
-  return NULL;
+
+  for (source = context->sources; source; source = source->next)
+    clear_cursor (source);
+  context->seen = NULL;
+  context->n_seen = context->n_allocated_seen = 0;
 }
 
-static MText *
-mtext_from_utf8 (TableContext *context, const unsigned char *buf, size_t size)
+/* Return 1 if the cursor of CONTEXT has no more matches, nor the
+   cursors of its sources.  */
+static int
+cursor_done (TableContext *context)
 {
-  mconv_reset_converter (context->converter);
-  mconv_rebind_buffer (context->converter, buf, size);
-  return mconv_decode (context->converter, mtext ());
+  TableCursor *cursor = &context->cursor;
+  TableContext *source;
+
+  if (cursor->remaining != 0)
+    for (source = context->sources; source; source = source->next)
+      if (!cursor_done (source))
+	return 0;
+  return (cursor->pos == cursor->end || cursor->remaining == 0)
+    && !cursor->has_row;
 }
 
-static ssize_t
-mtext_to_utf8 (TableContext *context, MText *mt, unsigned char *buf,
-	       size_t size)
+static void
+free_state (TableState *state)
 {
-  ssize_t nbytes;
+  free (state->key);
+  free (state->rows);
+  free (state->nodes);
+  memset (state, 0, sizeof *state);
+}
+
+static void
+clear_states (TableContext *context)
+{
+  int i;
+
+  for (i = 0; i < context->n_states; i++)
+    free_state (&context->states[i]);
+  context->n_states = 0;
+
+  free (context->rows);
+  context->rows = NULL;
+  context->n_rows = 0;
+  context->queried_len = 0;
+}
+
+/* Drop the states whose key is not a prefix of KEY, and return the
+   innermost remaining one, if any.  */
+static TableState *
+find_state (TableContext *context, const char *key, int len)
+{
+  while (context->n_states > 0)
+    {
+      TableState *state = &context->states[context->n_states - 1];
+
+      if (state->len <= len && memcmp (state->key, key, state->len) == 0)
+	return state;
+      free_state (state);
+      context->n_states--;
+    }
+  return NULL;
+}
+
+static TableState *
+push_state (TableContext *context, const char *key, int len)
+{
+  TableState *state;
+
+  if (context->n_states == MAX_STATES)
+    {
+      free_state (&context->states[0]);
+      memmove (&context->states[0], &context->states[1],
+	       sizeof (TableState) * (MAX_STATES - 1));
+      context->n_states--;
+    }
+
+  state = &context->states[context->n_states];
+  memset (state, 0, sizeof *state);
+  state->key = malloc (len + 1);
+  if (!state->key)
+    return NULL;
+  memcpy (state->key, key, len);
+  state->len = len;
+  context->n_states++;
+  return state;
+}
+
+static TableContext *
+make_context (MInputContext *ic)
+{
+  TableContext *context = calloc (sizeof (TableContext), 1);
+
+  if (!context)
+    return NULL;
+  context->ic = ic;
+  context->converter = mconv_buffer_converter (Mcoding_utf_8, NULL, 0);
+  return context;
+}
+
+static void
+free_sources (TableContext *context)
+{
+  while (context->sources)
+    {
+      TableContext *source = context->sources;
+
+      context->sources = source->next;
+      free_context (source);
+    }
+}
+
+static void
+free_context (TableContext *context)
+{
+  stop_prefetch (context);
+  if (stats_enabled && !context->speculative)
+    write_stats (context->parent ? "source" : "context", context->table,
+		 &context->stats);
+  clear_cursor (context);
+  free_sources (context);
+  clear_states (context);
+  finalize_statements (&context->stmts);
+  arena_free (&context->arena);
+  free (context->pending);
+  free (context->pending_text);
+  if (context->table)
+    release_table (context->table);
+  mconv_free_converter (context->converter);
+  free (context);
+}
+
+MPlist *
+init (MPlist *args)
+{
+  MInputContext *ic = mplist_value (args);
+  TableContext *context;
+
+  fflush (stderr);
+  if (! initialized++)
+    {
+      init_phrase_dict ();
+      match_prefixes = mimx_match_select ();
+      stats_file = getenv ("MIMX_TABLE_STATS");
+      stats_enabled = stats_file != NULL;
+      if (stats_file && (!*stats_file || strcmp (stats_file, "-") == 0))
+	stats_file = NULL;
+      if (getenv ("MIMX_TABLE_MEMORY"))
+	memory_budget = strtoul (getenv ("MIMX_TABLE_MEMORY"), NULL, 10)
+	  * (size_t) 1024;
+      Mtable = msymbol (" table");
+      Mibus = msymbol ("ibus");
+      Mscim = msymbol ("scim");
+    }
+
+  context = make_context (ic);
+  if (context)
+    {
+      mplist_push (ic->plist, Mtable, context);
+      context->next_context = contexts;
+      contexts = context;
+    }
+  return NULL;
+}
+
+MPlist *
+fini (MPlist *args)
+{
+  MInputContext *ic = mplist_value (args);
+  TableContext *context = get_context (ic), **p;
+
+  if (context)
+    {
+      for (p = &contexts; *p; p = &(*p)->next_context)
+	if (*p == context)
+	  {
+	    *p = context->next_context;
+	    break;
+	  }
+      free_context (context);
+    }
+  return NULL;
+}
+
+/* Return 1 if the SIZE bytes at BUF are well-formed UTF-8.  ASCII is
+   skipped eight bytes at a time.  */
+static int
+utf8_valid (const unsigned char *buf, size_t size)
+{
+  const unsigned char *p = buf, *end = buf + size;
+
+  while (p < end)
+    {
+      int c = *p, n;
+      uint32_t code;
+
+      if (c < 0x80)
+	{
+	  uint64_t word;
+
+	  while (end - p >= 8)
+	    {
+	      memcpy (&word, p, 8);
+	      if (word & 0x8080808080808080ULL)
+		break;
+	      p += 8;
+	    }
+	  if (p < end && *p < 0x80)
+	    p++;
+	  continue;
+	}
+
+      if (c >= 0xC2 && c <= 0xDF)
+	n = 1, code = c & 0x1F;
+      else if (c >= 0xE0 && c <= 0xEF)
+	n = 2, code = c & 0x0F;
+      else if (c >= 0xF0 && c <= 0xF4)
+	n = 3, code = c & 0x07;
+      else
+	return 0;
+      if (end - p <= n)
+	return 0;
+      for (p++; n > 0; n--, p++)
+	{
+	  if ((*p & 0xC0) != 0x80)
+	    return 0;
+	  code = (code << 6) | (*p & 0x3F);
+	}
+      /* overlong forms, surrogates and beyond U+10FFFF */
+      if ((c == 0xE0 && code < 0x800) || (code >= 0xD800 && code <= 0xDFFF)
+	  || (c == 0xF0 && code < 0x10000) || code > 0x10FFFF)
+	return 0;
+    }
+  return 1;
+}
+
+/* Return an M-text of the SIZE bytes of well-formed UTF-8 at BUF,
+   whose characters are decoded straight into it.  */
+static MText *
+decode_utf8 (const unsigned char *buf, size_t size)
+{
+  const unsigned char *p = buf, *end = buf + size;
+  MText *mt = mtext ();
+
+  while (mt && p < end)
+    {
+      int c = *p++, n = c < 0x80 ? 0 : c < 0xE0 ? 1 : c < 0xF0 ? 2 : 3;
+
+      if (n)
+	c &= 0x3F >> n;
+      for (; n > 0; n--)
+	c = (c << 6) | (*p++ & 0x3F);
+      if (!mtext_cat_char (mt, c))
+	{
+	  m17n_object_unref (mt);
+	  mt = NULL;
+	}
+    }
+  return mt;
+}
+
+/* Return an M-text of the SIZE bytes of UTF-8 at BUF.  Well-formed
+   UTF-8, which the phrases of the tables normally are, is decoded
+   directly; anything else goes through the converter.  */
+static MText *
+mtext_from_utf8 (TableContext *context, const unsigned char *buf, size_t size)
+{
+  if (utf8_valid (buf, size))
+    return decode_utf8 (buf, size);
+
+  mconv_reset_converter (context->converter);
+  mconv_rebind_buffer (context->converter, buf, size);
+  return mconv_decode (context->converter, mtext ());
+}
+
+static ssize_t
+mtext_to_utf8 (TableContext *context, MText *mt, unsigned char *buf,
+	       size_t size)
+{
+  ssize_t nbytes;
 
   mconv_reset_converter (context->converter);
   mconv_rebind_buffer (context->converter, (const unsigned char *)buf, size);
@@ -286,82 +1379,183 @@ mtext_to_utf8 (TableContext *context, MText *mt, unsigned char *buf,
   return nbytes;
 }
 
+/* Convert the preedit of CONTEXT into BUF, or copy the key of a
+   speculative lookup.  */
 static int
-get_ime_attr_int (TableContext *context, const char *attr, int *val)
+preedit_to_utf8 (TableContext *context, unsigned char *buf, size_t size)
+{
+  if (context->speculative)
+    {
+      if (context->key_len >= size)
+	return -1;
+      memcpy (buf, context->key, context->key_len);
+      buf[context->key_len] = '\0';
+      return context->key_len;
+    }
+  return mtext_to_utf8 (context, context->ic->preedit, buf, size);
+}
+
+/* Set *STMT to the row of ATTR in the ime table of TABLE.  Return -1
+   if it has none.  */
+static int
+get_ime_attr (Table *table, const char *attr, sqlite3_stmt **stmt)
 {
-  sqlite3_stmt *stmt;
   char *sql;
   int rc;
 
   sql = sqlite3_mprintf ("SELECT val FROM ime WHERE attr = \"%q\"", attr);
-  rc = sqlite3_prepare (context->db, sql, strlen (sql), &stmt, NULL);
+  rc = sqlite3_prepare (table->db, sql, strlen (sql), stmt, NULL);
   sqlite3_free (sql);
-  if (rc != SQLITE_OK)
-    {
-      sqlite3_finalize (stmt);
-      return -1;
-    }
-  rc = sqlite3_step (stmt);
-  if (rc == SQLITE_ROW)
+  if (rc == SQLITE_OK && sqlite3_step (*stmt) == SQLITE_ROW)
+    return 0;
+  sqlite3_finalize (*stmt);
+  return -1;
+}
+
+static int
+get_ime_attr_int (Table *table, const char *attr, int *val)
+{
+  sqlite3_stmt *stmt;
+
+  if (get_ime_attr (table, attr, &stmt) < 0)
+    return -1;
+  *val = sqlite3_column_int (stmt, 0);
+  sqlite3_finalize (stmt);
+  return 0;
+}
+
+/* Set *VAL to the character of ATTR, if it is a single ASCII one.  */
+static int
+get_ime_attr_char (Table *table, const char *attr, int *val)
+{
+  sqlite3_stmt *stmt;
+  const unsigned char *text;
+  int rc = -1;
+
+  if (get_ime_attr (table, attr, &stmt) < 0)
+    return -1;
+  text = sqlite3_column_text (stmt, 0);
+  if (text && text[0] > 0 && text[0] < 128 && !text[1])
     {
-      *val = sqlite3_column_int (stmt, 0);
-      sqlite3_finalize (stmt);
-      return 0;
+      *val = text[0];
+      rc = 0;
     }
   sqlite3_finalize (stmt);
-  return -1;
+  return rc;
 }
 
-static MPlist *
-open_ibus (TableContext *context, MPlist *args)
+/* Copy the database of TABLE into a private in-memory one, where the
+   phrases are indexed as they are looked up: for each number of key
+   columns up to MIRROR_INDEX_DEPTH, by those columns and then in the
+   order of the candidates, covering the columns selected by
+   LOOKUP_STATEMENT and MIN_MLEN_STATEMENT.  Longer keys use the
+   deepest index.  The database of the file is kept if this fails.  */
+#define MIRROR_INDEX_DEPTH 3
+#define MIRROR_BACKUP_PAGES 256
+
+/* progress handler of SQLite which interrupts the statement if the
+   loading of the table DATA is cancelled */
+static int
+progress_cancelled (void *data)
 {
-  MText *mt;
-  int rc;
-  char *file = NULL;
-  unsigned char buf[256];
+  return table_cancelled ((Table *) data);
+}
 
-  mt = (MText *) mplist_value (args);
-  rc = mtext_to_utf8 (context, mt, buf, sizeof (buf));
-  if (rc < 0)
-    return NULL;
-  file = strdup ((const char *)buf);
+static int
+mirror_ibus (Table *table)
+{
+  sqlite3 *db;
+  sqlite3_backup *backup;
+  sqlite3_str *str;
+  char *sql;
+  int i, j, rc;
 
-  args = mplist_next (args);
-  if (mplist_key (args) == Minteger)
-    context->xlen = (long) mplist_value (args);
-  else
-    context->xlen = XLEN;
+  rc = sqlite3_open_v2 (":memory:", &db,
+			SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL);
+  if (rc)
+    goto fail;
 
-  args = mplist_next (args);
-  if (mplist_key (args) == Minteger)
-    context->max_candidates = (long) mplist_value (args);
-  else
-    context->max_candidates = MAX_CANDIDATES;
+  backup = sqlite3_backup_init (db, "main", table->db, "main");
+  if (!backup)
+    goto fail;
+  while (sqlite3_backup_step (backup, MIRROR_BACKUP_PAGES) == SQLITE_OK
+	 && !table_cancelled (table))
+    ;
+  if (sqlite3_backup_finish (backup) != SQLITE_OK || table_cancelled (table))
+    goto fail;
+
+  sqlite3_progress_handler (db, 1000, progress_cancelled, table);
 
-  if (context->db && context->file && strcmp (context->file, file) != 0)
+  for (i = 1; i <= MIN(CLAMP(table->mlen, 0, 99), MIRROR_INDEX_DEPTH); i++)
     {
-      sqlite3_close (context->db);
-      context->db = NULL;
-      free (context->file);
+      str = sqlite3_str_new (db);
+      sqlite3_str_appendf (str, "CREATE INDEX mimx_m%d ON phrases (", i);
+      for (j = 0; j < i; j++)
+	sqlite3_str_appendf (str, "m%d, ", j);
+      sqlite3_str_appendall (str,
+			     "mlen, user_freq DESC, freq DESC, id, phrase)");
+      sql = sqlite3_str_finish (str);
+      if (!sql)
+	goto fail;
+      rc = sqlite3_exec (db, sql, NULL, NULL, NULL);
+      sqlite3_free (sql);
+      if (rc != SQLITE_OK)
+	goto fail;
     }
-  context->file = file;
 
-  if (!context->db)
+  sqlite3_progress_handler (db, 0, NULL, NULL);
+  sqlite3_close (table->db);
+  table->db = db;
+  return 0;
+
+ fail:
+  sqlite3_close (db);
+  return -1;
+}
+
+/* SQL function mimx_learned (PHRASE, TABLE): how many times the user
+   has chosen PHRASE in TABLE, which is bound as a pointer.  */
+static void
+sql_learned (sqlite3_context *sql, int argc, sqlite3_value **argv)
+{
+  Table *table = sqlite3_value_pointer (argv[1], "mimx-table");
+  const unsigned char *phrase = sqlite3_value_text (argv[0]);
+
+  sqlite3_result_int (sql, phrase ? learned_count (table, phrase,
+						  sqlite3_value_bytes (argv[0]))
+		      : 0);
+}
+
+static int
+open_ibus (Table *table)
+{
+  int rc;
+
+  rc = sqlite3_open_v2 (table->file, &table->db, SQLITE_OPEN_READONLY, NULL);
+  if (rc)
     {
-      rc = sqlite3_open_v2 (file, &context->db, SQLITE_OPEN_READONLY, NULL);
-      if (rc)
-	{
-	  sqlite3_close (context->db);
-	  context->db = NULL;
-	  free (context->file);
-	  context->file = NULL;
-	}
-      rc = get_ime_attr_int (context, "max_key_length", &context->mlen);
-      if (rc < 0)
-	context->mlen = MLEN;
+      sqlite3_close (table->db);
+      table->db = NULL;
+      return -1;
     }
+  rc = get_ime_attr_int (table, "max_key_length", &table->mlen);
+  if (rc < 0)
+    table->mlen = MLEN;
+  get_ime_attr_char (table, "single_wildcard_char", &table->single_wildcard);
+  get_ime_attr_char (table, "multi_wildcard_char", &table->multi_wildcard);
+  if (table->flags & TABLE_MEMORY)
+    mirror_ibus (table);
+  sqlite3_create_function (table->db, "mimx_learned", 2, SQLITE_UTF8, NULL,
+			   sql_learned, NULL, NULL);
+  return 0;
+}
 
-  return NULL;
+static void
+close_ibus (Table *table)
+{
+  finalize_statements (&table->stmts);
+  sqlite3_close (table->db);
+  table->db = NULL;
 }
 
 #define BUFSIZE 4096
@@ -381,374 +1575,4841 @@ scim_bytestouint16 (const unsigned char *bytes)
     return  ((uint16_t) bytes[0]) | (((uint16_t) bytes[1]) << 8);
 }
 
-static MPlist *
-open_scim (TableContext *context, MPlist *args)
+/* Pack KEY of KLEN bytes into WORDS.  The remaining code positions
+   are filled with PAD.  Return -1 if KEY contains a character which
+   has no code.  */
+static int
+pack_key (const unsigned char *key, int klen, int pad, uint64_t *words,
+	  int n_words)
 {
-  MText *mt;
-  int rc;
-  char *file = NULL;
-  unsigned char buf[BUFSIZE];
-
-  mt = (MText *) mplist_value (args);
-  rc = mtext_to_utf8 (context, mt, buf, sizeof (buf));
-  if (rc < 0)
-    return NULL;
-  file = strdup ((const char *)buf);
-
-  args = mplist_next (args);
-  if (mplist_key (args) == Minteger)
-    context->xlen = (long) mplist_value (args);
-  else
-    context->xlen = XLEN;
-
-  args = mplist_next (args);
-  if (mplist_key (args) == Minteger)
-    context->max_candidates = (long) mplist_value (args);
-  else
-    context->max_candidates = MAX_CANDIDATES;
+  int i;
 
-  if (context->mem && context->file && strcmp (context->file, file) != 0)
+  for (i = 0; i < n_words * KEY_CODES_PER_WORD; i++)
     {
-      munmap (context->mem, context->memlen);
-      context->mem = NULL;
-      free (context->file);
-      if (context->fp)
+      int code = pad;
+
+      if (i < klen)
 	{
-	  fclose (context->fp);
-	  context->fp = NULL;
+	  if (key[i] >= 128 || phrase_enc_dict[key[i]] <= 0)
+	    return -1;
+	  code = phrase_enc_dict[key[i]];
 	}
+      if (i % KEY_CODES_PER_WORD == 0)
+	words[i / KEY_CODES_PER_WORD] = 0;
+      words[i / KEY_CODES_PER_WORD] |=
+	(uint64_t) code << (64 - KEY_CODE_BITS * (i % KEY_CODES_PER_WORD + 1));
     }
+  return 0;
+}
+
+static int
+cmp_packed_keys (const uint64_t *a, const uint64_t *b, int n_words)
+{
+  int i;
+
+  for (i = 0; i < n_words; i++)
+    if (a[i] != b[i])
+      return a[i] < b[i] ? -1 : 1;
+  return 0;
+}
+
+static int
+cmp_index_entries (const void *a, const void *b, void *data)
+{
+  const uint64_t *ea = a, *eb = b;
+  int n_words = *(const int *) data;
+  int rc = cmp_packed_keys (ea, eb, n_words);
 
-  if (!context->fp)
-    context->fp = fopen (file, "rb");
+  if (rc)
+    return rc;
+  return ea[n_words] < eb[n_words] ? -1 : ea[n_words] > eb[n_words];
+}
 
-  if (!context->mem)
+/* Return the position of the first entry in INDEX between LO and HI
+   whose key is not less than KEY if UPPER is zero, or greater than
+   KEY otherwise.  */
+static int
+search_index (const TableKeyIndex *index, const uint64_t *key, int upper,
+	      int lo, int hi)
+{
+  while (lo < hi)
     {
-      while (1)
-	{
-	  if (!fgets ((char *)buf, sizeof buf, context->fp))
-	    break;
-	  if (strncmp ("###", (const char *)buf, 3) == 0)
-	    continue;
-	  if (strncmp ("MAX_KEY_LENGTH", (const char *)buf, 14) == 0)
-	    {
-	      char *p = strrchr ((char *)buf, '\n');
-	      if (!*p)
-		continue;
-	      *p-- = '\0';
-	      while (*p >= '0' && *p <= '9')
-		p--;
+      int mid = lo + (hi - lo) / 2;
+      int rc = cmp_packed_keys (index->data + mid * (index->n_words + 1),
+				key, index->n_words);
 
-	      context->mlen = strtoul (p + 1, NULL, 10);
-	      continue;
-	    }
-	  if (strncmp ("BEGIN_TABLE", (const char *)buf, 11) == 0)
-	    {
-	      long start_pos, end_pos;
+      if (rc < 0 || (upper && rc == 0))
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+  return lo;
+}
 
-	      if (fread (buf, 4, 1, context->fp) != 1)
-		break;
-	      context->content_size = scim_bytestouint32 (buf);
-	      start_pos = ftell (context->fp);
-	      if (fseek (context->fp, 0, SEEK_END) < 0)
-		break;
-	      end_pos = ftell (context->fp);
-	      if (context->content_size >= end_pos - start_pos)
-		break;
-	      context->mem = mmap (0, end_pos, PROT_READ, MAP_PRIVATE,
-				   fileno (context->fp), 0);
-	      if (context->mem)
-		{
-		  context->memlen = end_pos;
-		  context->content = (unsigned char *)context->mem + start_pos;
-		  context->file = file;
-		}
-	      break;
-	    }
-	}
+#define INDEX_OFFSET(index, i) \
+  ((index)->data[(size_t) (i) * ((index)->n_words + 1) + (index)->n_words])
+
+static inline int
+entry_klen (const Table *table, int offset)
+{
+  return table->content[offset] & 0x3F;
+}
+
+/* Return 1 if an entry of a key of at most mlen bytes lies whole at
+   OFFSET in content.  */
+static int
+entry_valid (const Table *table, int offset)
+{
+  int klen;
+
+  if (offset < 0 || offset > table->content_size - 4)
+    return 0;
+  klen = entry_klen (table, offset);
+  return klen > 0 && klen <= table->mlen
+    && offset + 4 + klen + table->content[offset + 1] <= table->content_size;
+}
+
+static inline int
+entry_freq (const Table *table, int offset)
+{
+  return scim_bytestouint16 (&table->content[offset + 2]);
+}
+
+/* Set *TEXT to the phrase of the entry at OFFSET and return its
+   length.  */
+static int
+entry_phrase (const Table *table, int offset, const unsigned char **text)
+{
+  *text = &table->content[offset + 4 + entry_klen (table, offset)];
+  return table->content[offset + 1];
+}
+
+/* Order entries at the offsets A and B as candidates: by frequency,
+   then longer keys first, then by table order.  */
+static int
+cmp_entries (const Table *table, int a, int b)
+{
+  int fa = entry_freq (table, a), fb = entry_freq (table, b);
+
+  if (fa != fb)
+    return fb - fa;
+  if (entry_klen (table, a) != entry_klen (table, b))
+    return entry_klen (table, b) - entry_klen (table, a);
+  return a - b;
+}
+
+static int
+cmp_postings (const void *a, const void *b, void *data)
+{
+  const Table *table = data;
+
+  return cmp_entries (table,
+		      INDEX_OFFSET (&table->index, *(const int *) a),
+		      INDEX_OFFSET (&table->index, *(const int *) b));
+}
+
+/* Return the Ith code of the key at position POS of INDEX.  */
+static inline int
+index_code (const TableKeyIndex *index, int pos, int i)
+{
+  uint64_t word = index->data[(size_t) pos * (index->n_words + 1)
+			      + i / KEY_CODES_PER_WORD];
+
+  return (word >> (64 - KEY_CODE_BITS * (i % KEY_CODES_PER_WORD + 1)))
+    & KEY_CODE_MAX;
+}
+
+static void
+build_postings (Table *table)
+{
+  TableKeyIndex *index = &table->index;
+  int d, lo, hi, i;
+
+  for (d = 0; d < POSTING_DEPTH; d++)
+    {
+      index->postings[d] = malloc (sizeof (int) * (index->len + 1));
+      index->kmin[d] = malloc (index->len + 1);
+      if (!index->postings[d] || !index->kmin[d])
+	{
+	  for (; d >= 0; d--)
+	    {
+	      free (index->postings[d]);
+	      free (index->kmin[d]);
+	      index->postings[d] = NULL;
+	      index->kmin[d] = NULL;
+	    }
+	  return;
+	}
+
+      for (lo = 0; lo < index->len; lo = hi)
+	{
+	  int kmin = entry_klen (table, INDEX_OFFSET (index, lo));
+
+	  for (hi = lo + 1; hi < index->len; hi++)
+	    {
+	      for (i = 0; i <= d; i++)
+		if (index_code (index, lo, i) != index_code (index, hi, i))
+		  break;
+	      if (i <= d)
+		break;
+	      kmin = MIN(kmin, entry_klen (table, INDEX_OFFSET (index, hi)));
+	    }
+	  for (i = lo; i < hi; i++)
+	    index->postings[d][i] = i;
+	  qsort_r (&index->postings[d][lo], hi - lo, sizeof (int),
+		   cmp_postings, table);
+	  memset (&index->kmin[d][lo], 0, hi - lo);
+	  index->kmin[d][lo] = kmin;
+	}
+    }
+}
+
+static int
+build_index (Table *table)
+{
+  TableKeyIndex *index = &table->index;
+  int stride, i, j, n;
+
+  index->n_words = (table->mlen + KEY_CODES_PER_WORD - 1)
+    / KEY_CODES_PER_WORD;
+  stride = index->n_words + 1;
+
+  for (n = 0, i = 0; i < table->mlen; i++)
+    n += table->offsets[i].len;
+  index->data = calloc (sizeof (uint64_t), (size_t) n * stride);
+  if (!index->data)
+    return -1;
+
+  for (n = 0, i = 0; i < table->mlen; i++)
+    for (j = 0; j < table->offsets[i].len; j++)
+      {
+	int offset = table->offsets[i].data[j];
+	uint64_t *entry = index->data + (size_t) n * stride;
+
+	/* fall back to scanning offsets */
+	if (pack_key (&table->content[offset + 4], i + 1, 0,
+		      entry, index->n_words) < 0)
+	  {
+	    free (index->data);
+	    index->data = NULL;
+	    return -1;
+	  }
+	entry[index->n_words] = offset;
+	n++;
+      }
+  index->len = n;
+
+  qsort_r (index->data, index->len, sizeof (uint64_t) * stride,
+	   cmp_index_entries, &index->n_words);
+  build_postings (table);
+  return 0;
+}
+
+static void
+free_offsets (Table *table)
+{
+  int i;
+
+  for (i = 0; table->offsets && i < table->mlen; i++)
+    free (table->offsets[i].prefixes);
+
+  if (table->index_mem)
+    {
+      munmap (table->index_mem, table->index_memlen);
+      table->index_mem = NULL;
+      free (table->offsets);
+      table->offsets = NULL;
+      memset (&table->index, 0, sizeof table->index);
+      return;
+    }
+
+  if (table->offsets)
+    {
+      for (i = 0; i < table->mlen; i++)
+	free (table->offsets[i].data);
+      free (table->offsets);
+      table->offsets = NULL;
+    }
+  free (table->index.data);
+  for (i = 0; i < POSTING_DEPTH; i++)
+    {
+      free (table->index.postings[i]);
+      free (table->index.kmin[i]);
+    }
+  memset (&table->index, 0, sizeof table->index);
+}
+
+/* The offsets and the key index of a scim table are cached in a
+   sidecar file under $XDG_CACHE_HOME/mimx-table, named after the
+   hash of the table's canonical path.  The file consists of the
+   header below, the path, the length of each offset array, the
+   offset arrays, the index entries, and the postings and kmin arrays
+   of each depth, each part aligned to 8 bytes.  It is written in the
+   native byte order, which is recorded in the header, and is only
+   used if the table's size, mtime, inode and the hash of samples of
+   its content still match, so that loading it does not read the whole
+   table.  The offsets are then only checked as the lookups use them:
+   see index_entry.  */
+#define INDEX_CACHE_MAGIC "MIMXIDX"
+#define INDEX_CACHE_VERSION 3
+#define INDEX_CACHE_SAMPLES 64
+#define INDEX_CACHE_SAMPLE_SIZE 64
+#define INDEX_CACHE_BYTE_ORDER 0x01020304
+
+struct _TableIndexCacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint64_t size;
+  int64_t mtime;
+  uint64_t ino;
+  uint64_t hash;
+  uint32_t mlen;
+  uint32_t n_words;
+  uint32_t index_len;
+  uint32_t path_len;
+};
+typedef struct _TableIndexCacheHeader TableIndexCacheHeader;
+
+
+static uint64_t
+hash_bytes (const unsigned char *data, size_t size)
+{
+  uint64_t hash = 0xcbf29ce484222325ULL; /* FNV-1a */
+  size_t i;
+
+  for (i = 0; i + 8 <= size; i += 8)
+    {
+      uint64_t word;
+
+      memcpy (&word, data + i, 8);
+      hash = (hash ^ word) * 0x100000001b3ULL;
+    }
+  for (; i < size; i++)
+    hash = (hash ^ data[i]) * 0x100000001b3ULL;
+  return hash;
+}
+
+/* Hash the header of the table file and INDEX_CACHE_SAMPLES blocks
+   spread evenly over its content.  */
+static uint64_t
+hash_samples (const Table *table)
+{
+  const unsigned char *mem = table->mem;
+  uint64_t hash = hash_bytes (mem, table->content - mem);
+  size_t step, i;
+
+  if (table->content_size <= INDEX_CACHE_SAMPLES * INDEX_CACHE_SAMPLE_SIZE)
+    return hash ^ hash_bytes (table->content, table->content_size);
+  step = (table->content_size - INDEX_CACHE_SAMPLE_SIZE)
+    / (INDEX_CACHE_SAMPLES - 1);
+  for (i = 0; i < INDEX_CACHE_SAMPLES; i++)
+    hash = (hash ^ hash_bytes (table->content + i * step,
+			       INDEX_CACHE_SAMPLE_SIZE)) * 0x100000001b3ULL;
+  return hash;
+}
+
+static char *
+index_cache_dir (void)
+{
+  const char *dir = getenv ("XDG_CACHE_HOME");
+  char *path;
+
+  if (dir && *dir)
+    path = sqlite3_mprintf ("%s/mimx-table", dir);
+  else if ((dir = getenv ("HOME")) && *dir)
+    path = sqlite3_mprintf ("%s/.cache/mimx-table", dir);
+  else
+    return NULL;
+  return path;
+}
+
+/* Fill HEADER with the identity of the table currently mapped in
+   TABLE, and return the name of its cache file.  */
+static char *
+index_cache_file (Table *table, TableIndexCacheHeader *header)
+{
+  struct stat st;
+  char *dir, *file;
+
+  if (fstat (fileno (table->fp), &st) < 0)
+    return NULL;
+
+  memset (header, 0, sizeof *header);
+  memcpy (header->magic, INDEX_CACHE_MAGIC, sizeof header->magic);
+  header->version = INDEX_CACHE_VERSION;
+  header->byte_order = INDEX_CACHE_BYTE_ORDER;
+  header->size = st.st_size;
+  header->mtime = (int64_t) st.st_mtim.tv_sec * 1000000000
+    + st.st_mtim.tv_nsec;
+  header->ino = st.st_ino;
+  header->hash = hash_samples (table);
+  header->mlen = table->mlen;
+  header->path_len = strlen (table->file);
+
+  dir = index_cache_dir ();
+  if (!dir)
+    return NULL;
+  file = sqlite3_mprintf ("%s/%016llx.idx", dir, (unsigned long long)
+			  hash_bytes ((const unsigned char *) table->file,
+				      header->path_len));
+  sqlite3_free (dir);
+  return file;
+}
+
+static int
+load_index_cache (Table *table)
+{
+  TableIndexCacheHeader header;
+  const TableIndexCacheHeader *cached;
+  char *file;
+  struct stat st;
+  unsigned char *mem, *p;
+  size_t size;
+  FILE *fp;
+  int i, n;
+
+  /* open(2) is shadowed by the module function of the same name */
+  file = index_cache_file (table, &header);
+  if (!file)
+    return -1;
+  fp = fopen (file, "rbe");
+  sqlite3_free (file);
+  if (!fp)
+    return -1;
+  if (fstat (fileno (fp), &st) < 0 || st.st_size < sizeof header)
+    {
+      fclose (fp);
+      return -1;
+    }
+  mem = mmap (0, st.st_size, PROT_READ, MAP_SHARED, fileno (fp), 0);
+  fclose (fp);
+  if (mem == MAP_FAILED)
+    return -1;
+
+  cached = (const TableIndexCacheHeader *) mem;
+  if (memcmp (cached, &header, offsetof (TableIndexCacheHeader, n_words))
+      || cached->path_len != header.path_len)
+    goto fail;
+
+  p = mem + sizeof header;
+  size = sizeof header + ALIGN8 (cached->path_len)
+    + ALIGN8 (sizeof (uint32_t) * cached->mlen);
+  if (st.st_size < size || memcmp (p, table->file, cached->path_len))
+    goto fail;
+  p += ALIGN8 (cached->path_len);
+
+  table->offsets = calloc (sizeof (TableOffsetArray), table->mlen);
+  if (!table->offsets)
+    goto fail;
+  for (n = 0, i = 0; i < table->mlen; i++)
+    n += ((const uint32_t *) p)[i];
+  size += ALIGN8 (sizeof (int) * n)
+    + sizeof (uint64_t) * cached->index_len * (cached->n_words + 1)
+    + (ALIGN8 (sizeof (int) * cached->index_len)
+       + ALIGN8 (cached->index_len)) * POSTING_DEPTH;
+  if (st.st_size != size
+      || (cached->index_len
+	  && cached->n_words != (table->mlen + KEY_CODES_PER_WORD - 1)
+	  / KEY_CODES_PER_WORD))
+    goto fail;
+
+  for (n = 0, i = 0; i < table->mlen; i++)
+    {
+      table->offsets[i].len = ((const uint32_t *) p)[i];
+      n += table->offsets[i].len;
+    }
+  p += ALIGN8 (sizeof (uint32_t) * table->mlen);
+  for (i = 0; i < table->mlen; i++)
+    {
+      table->offsets[i].data = (int *) p;
+      p += sizeof (int) * table->offsets[i].len;
+    }
+  p = mem + ALIGN8 (p - mem);
+
+  if (cached->index_len)
+    {
+      table->index.n_words = cached->n_words;
+      table->index.len = cached->index_len;
+      table->index.data = (uint64_t *) p;
+      p += sizeof (uint64_t) * cached->index_len * (cached->n_words + 1);
+      for (i = 0; i < POSTING_DEPTH; i++)
+	{
+	  table->index.postings[i] = (int *) p;
+	  p += ALIGN8 (sizeof (int) * cached->index_len);
+	  table->index.kmin[i] = p;
+	  p += ALIGN8 (cached->index_len);
+	}
+    }
+  /* the header only ties the file to the table.  Without the key
+     index, the scans read the entry at every offset, and building
+     their prefixes does so anyway, so the offsets are checked here;
+     the positions of the index are checked by index_entry.  */
+  for (i = 0; !table->index.len && i < table->mlen; i++)
+    for (n = 0; n < table->offsets[i].len; n++)
+      if (!entry_valid (table, table->offsets[i].data[n])
+	  || entry_klen (table, table->offsets[i].data[n]) != i + 1)
+	goto fail;
+
+  table->index_mem = mem;
+  table->index_memlen = st.st_size;
+  return 0;
+
+ fail:
+  free (table->offsets);
+  table->offsets = NULL;
+  memset (&table->index, 0, sizeof table->index);
+  munmap (mem, st.st_size);
+  return -1;
+}
+
+static int
+write_padded (FILE *fp, const void *data, size_t size)
+{
+  static const char zeros[8];
+
+  if (size && fwrite (data, size, 1, fp) != 1)
+    return -1;
+  if (ALIGN8 (size) > size
+      && fwrite (zeros, ALIGN8 (size) - size, 1, fp) != 1)
+    return -1;
+  return 0;
+}
+
+/* Write the offsets and the index just built to the cache file.
+   Failures are ignored; the table is simply indexed again next time.  */
+static void
+save_index_cache (Table *table)
+{
+  TableIndexCacheHeader header;
+  char *file, *dir, *tmp;
+  uint32_t lens[64];
+  FILE *fp;
+  int fd, i, n;
+
+  if (table->mlen > DIM (lens)
+      || (table->index.data && !table->index.postings[POSTING_DEPTH - 1]))
+    return;
+  file = index_cache_file (table, &header);
+  if (!file)
+    return;
+  if (table->index.data)
+    {
+      header.n_words = table->index.n_words;
+      header.index_len = table->index.len;
+    }
+
+  dir = index_cache_dir ();
+  tmp = sqlite3_mprintf ("%s.XXXXXX", file);
+  if (!dir || !tmp)
+    goto out;
+  /* create $HOME/.cache as well as its subdirectory */
+  if (mkdir (dir, 0700) < 0 && errno == ENOENT)
+    {
+      char *parent = strrchr (dir, '/');
+
+      *parent = '\0';
+      mkdir (dir, 0700);
+      *parent = '/';
+      mkdir (dir, 0700);
+    }
+
+  fd = mkstemp (tmp);
+  if (fd < 0)
+    goto out;
+  fp = fdopen (fd, "wb");
+  if (!fp)
+    {
+      close (fd);
+      unlink (tmp);
+      goto out;
+    }
+
+  for (n = 0, i = 0; i < table->mlen; i++)
+    {
+      lens[i] = table->offsets[i].len;
+      n += lens[i];
+    }
+  if (write_padded (fp, &header, sizeof header) < 0
+      || write_padded (fp, table->file, header.path_len) < 0
+      || write_padded (fp, lens, sizeof (uint32_t) * table->mlen) < 0)
+    goto fail;
+  for (i = 0; i < table->mlen; i++)
+    if (lens[i] && fwrite (table->offsets[i].data,
+			   sizeof (int) * lens[i], 1, fp) != 1)
+      goto fail;
+  if ((n * sizeof (int)) % 8 && fwrite ("\0\0\0\0", 4, 1, fp) != 1)
+    goto fail;
+  if (header.index_len
+      && fwrite (table->index.data,
+		 sizeof (uint64_t) * (header.n_words + 1),
+		 header.index_len, fp) != header.index_len)
+    goto fail;
+  for (i = 0; header.index_len && i < POSTING_DEPTH; i++)
+    if (write_padded (fp, table->index.postings[i],
+		      sizeof (int) * header.index_len) < 0
+	|| write_padded (fp, table->index.kmin[i], header.index_len) < 0)
+      goto fail;
+  if (fclose (fp) == 0 && rename (tmp, file) == 0)
+    goto out;
+  unlink (tmp);
+  goto out;
+
+ fail:
+  fclose (fp);
+  unlink (tmp);
+ out:
+  sqlite3_free (tmp);
+  sqlite3_free (dir);
+  sqlite3_free (file);
+}
+
+/* Return the offset of the entry at the position POS of the key
+   index, or -1 if POS or the offset is out of bounds.  Only a corrupt
+   index cache can do that, as its positions and offsets are not
+   checked when it is loaded: the cache file is then removed, so that
+   the next open of the table builds the index again, and the lookups
+   skip the entry meanwhile.  */
+static int
+index_entry (Table *table, int pos)
+{
+  int offset;
+
+  if (pos >= 0 && pos < table->index.len)
+    {
+      offset = INDEX_OFFSET (&table->index, pos);
+      if (INDEX_OFFSET (&table->index, pos) <= INT_MAX
+	  && entry_valid (table, offset))
+	return offset;
+    }
+
+  /* the prefetch thread may get here as well */
+  if (table->index_mem
+      && !__atomic_exchange_n (&table->index_dropped, 1, __ATOMIC_RELAXED))
+    {
+      TableIndexCacheHeader header;
+      char *file = index_cache_file (table, &header);
+
+      if (file)
+	unlink (file);
+      sqlite3_free (file);
+    }
+  return -1;
+}
+
+/* Gather the prefixes of the keys, which the scans compare instead of
+   the entries in content.  */
+static int
+build_prefixes (Table *table)
+{
+  int i, j;
+
+  for (i = 0; i < table->mlen; i++)
+    {
+      TableOffsetArray *array = &table->offsets[i];
+
+      array->prefixes = malloc (sizeof (uint64_t) * (array->len + 1));
+      if (!array->prefixes)
+	return -1;
+      for (j = 0; j < array->len; j++)
+	array->prefixes[j] =
+	  mimx_match_prefix (&table->content[array->data[j] + 4], i + 1);
+    }
+  return 0;
+}
+
+/* Set *VAL to the character of the header line BUF, such as
+   "SINGLE_WILDCARD_CHAR = ?", if it is a single ASCII one.  */
+static void
+scim_header_char (const char *buf, int *val)
+{
+  const char *p = strchr (buf, '=');
+  int c;
+
+  if (!p)
+    return;
+  for (p++; *p == ' ' || *p == '\t'; p++)
+    ;
+  c = (unsigned char) *p;
+  for (p++; *p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'; p++)
+    ;
+  if (c > ' ' && c < 128 && !*p)
+    *val = c;
+}
+
+static int
+open_scim (Table *table)
+{
+  unsigned char buf[BUFSIZE];
+  int offset;
+
+  table->fp = fopen (table->file, "rb");
+  if (!table->fp)
+    return -1;
+
+  while (1)
+    {
+      if (!fgets ((char *)buf, sizeof buf, table->fp))
+	break;
+      if (strncmp ("###", (const char *)buf, 3) == 0)
+	continue;
+      if (strncmp ("MAX_KEY_LENGTH", (const char *)buf, 14) == 0)
+	{
+	  char *p = strrchr ((char *)buf, '\n');
+	  if (!*p)
+	    continue;
+	  *p-- = '\0';
+	  while (*p >= '0' && *p <= '9')
+	    p--;
+
+	  table->mlen = strtoul (p + 1, NULL, 10);
+	  continue;
+	}
+      if (strncmp ("SINGLE_WILDCARD_CHAR", (const char *)buf, 20) == 0)
+	{
+	  scim_header_char ((const char *)buf, &table->single_wildcard);
+	  continue;
+	}
+      if (strncmp ("MULTI_WILDCARD_CHAR", (const char *)buf, 19) == 0)
+	{
+	  scim_header_char ((const char *)buf, &table->multi_wildcard);
+	  continue;
+	}
+      if (strncmp ("BEGIN_TABLE", (const char *)buf, 11) == 0)
+	{
+	  long start_pos, end_pos;
+	  void *mem;
+
+	  if (fread (buf, 4, 1, table->fp) != 1)
+	    break;
+	  table->content_size = scim_bytestouint32 (buf);
+	  start_pos = ftell (table->fp);
+	  if (fseek (table->fp, 0, SEEK_END) < 0)
+	    break;
+	  end_pos = ftell (table->fp);
+	  if (table->content_size >= end_pos - start_pos)
+	    break;
+	  mem = mmap (0, end_pos, PROT_READ, MAP_PRIVATE,
+		      fileno (table->fp), 0);
+	  if (mem != MAP_FAILED)
+	    {
+	      table->mem = mem;
+	      table->memlen = end_pos;
+	      table->content = (unsigned char *)table->mem + start_pos;
+	    }
+	  break;
+	}
+    }
+
+  if (!table->mem)
+    {
+      fclose (table->fp);
+      table->fp = NULL;
+      return -1;
+    }
+
+  if (!table->mlen)
+    table->mlen = MLEN;
+  if (load_index_cache (table) == 0)
+    goto out;
+
+  table->offsets = calloc (sizeof (TableOffsetArray), table->mlen);
+  if (!table->offsets)
+    goto fail;
+
+  for (offset = 0; offset < table->content_size;)
+    {
+      int klen = table->content[offset] & 0x3F;
+      int plen = table->content[offset + 1];
+      TableOffsetArray *array;
+
+      assert (klen > 0);
+      if (klen > table->mlen)
+	{
+	  offset += 4 + klen + plen;
+	  continue;
+	}
+
+      array = &table->offsets[klen - 1];
+      if (array->cap < array->len + 1)
+	{
+	  int *data;
+
+	  array->cap = array->cap ? array->cap * 2 : 1;
+	  data = realloc (array->data, sizeof (int) * array->cap);
+	  if (!data)
+	    goto fail;
+	  array->data = data;
+	}
+      *(array->data + array->len++) = offset;
+      offset += 4 + klen + plen;
+    }
+
+  if (table_cancelled (table))
+    goto fail;
+  build_index (table);
+  save_index_cache (table);
+
+ out:
+  if (!table->index.data && build_prefixes (table) < 0)
+    goto fail;
+  return 0;
+
+ fail:
+  close_scim (table);
+  return -1;
+}
+
+static void
+close_scim (Table *table)
+{
+  free_offsets (table);
+  if (table->mem)
+    munmap (table->mem, table->memlen);
+  table->mem = NULL;
+  if (table->fp)
+    fclose (table->fp);
+  table->fp = NULL;
+}
+
+/* Create the directories of PATH which do not exist.  */
+static void
+make_directories (char *path)
+{
+  char *p;
+
+  for (p = strchr (path + 1, '/'); p; p = strchr (p + 1, '/'))
+    {
+      *p = '\0';
+      mkdir (path, 0700);
+      *p = '/';
+    }
+}
+
+static char *
+learn_log_file (const char *file)
+{
+  const char *dir = getenv ("XDG_DATA_HOME");
+  unsigned long long hash = hash_bytes ((const unsigned char *) file,
+					strlen (file));
+
+  if (dir && *dir)
+    return sqlite3_mprintf ("%s/mimx-table/%016llx.log", dir, hash);
+  if ((dir = getenv ("HOME")) && *dir)
+    return sqlite3_mprintf ("%s/.local/share/mimx-table/%016llx.log",
+			    dir, hash);
+  return NULL;
+}
+
+static TableLearned **
+find_learned (Table *table, const char *phrase, int len)
+{
+  TableLearned **p;
+
+  p = &table->learned[hash_bytes ((const unsigned char *) phrase, len)
+		      % LEARN_BUCKETS];
+  for (; *p; p = &(*p)->next)
+    if ((*p)->len == len && memcmp ((*p)->phrase, phrase, len) == 0)
+      break;
+  return p;
+}
+
+/* Return how many times the user has chosen the LEN bytes of PHRASE
+   in TABLE, which may be NULL.  */
+static int
+learned_count (Table *table, const unsigned char *phrase, int len)
+{
+  TableLearned *learned;
+
+  if (!table || !table->n_learned)
+    return 0;
+  learned = *find_learned (table, (const char *) phrase, len);
+  return learned ? learned->count : 0;
+}
+
+/* Return the table whose choices rank the candidates of CONTEXT: its
+   own, or for a source of several tables the first of them, or NULL
+   if it is not ready.  */
+static Table *
+learned_table (TableContext *context)
+{
+  if (!context->parent)
+    return context->table;
+  return context->parent->sources->ready ? context->parent->table : NULL;
+}
+
+static int
+add_learned (Table *table, const char *phrase, int len, int count)
+{
+  TableLearned **p, *learned;
+
+  if (!table->learned)
+    {
+      table->learned = calloc (LEARN_BUCKETS, sizeof (TableLearned *));
+      if (!table->learned)
+	return -1;
+    }
+
+  p = find_learned (table, phrase, len);
+  if (*p)
+    {
+      /* saturated, as a log may sum up to more */
+      (*p)->count = count > INT_MAX - (*p)->count ? INT_MAX
+	: (*p)->count + count;
+      return 0;
+    }
+
+  learned = malloc (sizeof (TableLearned) + len);
+  if (!learned)
+    return -1;
+  learned->next = NULL;
+  learned->count = count;
+  learned->len = len;
+  memcpy (learned->phrase, phrase, len);
+  *p = learned;
+  table->n_learned++;
+  return 0;
+}
+
+static void
+free_learned (Table *table)
+{
+  int i;
+
+  for (i = 0; table->learned && i < LEARN_BUCKETS; i++)
+    while (table->learned[i])
+      {
+	TableLearned *next = table->learned[i]->next;
+
+	free (table->learned[i]);
+	table->learned[i] = next;
+      }
+  free (table->learned);
+  table->learned = NULL;
+  table->n_learned = 0;
+}
+
+/* Open the file LOG with MODE, locked against the other processes
+   which read or write it, with the log mutex held.  The lock is held
+   on the file which LOG names once it is taken, as another process
+   may have renamed a compacted log over the one opened meanwhile.  If
+   the file system does not lock, the file is used unlocked.  */
+static FILE *
+open_learn_log (const char *log, const char *mode)
+{
+  struct stat st, path_st;
+  FILE *fp;
+
+  while ((fp = fopen (log, mode)))
+    {
+      if (lockf (fileno (fp), F_LOCK, 0) < 0)
+	return fp;
+      if (fstat (fileno (fp), &st) == 0 && stat (log, &path_st) == 0
+	  && st.st_dev == path_st.st_dev && st.st_ino == path_st.st_ino)
+	return fp;
+      fclose (fp);
+    }
+  return NULL;
+}
+
+/* Read the log of TABLE into its counts, and rewrite it with a line
+   per phrase if some phrases appear more than once.  The log stays
+   locked until it is renamed, so that the choices which the other
+   processes append meanwhile wait for the compacted one.  */
+static void
+load_learned (Table *table)
+{
+  char buf[1024], *tmp;
+  FILE *fp, *log;
+  int n_lines = 0, i, fd;
+
+  if (!table->learn_log)
+    return;
+  pthread_mutex_lock (&learn_flusher.log_mutex);
+  fp = log = open_learn_log (table->learn_log, "r+");
+  if (!fp)
+    {
+      pthread_mutex_unlock (&learn_flusher.log_mutex);
+      return;
+    }
+  while (fgets (buf, sizeof buf, fp))
+    {
+      char *phrase, *end;
+      long count = strtol (buf, &phrase, 10);
+
+      end = strchr (phrase, '\n');
+      if (*phrase != '\t' || !end || count <= 0 || count > INT_MAX)
+	continue;
+      phrase++;
+      if (end > phrase && add_learned (table, phrase, end - phrase, count) < 0)
+	break;
+      n_lines++;
+    }
+
+  if (n_lines == table->n_learned)
+    goto done;
+
+  tmp = sqlite3_mprintf ("%s.XXXXXX", table->learn_log);
+  if (!tmp)
+    goto done;
+  fd = mkstemp (tmp);
+  fp = fd < 0 ? NULL : fdopen (fd, "w");
+  if (!fp)
+    {
+      if (fd >= 0)
+	close (fd);
+      sqlite3_free (tmp);
+      goto done;
+    }
+  for (i = 0; i < LEARN_BUCKETS && table->learned; i++)
+    {
+      TableLearned *learned;
+
+      for (learned = table->learned[i]; learned; learned = learned->next)
+	fprintf (fp, "%d\t%.*s\n", learned->count, learned->len,
+		 learned->phrase);
+    }
+  if (fclose (fp) != 0 || rename (tmp, table->learn_log) != 0)
+    unlink (tmp);
+  sqlite3_free (tmp);
+
+ done:
+  fclose (log);
+  pthread_mutex_unlock (&learn_flusher.log_mutex);
+}
+
+/* Append the choices in RECORDS to their logs, and free them.  */
+static void
+write_records (LearnRecord *records)
+{
+  FILE *fp = NULL;
+
+  pthread_mutex_lock (&learn_flusher.log_mutex);
+  while (records)
+    {
+      LearnRecord *next = records->next;
+
+      if (!fp)
+	{
+	  make_directories (records->log);
+	  fp = open_learn_log (records->log, "a");
+	}
+      if (fp)
+	fprintf (fp, "1\t%.*s\n", records->len, records->phrase);
+      if (fp && (!next || strcmp (next->log, records->log) != 0))
+	{
+	  fclose (fp);
+	  fp = NULL;
+	}
+      sqlite3_free (records->log);
+      free (records);
+      records = next;
+    }
+  pthread_mutex_unlock (&learn_flusher.log_mutex);
+}
+
+static void *
+flush_learned (void *data)
+{
+  LearnFlusher *flusher = data;
+
+  pthread_mutex_lock (&flusher->mutex);
+  while (1)
+    {
+      LearnRecord *records;
+      int stop;
+
+      while (!flusher->stop && flusher->n_pending == 0)
+	pthread_cond_wait (&flusher->cond, &flusher->mutex);
+      if (!flusher->stop && flusher->n_pending < LEARN_FLUSH_BATCH)
+	{
+	  struct timespec ts;
+
+	  clock_gettime (CLOCK_REALTIME, &ts);
+	  ts.tv_sec += LEARN_FLUSH_INTERVAL;
+	  while (!flusher->stop && flusher->n_pending < LEARN_FLUSH_BATCH
+		 && pthread_cond_timedwait (&flusher->cond, &flusher->mutex,
+					    &ts) == 0)
+	    ;
+	}
+
+      records = flusher->head;
+      flusher->head = NULL;
+      flusher->tail = &flusher->head;
+      flusher->n_pending = 0;
+      stop = flusher->stop;
+      pthread_mutex_unlock (&flusher->mutex);
+
+      write_records (records);
+
+      pthread_mutex_lock (&flusher->mutex);
+      if (stop)
+	break;
+    }
+  pthread_mutex_unlock (&flusher->mutex);
+  return NULL;
+}
+
+/* Queue the choice of the LEN bytes of PHRASE in TABLE to be appended
+   to its log, starting the thread which writes it if needed.  */
+static void
+queue_learned (Table *table, const char *phrase, int len)
+{
+  LearnFlusher *flusher = &learn_flusher;
+  LearnRecord *record;
+
+  record = malloc (sizeof (LearnRecord) + len);
+  if (!record)
+    return;
+  record->next = NULL;
+  record->log = sqlite3_mprintf ("%s", table->learn_log);
+  record->len = len;
+  memcpy (record->phrase, phrase, len);
+  if (!record->log)
+    {
+      free (record);
+      return;
+    }
+
+  pthread_mutex_lock (&flusher->mutex);
+  if (!flusher->running)
+    {
+      flusher->head = NULL;
+      flusher->tail = &flusher->head;
+      flusher->running = pthread_create (&flusher->thread, NULL,
+					 flush_learned, flusher) == 0;
+    }
+  if (flusher->running)
+    {
+      *flusher->tail = record;
+      flusher->tail = &record->next;
+      if (++flusher->n_pending == 1
+	  || flusher->n_pending == LEARN_FLUSH_BATCH)
+	pthread_cond_signal (&flusher->cond);
+      record = NULL;
+    }
+  pthread_mutex_unlock (&flusher->mutex);
+
+  /* without the thread, the choice is lost rather than written here */
+  if (record)
+    {
+      sqlite3_free (record->log);
+      free (record);
+    }
+}
+
+/* Write the pending choices and stop the thread.  */
+static void
+stop_learn_flusher (void)
+{
+  LearnFlusher *flusher = &learn_flusher;
+
+  pthread_mutex_lock (&flusher->mutex);
+  if (!flusher->running)
+    {
+      pthread_mutex_unlock (&flusher->mutex);
+      return;
+    }
+  flusher->stop = 1;
+  pthread_cond_signal (&flusher->cond);
+  pthread_mutex_unlock (&flusher->mutex);
+
+  pthread_join (flusher->thread, NULL);
+  flusher->running = 0;
+  flusher->stop = 0;
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+/* Mark the tables whose files the LEN bytes of events at BUF are
+   about, or all of them if some events were lost.  */
+static void
+mark_changed (TableWatcher *watcher, const char *buf, ssize_t len)
+{
+  const struct inotify_event *event;
+  ssize_t i;
+
+  pthread_mutex_lock (&watcher->mutex);
+  for (i = 0; i < len; i += sizeof (struct inotify_event) + event->len)
+    {
+      TableWatch *watch;
+
+      event = (const struct inotify_event *) (buf + i);
+      for (watch = watcher->watches; watch; watch = watch->next)
+	if ((event->mask & IN_Q_OVERFLOW)
+	    || (watch->wd == event->wd && event->len
+		&& strcmp (strrchr (watch->table->file, '/') + 1,
+			   event->name) == 0))
+	  __atomic_store_n (&watch->table->changed, 1, __ATOMIC_RELEASE);
+    }
+  pthread_mutex_unlock (&watcher->mutex);
+}
+
+static void *
+watch_files (void *data)
+{
+  TableWatcher *watcher = data;
+  char buf[4096]
+    __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+  struct pollfd fds[2];
+
+  fds[0].fd = watcher->fd;
+  fds[0].events = POLLIN;
+  fds[1].fd = watcher->wake;
+  fds[1].events = POLLIN;
+  while (1)
+    {
+      ssize_t len;
+
+      if (poll (fds, 2, -1) < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  break;
+	}
+      if (fds[1].revents)
+	break;
+      len = read (watcher->fd, buf, sizeof buf);
+      if (len > 0)
+	mark_changed (watcher, buf, len);
+      else if (len == 0 || (errno != EINTR && errno != EAGAIN))
+	break;
+    }
+  return NULL;
+}
+
+static int
+start_table_watcher (TableWatcher *watcher)
+{
+  watcher->fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+  if (watcher->fd < 0)
+    return 0;
+  watcher->wake = eventfd (0, EFD_CLOEXEC);
+  if (watcher->wake < 0)
+    {
+      close (watcher->fd);
+      return 0;
+    }
+  if (pthread_create (&watcher->thread, NULL, watch_files, watcher) != 0)
+    {
+      close (watcher->wake);
+      close (watcher->fd);
+      return 0;
+    }
+  return 1;
+}
+
+/* Watch the file of TABLE, starting the thread which watches them if
+   needed.  A table whose file cannot be watched is never loaded
+   again.  */
+static void
+watch_table (Table *table)
+{
+  TableWatcher *watcher = &table_watcher;
+  TableWatch *watch;
+  const char *p = strrchr (table->file, '/');
+  char *dir;
+
+  watch = malloc (sizeof (TableWatch));
+  if (!watch)
+    return;
+  dir = strndup (table->file, p == table->file ? 1 : p - table->file);
+  if (!dir)
+    {
+      free (watch);
+      return;
+    }
+
+  pthread_mutex_lock (&watcher->mutex);
+  if (!watcher->running)
+    watcher->running = start_table_watcher (watcher);
+  watch->wd = watcher->running
+    ? inotify_add_watch (watcher->fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO)
+    : -1;
+  if (watch->wd >= 0)
+    {
+      watch->table = table;
+      watch->next = watcher->watches;
+      watcher->watches = watch;
+      watch = NULL;
+    }
+  pthread_mutex_unlock (&watcher->mutex);
+
+  free (dir);
+  free (watch);
+}
+
+/* Stop watching the file of TABLE.  Once this returns, the watcher
+   thread no longer touches TABLE.  */
+static void
+unwatch_table (Table *table)
+{
+  TableWatcher *watcher = &table_watcher;
+  TableWatch **p, *watch;
+  int wd = -1;
+
+  pthread_mutex_lock (&watcher->mutex);
+  for (p = &watcher->watches; *p; p = &(*p)->next)
+    if ((*p)->table == table)
+      {
+	watch = *p;
+	*p = watch->next;
+	wd = watch->wd;
+	free (watch);
+	break;
+      }
+  /* the directory may hold the files of other tables */
+  for (watch = watcher->watches; wd >= 0 && watch; watch = watch->next)
+    if (watch->wd == wd)
+      wd = -1;
+  if (wd >= 0)
+    inotify_rm_watch (watcher->fd, wd);
+  pthread_mutex_unlock (&watcher->mutex);
+}
+
+static void
+stop_table_watcher (void)
+{
+  TableWatcher *watcher = &table_watcher;
+
+  if (!watcher->running)
+    return;
+  while (eventfd_write (watcher->wake, 1) < 0 && errno == EINTR)
+    ;
+  pthread_join (watcher->thread, NULL);
+  close (watcher->wake);
+  close (watcher->fd);
+  watcher->running = 0;
+}
+#else	/* HAVE_SYS_INOTIFY_H */
+static void
+watch_table (Table *table)
+{
+}
+
+static void
+unwatch_table (Table *table)
+{
+}
+
+static void
+stop_table_watcher (void)
+{
+}
+#endif	/* !HAVE_SYS_INOTIFY_H */
+
+/* Return the bytes used by TABLE outside SQLite when it is loaded: its
+   files mapped, and the key index and offsets built on the heap.  */
+static size_t
+table_heap_memory (Table *table)
+{
+  size_t size;
+  int i;
+
+  size = table->memlen + table->index_memlen;
+  for (i = 0; table->offsets && i < table->mlen; i++)
+    {
+      if (table->offsets[i].prefixes)
+	size += sizeof (uint64_t) * (table->offsets[i].len + 1);
+      if (!table->index_mem)
+	size += sizeof (int) * table->offsets[i].cap;
+    }
+  if (!table->index_mem && table->index.data)
+    size += table->index.len * (sizeof (uint64_t) * (table->index.n_words + 1)
+				+ (sizeof (int) + 1) * POSTING_DEPTH);
+  return size;
+}
+
+static void *
+load_table (void *data)
+{
+  Table *table = data;
+  int status;
+
+  status = (*table->desc->open) (table) < 0 ? TABLE_FAILED : TABLE_READY;
+  /* the counts learned before an eviction are kept */
+  if (status == TABLE_READY && !table->learned)
+    load_learned (table);
+  if (status == TABLE_READY)
+    {
+      table->memory = table_heap_memory (table);
+      __atomic_add_fetch (&tables_memory, table->memory, __ATOMIC_RELAXED);
+    }
+  pthread_mutex_lock (&table->mutex);
+  __atomic_store_n (&table->status, status, __ATOMIC_RELEASE);
+  pthread_cond_broadcast (&table->cond);
+  pthread_mutex_unlock (&table->mutex);
+  return NULL;
+}
+
+/* Return 1 if TABLE is ready, waiting up to TIMEOUT milliseconds for
+   the worker thread to load it.  */
+static int
+wait_table (Table *table, long timeout)
+{
+  int status = __atomic_load_n (&table->status, __ATOMIC_ACQUIRE);
+
+  if (status == TABLE_LOADING && timeout > 0)
+    {
+      struct timespec ts;
+
+      clock_gettime (CLOCK_REALTIME, &ts);
+      ts.tv_sec += timeout / 1000;
+      ts.tv_nsec += (timeout % 1000) * 1000000;
+      if (ts.tv_nsec >= 1000000000)
+	{
+	  ts.tv_sec++;
+	  ts.tv_nsec -= 1000000000;
+	}
+      pthread_mutex_lock (&table->mutex);
+      while (table->status == TABLE_LOADING
+	     && pthread_cond_timedwait (&table->cond, &table->mutex, &ts) == 0)
+	;
+      status = table->status;
+      pthread_mutex_unlock (&table->mutex);
+    }
+
+  if (status != TABLE_LOADING && table->has_loader)
+    {
+      pthread_join (table->loader, NULL);
+      table->has_loader = 0;
+    }
+  return status == TABLE_READY;
+}
+
+/* Load TABLE on a worker thread, or right away if the thread cannot
+   be created.  */
+static void
+start_loader (Table *table)
+{
+  table->status = TABLE_LOADING;
+  if (pthread_create (&table->loader, NULL, load_table, table) == 0)
+    table->has_loader = 1;
+  else
+    load_table (table);
+}
+
+/* Return a new table of the backend DESC for the canonical PATH,
+   loaded on a worker thread, or right away if the thread cannot be
+   created.  */
+static Table *
+new_table (const TableDescription *desc, const char *path, int flags)
+{
+  Table *table;
+
+  table = calloc (sizeof (Table), 1);
+  if (!table)
+    return NULL;
+  table->desc = desc;
+  table->flags = flags;
+  table->file = strdup (path);
+  if (!table->file)
+    {
+      free (table);
+      return NULL;
+    }
+  table->serial = ++table_serial;
+  table->learn_log = learn_log_file (path);
+  pthread_mutex_init (&table->mutex, NULL);
+  pthread_cond_init (&table->cond, NULL);
+  watch_table (table);
+  start_loader (table);
+
+  table->refcount = 1;
+  return table;
+}
+
+/* Return the table of the backend DESC for FILE, which another input
+   context may already have opened.  */
+static Table *
+acquire_table (const TableDescription *desc, const char *file, int flags)
+{
+  char path[PATH_MAX];
+  Table *table;
+
+  if (!realpath (file, path))
+    return NULL;
+
+  for (table = tables; table; table = table->next)
+    if (table->desc == desc && table->flags == flags
+	&& strcmp (table->file, path) == 0
+	&& __atomic_load_n (&table->status, __ATOMIC_ACQUIRE) != TABLE_FAILED)
+      {
+	table->refcount++;
+	return table;
+      }
+
+  table = new_table (desc, path, flags);
+  if (!table)
+    return NULL;
+  table->next = tables;
+  tables = table;
+  return table;
+}
+
+/* Remove TABLE from the opened tables.  Return 1 if it was there.  */
+static int
+unlink_table (Table *table)
+{
+  Table **p;
+
+  for (p = &tables; *p; p = &(*p)->next)
+    if (*p == table)
+      {
+	*p = table->next;
+	return 1;
+      }
+  return 0;
+}
+
+static void
+release_table (Table *table)
+{
+  if (--table->refcount > 0)
+    return;
+
+  unlink_table (table);
+  unwatch_table (table);
+
+  /* the open functions give up when they see CANCELLED, and clean up
+     what they have opened */
+  if (table->has_loader)
+    {
+      __atomic_store_n (&table->cancelled, 1, __ATOMIC_RELAXED);
+      pthread_join (table->loader, NULL);
+    }
+  pthread_cond_destroy (&table->cond);
+  pthread_mutex_destroy (&table->mutex);
+  purge_results (table->serial);
+  if (stats_enabled)
+    write_stats ("table", table, &table->stats);
+
+  if (table->phrases)
+    {
+      int i;
+
+      for (i = 0; i < PHRASE_CACHE_SIZE; i++)
+	if (table->phrases[i].mt)
+	  m17n_object_unref (table->phrases[i].mt);
+      free (table->phrases);
+    }
+  if (table->status == TABLE_READY)
+    (*table->desc->close) (table);
+  __atomic_sub_fetch (&tables_memory, table->memory, __ATOMIC_RELAXED);
+  free_learned (table);
+  sqlite3_free (table->learn_log);
+  free (table->file);
+  if (table->reload)
+    release_table (table->reload);
+  free (table);
+
+  /* the threads only work for the tables, so they go with the last
+     one */
+  if (!tables)
+    {
+      stop_scan_pool ();
+      stop_learn_flusher ();
+      stop_table_watcher ();
+      stop_prefetcher ();
+    }
+}
+
+/* Move CONTEXT to the table loaded again from the file of its table,
+   if it is ready, and start loading it if the file has changed.  The
+   lookups never wait for it: until it is ready, they go on with the
+   table they have.  As CONTEXT only moves between lookups, no lookup
+   is using the table it leaves, which is released with the last
+   context on it.  */
+static void
+refresh_table (TableContext *context)
+{
+  Table *table = context->table, *reload;
+
+  while (table)
+    {
+      if (__atomic_exchange_n (&table->changed, 0, __ATOMIC_ACQUIRE))
+	{
+	  if (!table->reload)
+	    table->reload = new_table (table->desc, table->file,
+				       table->flags);
+	  else
+	    /* the file may have changed again while it was loaded */
+	    __atomic_store_n (&table->reload->changed, 1, __ATOMIC_RELAXED);
+	}
+
+      reload = table->reload;
+      if (!reload || !wait_table (reload, 0))
+	{
+	  /* keep the table, until the file changes again */
+	  if (reload && __atomic_load_n (&reload->status, __ATOMIC_ACQUIRE)
+	      == TABLE_FAILED)
+	    {
+	      table->reload = NULL;
+	      release_table (reload);
+	    }
+	  return;
+	}
+
+      /* the first context to move puts it in place of the table for
+	 the contexts opened from now on */
+      if (unlink_table (table))
+	{
+	  reload->next = tables;
+	  tables = reload;
+	}
+      reload->refcount++;
+      stop_prefetch (context);
+      clear_cursor (context);
+      clear_states (context);
+      finalize_statements (&context->stmts);
+      context->table = reload;
+      release_table (table);
+      table = reload;
+    }
+}
+
+static void
+refresh_tables (TableContext *context)
+{
+  TableContext *source;
+
+  refresh_table (context);
+  for (source = context->sources; source; source = source->next)
+    refresh_table (source);
+}
+
+/* Return the bytes used by TABLE: those outside SQLite, and the
+   memory of its SQLite connection, which holds the pages read from
+   the database or all of them if it is mirrored.  */
+static size_t
+table_memory (Table *table)
+{
+  size_t size;
+  int j;
+
+  if (__atomic_load_n (&table->status, __ATOMIC_ACQUIRE) != TABLE_READY)
+    return 0;
+
+  size = table->memory;
+  if (table->db)
+    {
+      static const int ops[] = { SQLITE_DBSTATUS_CACHE_USED,
+				 SQLITE_DBSTATUS_SCHEMA_USED,
+				 SQLITE_DBSTATUS_STMT_USED };
+      int current, highwater;
+
+      for (j = 0; j < DIM(ops); j++)
+	if (sqlite3_db_status (table->db, ops[j], &current, &highwater, 0)
+	    == SQLITE_OK)
+	  size += current;
+    }
+  return size;
+}
+
+/* Close TABLE, which is ready, to give back its memory, and drop what
+   the input contexts using it have looked up in it.  The table stays
+   in the list with its learned counts, and the next lookup in it
+   loads it again.  */
+static void
+evict_table (Table *table)
+{
+  TableContext *context, *source;
+  int i;
+
+  for (context = contexts; context; context = context->next_context)
+    {
+      int using = context->table == table;
+
+      for (source = context->sources; source; source = source->next)
+	if (source->table == table)
+	  using = 1;
+      if (!using)
+	continue;
+
+      stop_prefetch (context);
+      clear_cursor (context);
+      if (context->table == table)
+	{
+	  clear_states (context);
+	  finalize_statements (&context->stmts);
+	}
+      for (source = context->sources; source; source = source->next)
+	if (source->table == table)
+	  {
+	    clear_states (source);
+	    finalize_statements (&source->stmts);
+	  }
+    }
+
+  if (table->has_loader)
+    {
+      pthread_join (table->loader, NULL);
+      table->has_loader = 0;
+    }
+  purge_results (table->serial);
+  if (table->phrases)
+    {
+      for (i = 0; i < PHRASE_CACHE_SIZE; i++)
+	if (table->phrases[i].mt)
+	  m17n_object_unref (table->phrases[i].mt);
+      free (table->phrases);
+      table->phrases = NULL;
+    }
+  (*table->desc->close) (table);
+  __atomic_sub_fetch (&tables_memory, table->memory, __ATOMIC_RELAXED);
+  table->memory = 0;
+  table->status = TABLE_EVICTED;
+  if (stats_enabled)
+    table->stats.evictions++;
+}
+
+static int
+table_evicted (Table *table)
+{
+  return __atomic_load_n (&table->status, __ATOMIC_ACQUIRE) == TABLE_EVICTED;
+}
+
+/* Mark the tables of CONTEXT as used by this lookup, and load again
+   those which have been evicted.  */
+static void
+restore_tables (TableContext *context)
+{
+  TableContext *source;
+
+  lookup_clock++;
+  if (context->table)
+    context->table->used = lookup_clock;
+  for (source = context->sources; source; source = source->next)
+    source->table->used = lookup_clock;
+
+  if (context->table && table_evicted (context->table))
+    start_loader (context->table);
+  for (source = context->sources; source; source = source->next)
+    if (table_evicted (source->table))
+      start_loader (source->table);
+}
+
+/* Evict the tables which have not been used for the longest time,
+   other than those of CONTEXT, until the tables fit in the memory
+   budget.  The memory of the tables is kept as a running total, with
+   that of SQLite as a whole, so that a lookup which leaves it within
+   the budget only compares them.  */
+static void
+trim_tables (TableContext *context)
+{
+  Table *table, *victim;
+  size_t total, size;
+
+  if (!memory_budget)
+    return;
+  total = __atomic_load_n (&tables_memory, __ATOMIC_RELAXED)
+    + sqlite3_memory_used ();
+
+  while (total > memory_budget)
+    {
+      victim = NULL;
+      for (table = tables; table; table = table->next)
+	if (table->used != lookup_clock
+	    && __atomic_load_n (&table->status, __ATOMIC_ACQUIRE)
+	    == TABLE_READY
+	    && (!victim || table->used < victim->used))
+	  victim = table;
+      if (!victim)
+	break;
+      size = table_memory (victim);
+      total -= MIN(total, size);
+      evict_table (victim);
+    }
+}
+
+/* the options which "open" takes as a symbol and an integer each,
+   after the optional integers */
+enum
+  {
+    OPTION_MIRROR,
+    OPTION_LOAD_WAIT,
+    OPTION_SCAN_THREADS,
+    OPTION_FUZZY,
+    OPTION_SINGLE_WILDCARD,
+    OPTION_MULTI_WILDCARD,
+    OPTION_PREFETCH,
+    N_OPTIONS
+  };
+
+static const char *const option_names[N_OPTIONS] =
+  {
+    "mirror",
+    "load-wait",
+    "scan-threads",
+    "fuzzy",
+    "single-wildcard",
+    "multi-wildcard",
+    "prefetch"
+  };
+
+/* Open the tables given as a type and a file each, followed by the
+   optional integers xlen, max_candidates and paging, and by the
+   options.  With several tables, up to MAX_SOURCES, their candidates
+   are merged into one list:
+
+   (call libmimx-table open ibus "/path/to/marathi.db"
+			    scim "/path/to/domain.bin" 2 100
+			    load-wait 200)  */
+MPlist *
+open (MPlist *args)
+{
+  MInputContext *ic;
+  TableContext *context, *source, **tail;
+  const TableDescription *descs[MAX_SOURCES];
+  MText *files[MAX_SOURCES];
+  Table *opened[MAX_SOURCES];
+  unsigned char buf[PATH_MAX];
+  long ints[] = { XLEN, MAX_CANDIDATES, 0 };
+  long options[N_OPTIONS] = { 0, LOAD_WAIT, SCAN_THREADS, FUZZY, 0, 0,
+			      PREFETCH };
+  int i, j, rc, n_tables, n_opened, flags = 0;
+
+  ic = mplist_value (args);
+  context = get_context (ic);
+
+  /* a symbol followed by an integer is an option */
+  args = mplist_next (args);
+  for (n_tables = 0;
+       n_tables < MAX_SOURCES && args && mplist_key (args) == Msymbol
+	 && mplist_key (mplist_next (args)) != Minteger;
+       n_tables++)
+    {
+      MSymbol type = (MSymbol) mplist_value (args);
+
+      descs[n_tables] = NULL;
+      for (i = 0; i < DIM(table_descriptions); i++)
+	if (strcmp (table_descriptions[i].name, msymbol_name (type)) == 0)
+	  {
+	    descs[n_tables] = &table_descriptions[i];
+	    break;
+	  }
+
+      args = mplist_next (args);
+      if (!descs[n_tables] || mplist_key (args) != Mtext)
+	return NULL;
+      files[n_tables] = (MText *) mplist_value (args);
+      args = mplist_next (args);
+    }
+  if (n_tables == 0)
+    return NULL;
+
+  /* the optional integers which follow: xlen, max_candidates and
+     paging */
+  for (i = 0;
+       i < DIM (ints) && args && mplist_key (args) == Minteger;
+       i++, args = mplist_next (args))
+    ints[i] = (long) mplist_value (args);
+
+  /* then the options: the in-memory mirror, the time to wait for the
+     table, the threads of a scan, the edit distance of a fuzzy lookup,
+     the single and multi wildcard characters, in place of those of the
+     table, and the microseconds of CPU time to look up the next keys
+     ahead */
+  for (; args && mplist_key (args) == Msymbol; args = mplist_next (args))
+    {
+      const char *name = msymbol_name ((MSymbol) mplist_value (args));
+
+      for (i = 0; i < N_OPTIONS; i++)
+	if (strcmp (option_names[i], name) == 0)
+	  break;
+      args = mplist_next (args);
+      if (i == N_OPTIONS || mplist_key (args) != Minteger)
+	return NULL;
+      options[i] = (long) mplist_value (args);
+    }
+
+  /* the prefetch thread reads the options and the table */
+  stop_prefetch (context);
+  context->xlen = ints[0];
+  context->max_candidates = ints[1];
+  context->paging = ints[2] != 0;
+  if (options[OPTION_MIRROR])
+    flags |= TABLE_MEMORY;
+  context->load_wait = options[OPTION_LOAD_WAIT];
+  context->scan_threads = options[OPTION_SCAN_THREADS];
+  context->fuzzy = CLAMP(options[OPTION_FUZZY], 0, FUZZY_MAX_DISTANCE);
+  context->single_wildcard = options[OPTION_SINGLE_WILDCARD] > 0
+    && options[OPTION_SINGLE_WILDCARD] < 128
+    ? options[OPTION_SINGLE_WILDCARD] : 0;
+  context->multi_wildcard = options[OPTION_MULTI_WILDCARD] > 0
+    && options[OPTION_MULTI_WILDCARD] < 128
+    ? options[OPTION_MULTI_WILDCARD] : 0;
+  context->prefetch = MAX(options[OPTION_PREFETCH], 0);
+
+  clear_cursor (context);
+  clear_states (context);
+  finalize_statements (&context->stmts);
+
+  /* acquire first, so that reopening the same table does not close it */
+  for (i = 0, n_opened = 0; i < n_tables; i++)
+    {
+      rc = mtext_to_utf8 (context, files[i], buf, sizeof (buf));
+      if (rc >= 0
+	  && (opened[n_opened] = acquire_table (descs[i], (const char *)buf,
+						flags)))
+	n_opened++;
+    }
+  free_sources (context);
+  if (context->table)
+    release_table (context->table);
+  context->table = n_opened > 0 ? opened[0] : NULL;
+
+  /* the first table is both that of the context and of a source */
+  tail = &context->sources;
+  for (i = 0; n_opened > 1 && i < n_opened; i++)
+    {
+      source = make_context (ic);
+      if (!source)
+	{
+	  for (j = i; j < n_opened; j++)
+	    if (j > 0)
+	      release_table (opened[j]);
+	  break;
+	}
+      if (i == 0)
+	opened[0]->refcount++;
+      source->table = opened[i];
+      source->parent = context;
+      source->xlen = context->xlen;
+      source->max_candidates = context->max_candidates;
+      source->scan_threads = context->scan_threads;
+      source->fuzzy = context->fuzzy;
+      source->single_wildcard = context->single_wildcard;
+      source->multi_wildcard = context->multi_wildcard;
+      *tail = source;
+      tail = &source->next;
+    }
+
+  return NULL;
+}
+
+#ifdef DEBUG
+/* Print how SQLite runs SQL, to tell whether it scans the whole table
+   instead of using an index.  */
+static void
+explain_statement (Table *table, const char *sql)
+{
+  sqlite3_stmt *stmt;
+  char *explain;
+  int rc;
+
+  explain = sqlite3_mprintf ("EXPLAIN QUERY PLAN %s", sql);
+  if (!explain)
+    return;
+  rc = sqlite3_prepare_v2 (table->db, explain, -1, &stmt, NULL);
+  sqlite3_free (explain);
+  if (rc != SQLITE_OK)
+    return;
+  while (sqlite3_step (stmt) == SQLITE_ROW)
+    fprintf (stderr, "  %s\n", sqlite3_column_text (stmt, 3));
+  sqlite3_finalize (stmt);
+}
+#endif
+
+/* Return a prepared statement of KIND whose first LEN key columns
+   are bound to the parameters ?1 to ?LEN, except where the codes M
+   have a single wildcard: such a column is any code, which is spelt
+   out as a list for the index on the key columns to be used if a code
+   follows, and otherwise only needs the key to be long enough.
+
+   LOOKUP_STATEMENT selects the id, phrase, mlen and freq of the rows
+   whose mlen is less than ?LEN+1, in the order of the candidates, up
+   to ?LEN+2 rows.
+
+   LEARNED_LOOKUP_STATEMENT does the same for a table ?LEN+3 whose
+   choices rank the candidates right after mlen, through the function
+   mimx_learned.  Sorting by a function, it cannot stop at the first
+   rows as the indexes give them, which is why LOOKUP_STATEMENT stays
+   for the tables whose user has chosen nothing yet.
+
+   MIN_MLEN_STATEMENT selects the smallest mlen of the matching rows.
+
+   ROWS_STATEMENT selects the unordered rows kept for narrowing, with
+   id, phrase, mlen, user_freq, freq and the key columns, up to ?LEN+1
+   rows.
+
+   The statement is cached in CACHE, which is either the one of the
+   table of CONTEXT or the one of CONTEXT, and reset before being
+   returned.  */
+static sqlite3_stmt *
+get_statement (TableContext *context, TableStatementCache *cache,
+	       TableStatementKind kind, const int *m, int len)
+{
+  Table *table = context->table;
+  TableStatement *ts;
+  sqlite3_str *str;
+  char *sql, *where;
+  uint64_t start, wildcards = 0;
+  int i, j, rc;
+
+  for (i = 0; i < len && i < 64; i++)
+    if (m[i] == WILDCARD_ONE)
+      wildcards |= (uint64_t) 1 << i;
+
+  for (i = 0; i < cache->n_stmts; i++)
+    {
+      ts = &cache->stmts[i];
+      if (ts->kind == kind && ts->len == len && ts->wildcards == wildcards)
+	{
+	  sqlite3_reset (ts->stmt);
+	  sqlite3_clear_bindings (ts->stmt);
+	  return ts->stmt;
+	}
+    }
+
+  if (cache->n_stmts == cache->n_allocated_stmts)
+    {
+      int n_allocated_stmts = cache->n_allocated_stmts
+	? cache->n_allocated_stmts * 2 : 4;
+
+      ts = realloc (cache->stmts,
+		    sizeof (TableStatement) * n_allocated_stmts);
+      if (!ts)
+	return NULL;
+      cache->stmts = ts;
+      cache->n_allocated_stmts = n_allocated_stmts;
+    }
+
+  str = sqlite3_str_new (table->db);
+  sqlite3_str_appendall (str, "WHERE 1");
+  for (i = 0; i < len; i++)
+    {
+      if (m[i] != WILDCARD_ONE)
+	{
+	  sqlite3_str_appendf (str, " AND m%d = ?%d", i, i + 1);
+	  continue;
+	}
+      for (j = i + 1; j < len && m[j] == WILDCARD_ONE; j++)
+	;
+      if (j == len)
+	continue;
+      sqlite3_str_appendf (str, " AND m%d IN (", i);
+      for (j = 1; j < DIM (phrase_dict); j++)
+	sqlite3_str_appendf (str, j > 1 ? ", %d" : "%d", phrase_dict[j].n);
+      sqlite3_str_appendall (str, ")");
+    }
+  if (wildcards)
+    sqlite3_str_appendf (str, " AND mlen >= %d", len);
+  where = sqlite3_str_finish (str);
+  if (!where)
+    return NULL;
+
+  str = sqlite3_str_new (table->db);
+  if (kind == LOOKUP_STATEMENT)
+    sqlite3_str_appendf (str,
+			 "SELECT id, phrase, mlen, freq FROM phrases %s"
+			 " AND mlen < ?%d"
+			 " ORDER BY mlen ASC, user_freq DESC, freq DESC, id ASC"
+			 " LIMIT ?%d",
+			 where, len + 1, len + 2);
+  else if (kind == LEARNED_LOOKUP_STATEMENT)
+    sqlite3_str_appendf (str,
+			 "SELECT id, phrase, mlen, freq FROM phrases %s"
+			 " AND mlen < ?%d"
+			 " ORDER BY mlen ASC, mimx_learned (phrase, ?%d) DESC,"
+			 " user_freq DESC, freq DESC, id ASC"
+			 " LIMIT ?%d",
+			 where, len + 1, len + 3, len + 2);
+  else if (kind == MIN_MLEN_STATEMENT)
+    sqlite3_str_appendf (str, "SELECT MIN(mlen) FROM phrases %s", where);
+  else
+    {
+      sqlite3_str_appendall (str,
+			     "SELECT id, phrase, mlen, user_freq, freq");
+      for (i = 0; i < CLAMP(table->mlen, 0, 99); i++)
+	sqlite3_str_appendf (str, ", m%d", i);
+      sqlite3_str_appendf (str, " FROM phrases %s LIMIT ?%d", where, len + 1);
+    }
+  sqlite3_free (where);
+  sql = sqlite3_str_finish (str);
+  if (!sql)
+    return NULL;
+
+#ifdef DEBUG
+  fprintf (stderr, "%s\n", sql);
+  explain_statement (table, sql);
+#endif
+  ts = &cache->stmts[cache->n_stmts];
+  STATS_START (start);
+  rc = sqlite3_prepare_v3 (table->db, sql, -1, SQLITE_PREPARE_PERSISTENT,
+			   &ts->stmt, NULL);
+  STATS_STOP (context, STATS_PREPARE, start);
+  sqlite3_free (sql);
+  if (rc != SQLITE_OK)
+    {
+      sqlite3_finalize (ts->stmt);
+      return NULL;
+    }
+  ts->kind = kind;
+  ts->len = len;
+  ts->wildcards = wildcards;
+  cache->n_stmts++;
+  return ts->stmt;
+}
+
+/* Order rows as LEARNED_LOOKUP_STATEMENT does.  */
+static int
+cmp_rows (const void *a, const void *b)
+{
+  const TableRow *ra = a, *rb = b;
+
+  if (ra->mlen != rb->mlen)
+    return ra->mlen - rb->mlen;
+  if (ra->count != rb->count)
+    return rb->count - ra->count;
+  if (ra->user_freq != rb->user_freq)
+    return rb->user_freq - ra->user_freq;
+  if (ra->freq != rb->freq)
+    return rb->freq - ra->freq;
+  return ra->id - rb->id;
+}
+
+/* Return the slot of the phrase cache of TABLE for the phrase KEY, or
+   NULL if the cache cannot be allocated.  */
+static TablePhrase *
+cached_phrase (Table *table, int key)
+{
+  if (!table->phrases)
+    {
+      table->phrases = calloc (PHRASE_CACHE_SIZE, sizeof (TablePhrase));
+      if (!table->phrases)
+	return NULL;
+      table->memory += sizeof (TablePhrase) * PHRASE_CACHE_SIZE;
+      __atomic_add_fetch (&tables_memory,
+			  sizeof (TablePhrase) * PHRASE_CACHE_SIZE,
+			  __ATOMIC_RELAXED);
+    }
+  return &table->phrases[((uint32_t) key * 2654435761U)
+			 >> (32 - PHRASE_CACHE_BITS)];
+}
+
+/* Add the phrase KEY, whose text is the SIZE bytes at TEXT, to the
+   candidates pending in CONTEXT.  The M-text is taken from the phrase
+   cache of the table if it is there, and made by flush_candidates
+   otherwise.  */
+static void
+add_candidate (TableContext *context, int key, const unsigned char *text,
+	       size_t size)
+{
+  Table *table = context->table;
+  TablePhrase *phrase;
+  TablePending *pending;
+
+  /* the candidates of several tables are merged by them */
+  if (context->parent)
+    {
+      context->cursor.count = learned_count (learned_table (context), text,
+					     size);
+      context->cursor.hash = hash_bytes (text, size);
+    }
+
+#ifdef DEBUG
+  fprintf (stderr, " %.*s\n", (int) size, text);
+#endif
+  if (context->n_pending == context->n_allocated_pending)
+    {
+      int n_allocated = context->n_allocated_pending
+	? context->n_allocated_pending * 2 : PAGE_SIZE;
+
+      pending = realloc (context->pending, sizeof (TablePending) * n_allocated);
+      if (!pending)
+	return;
+      context->pending = pending;
+      context->n_allocated_pending = n_allocated;
+    }
+  pending = &context->pending[context->n_pending];
+  pending->key = key;
+  pending->mt = NULL;
+
+  phrase = cached_phrase (table, key);
+  if (phrase && phrase->mt && phrase->key == key)
+    {
+      pending->mt = phrase->mt;
+      m17n_object_ref (pending->mt);
+      context->n_pending++;
+      return;
+    }
+
+  if (context->pending_size + size > context->allocated_pending_text)
+    {
+      size_t allocated = MAX(context->allocated_pending_text * 2,
+			     context->pending_size + size + 256);
+      unsigned char *buf = realloc (context->pending_text, allocated);
+
+      if (!buf)
+	return;
+      context->pending_text = buf;
+      context->allocated_pending_text = allocated;
+    }
+  memcpy (context->pending_text + context->pending_size, text, size);
+  pending->start = context->pending_size;
+  pending->size = size;
+  context->pending_size += size;
+  context->n_pending++;
+}
+
+/* Add the candidates pending in CONTEXT to CANDIDATES, making the
+   M-texts which the phrase cache does not have and putting them
+   there.  Their texts are checked as UTF-8 in one pass, which holds
+   for each of them as none starts in the middle of a character, and
+   only if it fails one by one, to find those which go through the
+   converter.  */
+static void
+flush_candidates (TableContext *context, MPlist *candidates)
+{
+  Table *table = context->table;
+  const unsigned char *texts = context->pending_text;
+  uint64_t start;
+  int valid, i;
+
+  STATS_START (start);
+  valid = utf8_valid (texts, context->pending_size);
+  for (i = 0; valid && i < context->n_pending; i++)
+    if (!context->pending[i].mt && context->pending[i].size
+	&& (texts[context->pending[i].start] & 0xC0) == 0x80)
+      valid = 0;
+
+  for (i = 0; i < context->n_pending; i++)
+    {
+      TablePending *pending = &context->pending[i];
+      MText *mt = pending->mt;
+
+      if (!mt)
+	{
+	  TablePhrase *phrase;
+
+	  mt = valid ? decode_utf8 (texts + pending->start, pending->size)
+	    : mtext_from_utf8 (context, texts + pending->start, pending->size);
+	  if (!mt)
+	    continue;
+	  phrase = cached_phrase (table, pending->key);
+	  if (phrase)
+	    {
+	      if (phrase->mt)
+		m17n_object_unref (phrase->mt);
+	      phrase->key = pending->key;
+	      phrase->mt = mt;
+	      m17n_object_ref (mt);
+	    }
+	}
+      mplist_add (candidates, Mtext, mt);
+      m17n_object_unref (mt);
+    }
+  context->n_pending = 0;
+  context->pending_size = 0;
+  STATS_STOP (context, STATS_DECODE, start);
+}
+
+/* Set the cursor over the rows at POSITIONS in the rows of CONTEXT,
+   which are ordered by cmp_rows.  The candidates are the rows in the
+   band of the first row, as with LOOKUP_STATEMENT.  */
+static void
+set_row_cursor (TableContext *context, int len, const int *positions,
+		int n_rows)
+{
+  TableCursor *cursor = &context->cursor;
+
+  cursor->positions = positions;
+  cursor->end = n_rows;
+  cursor->remaining = context->max_candidates ? context->max_candidates : -1;
+  if (n_rows > 0)
+    cursor->bound = MAX(len + context->xlen,
+			context->rows[positions[0]].mlen + 1);
+}
+
+/* Select the rows matching the LEN codes in M, up to LIMIT rows, and
+   sort them.  */
+static int
+select_rows (TableContext *context, const int *m, int len, int limit,
+	     TableRow **rows, int *n_rows)
+{
+  Table *table = context->table, *learned = learned_table (context);
+  int mlen = CLAMP(table->mlen, 0, 99);
+  sqlite3_stmt *stmt;
+  uint64_t start;
+  int i;
+
+  *n_rows = 0;
+  *rows = arena_alloc (&context->arena, sizeof (TableRow) * limit);
+  if (!*rows)
+    return -1;
+
+  stmt = get_statement (context, &table->stmts, ROWS_STATEMENT, m, len);
+  if (!stmt)
+    return -1;
+
+  for (i = 0; i < len; i++)
+    if (m[i] >= 0)
+      sqlite3_bind_int (stmt, i + 1, m[i]);
+  sqlite3_bind_int (stmt, len + 1, limit);
+
+  STATS_ADD (context, queries, 1);
+  STATS_START (start);
+  while (sqlite3_step (stmt) == SQLITE_ROW)
+    {
+      const unsigned char *text = sqlite3_column_text (stmt, 1);
+      size_t size = strlen ((const char *)text);
+      TableRow *row;
+
+      if (*n_rows == limit)
+	break;
+
+      row = &(*rows)[*n_rows];
+      row->id = sqlite3_column_int (stmt, 0);
+      row->mlen = CLAMP(sqlite3_column_int (stmt, 2), 0, mlen);
+      row->user_freq = sqlite3_column_int (stmt, 3);
+      row->freq = sqlite3_column_int (stmt, 4);
+      row->count = learned_count (learned, text, size);
+      row->codes = arena_alloc (&context->arena, row->mlen + size + 1);
+      if (!row->codes)
+	goto fail;
+      (*n_rows)++;
+      for (i = 0; i < row->mlen; i++)
+	row->codes[i] = sqlite3_column_int (stmt, 5 + i);
+      row->phrase = (char *)row->codes + row->mlen;
+      memcpy (row->phrase, text, size + 1);
+    }
+  sqlite3_reset (stmt);
+  STATS_STOP (context, STATS_STEP, start);
+  STATS_ADD (context, rows, *n_rows);
+
+  STATS_START (start);
+  qsort (*rows, *n_rows, sizeof (TableRow), cmp_rows);
+  STATS_STOP (context, STATS_SORT, start);
+  return 0;
+
+ fail:
+  sqlite3_reset (stmt);
+  STATS_STOP (context, STATS_STEP, start);
+  *n_rows = 0;
+  return -1;
+}
+
+/* Copy ROWS, selected in the arena, to a single block to be kept in
+   CONTEXT for narrowing.  */
+static int
+keep_rows (TableContext *context, const TableRow *rows, int n_rows)
+{
+  size_t size = sizeof (TableRow) * n_rows;
+  unsigned char *p;
+  TableRow *copy;
+  int i;
+
+  for (i = 0; i < n_rows; i++)
+    size += rows[i].mlen + strlen (rows[i].phrase) + 1;
+  copy = malloc (size);
+  if (!copy)
+    return -1;
+
+  p = (unsigned char *) (copy + n_rows);
+  for (i = 0; i < n_rows; i++)
+    {
+      size = rows[i].mlen + strlen (rows[i].phrase) + 1;
+      copy[i] = rows[i];
+      copy[i].codes = memcpy (p, rows[i].codes, size);
+      copy[i].phrase = (char *) p + rows[i].mlen;
+      p += size;
+    }
+  context->rows = copy;
+  context->n_rows = n_rows;
+  return 0;
+}
+
+/* Set the cursor over the matches in the band "mlen < BOUND".  Return
+   1 if there are any, 0 if not, and -1 on error.  */
+static int
+start_candidates (TableContext *context, const int *m, int len, int bound)
+{
+  Table *learned = learned_table (context);
+  sqlite3_stmt *stmt;
+  uint64_t start;
+  int i, rc;
+
+  if (learned && learned->n_learned)
+    {
+      stmt = get_statement (context, &context->stmts,
+			    LEARNED_LOOKUP_STATEMENT, m, len);
+      if (!stmt)
+	return -1;
+      sqlite3_bind_pointer (stmt, len + 3, learned, "mimx-table", NULL);
+    }
+  else
+    {
+      stmt = get_statement (context, &context->stmts, LOOKUP_STATEMENT,
+			    m, len);
+      if (!stmt)
+	return -1;
+    }
+
+  for (i = 0; i < len; i++)
+    if (m[i] >= 0)
+      sqlite3_bind_int (stmt, i + 1, m[i]);
+  sqlite3_bind_int (stmt, len + 1, bound);
+  sqlite3_bind_int (stmt, len + 2,
+		    context->max_candidates ? context->max_candidates : -1);
+
+  STATS_ADD (context, queries, 1);
+  STATS_START (start);
+  rc = sqlite3_step (stmt);
+  STATS_STOP (context, STATS_STEP, start);
+  if (rc != SQLITE_ROW)
+    {
+      sqlite3_reset (stmt);
+      return 0;
+    }
+  STATS_ADD (context, rows, 1);
+  context->cursor.stmt = stmt;
+  context->cursor.has_row = 1;
+  context->cursor.n_stepped = 1;
+  return 1;
+}
+
+/* Set the cursor over the matches in the narrowest band "mlen < len +
+   xlen" which is not empty, widening xlen up to the max_key_length.
+   Rather than issuing a query for each xlen, if the first band is
+   empty, the band in which the shortest match falls is taken.  Return
+   0 if there is no match at all, and 1 otherwise.  */
+static int
+lookup_candidates (TableContext *context, const int *m, int len)
+{
+  Table *table = context->table;
+  sqlite3_stmt *stmt;
+  uint64_t start;
+  int i, rc;
+
+  rc = start_candidates (context, m, len, len + context->xlen);
+  if (rc != 0)
+    return 1;
+
+  stmt = get_statement (context, &table->stmts, MIN_MLEN_STATEMENT, m, len);
+  if (!stmt)
+    return 1;
+  for (i = 0; i < len; i++)
+    if (m[i] >= 0)
+      sqlite3_bind_int (stmt, i + 1, m[i]);
+  STATS_ADD (context, queries, 1);
+  STATS_START (start);
+  rc = sqlite3_step (stmt);
+  STATS_STOP (context, STATS_STEP, start);
+  if (rc == SQLITE_ROW && sqlite3_column_type (stmt, 0) != SQLITE_NULL)
+    {
+      int bound = sqlite3_column_int (stmt, 0) + 1;
+
+      sqlite3_reset (stmt);
+      if (bound > len + context->xlen)
+	start_candidates (context, m, len, bound);
+      return 1;
+    }
+  sqlite3_reset (stmt);
+  return rc != SQLITE_ROW;
+}
+
+static int
+lookup_ibus (TableContext *context)
+{
+  unsigned char buf[256];
+  Table *table = context->table, *learned = learned_table (context);
+  TableState *state;
+  TableRow *rows;
+  int len, wlen, mlen;
+  int i, j, rc, n_rows;
+  int *m = NULL, *positions;
+
+  rc = preedit_to_utf8 (context, buf, sizeof (buf));
+  if (rc < 0)
+    return -1;
+  len = rc;
+
+  if (context->rows_serial != (learned ? learned->serial : 0)
+      || context->rows_learn_serial != (learned ? learned->learn_serial : 0))
+    {
+      clear_states (context);
+      context->rows_serial = learned ? learned->serial : 0;
+      context->rows_learn_serial = learned ? learned->learn_serial : 0;
+    }
+
+  mlen = CLAMP(table->mlen, 0, 99);
+  if (len > mlen)
+    len = mlen;
+
+  /* xlen is widened up to wlen + 1 */
+  wlen = mlen - len + 1;
+  if (context->xlen > wlen + 1)
+    return 0;
+
+  /* SQLite matches single wildcards, but not multi ones before the
+     end of the key.  */
+  rc = encode_pattern (context, buf, len, 1, &m);
+  if (rc < 0)
+    return 0;
+  if (rc > 0)
+    {
+      for (i = 0; i < rc; i++)
+	if (m[i] == WILDCARD_ANY || (m[i] == WILDCARD_ONE && i >= 64))
+	  return 0;
+      len = rc;
+    }
+  else
+    {
+      rc = encode_phrase (&context->arena, buf, &m);
+      if (rc)
+	return -1;
+    }
+
+  /* Narrow down the rows of the lookup for a prefix of the key.  */
+  state = find_state (context, (const char *)buf, len);
+  if (state)
+    {
+      if (state->len < len)
+	{
+	  positions = malloc (sizeof (int) * (state->n_rows + 1));
+	  if (!positions)
+	    return 0;
+	  STATS_ADD (context, rows, state->n_rows);
+	  for (n_rows = 0, i = 0; i < state->n_rows; i++)
+	    {
+	      const TableRow *row = &context->rows[state->rows[i]];
+
+	      if (row->mlen < len)
+		continue;
+	      for (j = state->len;
+		   j < len && (m[j] == WILDCARD_ONE || row->codes[j] == m[j]);
+		   j++)
+		;
+	      if (j == len)
+		positions[n_rows++] = state->rows[i];
+	    }
+	  state = push_state (context, (const char *)buf, len);
+	  if (!state)
+	    {
+	      free (positions);
+	      return 0;
+	    }
+	  state->rows = positions;
+	  state->n_rows = n_rows;
+	}
+      set_row_cursor (context, len, state->rows, state->n_rows);
+      return 0;
+    }
+
+  /* Otherwise select the matching rows, and keep them if there are
+     only a few.  If there are many, give up after MAX_STATE_ROWS and
+     query the candidates.  As the first keystrokes look up keys which
+     match many rows, a key is queried right away with a single
+     statement if its prefix has been queried and found more than
+     MAX_STATE_ROWS candidates, or else if nothing is known of its
+     prefix and it is shorter than MIN_STATE_LEN.  A key whose prefix
+     has been found no match has none either.  */
+  n_rows = -1;
+  if (context->queried_len > 0 && context->queried_len < len
+      && memcmp (context->queried, buf, context->queried_len) == 0)
+    n_rows = context->queried_rows;
+  clear_states (context);
+  if (n_rows == 0)
+    return 0;
+  if (n_rows < 0 ? len >= MIN_STATE_LEN : n_rows <= MAX_STATE_ROWS)
+    {
+      if (select_rows (context, m, len, MAX_STATE_ROWS + 1,
+		       &rows, &n_rows) < 0)
+	return 0;
+      if (n_rows <= MAX_STATE_ROWS)
+	{
+	  positions = malloc (sizeof (int) * (n_rows + 1));
+	  if (!positions)
+	    return 0;
+	  for (i = 0; i < n_rows; i++)
+	    positions[i] = i;
+	  if (keep_rows (context, rows, n_rows) == 0
+	      && (state = push_state (context, (const char *)buf, len)))
+	    {
+	      state->rows = positions;
+	      state->n_rows = n_rows;
+	      set_row_cursor (context, len, positions, n_rows);
+	      return 0;
+	    }
+	  free (positions);
+	  return 0;
+	}
+    }
+
+  rc = lookup_candidates (context, m, len);
+  memcpy (context->queried, buf, len);
+  context->queried_len = len;
+  context->queried_rows = rc ? -1 : 0;
+  return 0;
+}
+
+static int
+fetch_ibus (TableContext *context, MPlist *candidates, int n)
+{
+  TableCursor *cursor = &context->cursor;
+  uint64_t start;
+  int count = 0, rc;
+
+  if (cursor->positions)
+    {
+      while ((!n || count < n) && cursor->pos < cursor->end
+	     && cursor->remaining != 0)
+	{
+	  const TableRow *row = &context->rows[cursor->positions[cursor->pos]];
+
+	  if (row->mlen >= cursor->bound)
+	    {
+	      cursor->end = cursor->pos;
+	      break;
+	    }
+	  cursor->mlen = row->mlen;
+	  cursor->freq = row->freq;
+	  add_candidate (context, row->id, (const unsigned char *)row->phrase,
+			 strlen (row->phrase));
+	  cursor->pos++;
+	  if (cursor->remaining > 0)
+	    cursor->remaining--;
+	  count++;
+	}
+      flush_candidates (context, candidates);
+      return count;
+    }
+
+  while ((!n || count < n) && cursor->has_row)
+    {
+      const unsigned char *text = sqlite3_column_text (cursor->stmt, 1);
+
+      cursor->mlen = sqlite3_column_int (cursor->stmt, 2);
+      cursor->freq = sqlite3_column_int (cursor->stmt, 3);
+      add_candidate (context, sqlite3_column_int (cursor->stmt, 0),
+		     text, strlen ((const char *)text));
+      count++;
+      STATS_START (start);
+      rc = sqlite3_step (cursor->stmt);
+      STATS_STOP (context, STATS_STEP, start);
+      if (rc == SQLITE_ROW)
+	{
+	  STATS_ADD (context, rows, 1);
+	  if (++cursor->n_stepped > MAX_STATE_ROWS)
+	    context->queried_rows = cursor->n_stepped;
+	}
+      else
+	{
+	  sqlite3_reset (cursor->stmt);
+	  cursor->stmt = NULL;
+	  cursor->has_row = 0;
+	  /* unless LIMIT has cut them short */
+	  if (cursor->n_stepped <= MAX_STATE_ROWS
+	      && (!context->max_candidates
+		  || cursor->n_stepped < context->max_candidates))
+	    context->queried_rows = cursor->n_stepped;
+	}
+    }
+  flush_candidates (context, candidates);
+  return count;
+}
+
+/* Selection of the best N_MAX matches (all if N_MAX is 0), given by
+   the offsets of their entries in content for scim-tables, or their
+   positions for mimx, and ordered by CMP.  Unless all matches are
+   selected, OFFSETS is a heap whose root is the worst of the selected
+   matches, so that the selection costs O(log N_MAX) per match and
+   nothing is copied.  */
+struct _TableSelection {
+  const Table *table;
+  int (*cmp) (const Table *table, int a, int b);
+  TableArena *arena;
+  int *offsets;
+  int n, n_allocated, n_max;
+
+  /* if the user has chosen phrases of the table which ranks the
+     matches, their counts, which come before CMP, or right after the
+     length of the keys if MLEN is set.  PHRASE sets the text of an
+     entry and returns its length.  */
+  TableChosen *chosen;
+  int (*phrase) (const Table *table, int offset, const unsigned char **text);
+  int (*mlen) (const Table *table, int offset);
+};
+typedef struct _TableSelection TableSelection;
+
+/* Return how many times the user has chosen the phrase of the entry
+   at OFFSET, among the matches of CHOSEN.  */
+static int
+chosen_count (const TableChosen *chosen, int offset)
+{
+  int i, mask = chosen->n_allocated - 1;
+
+  if (!chosen->n)
+    return 0;
+  for (i = ((uint32_t) offset * 2654435761U) & mask; chosen->counts[i];
+       i = (i + 1) & mask)
+    if (chosen->offsets[i] == offset)
+      return chosen->counts[i];
+  return 0;
+}
+
+/* Add the count of the phrase of the entry at OFFSET to the chosen
+   matches of SEL, if the user has chosen it.  Return 0, or -1 on
+   error.  */
+static int
+choose_entry (TableSelection *sel, int offset)
+{
+  TableChosen *chosen = sel->chosen;
+  const unsigned char *text;
+  int size = (*sel->phrase) (sel->table, offset, &text);
+  int count = learned_count (chosen->learned, text, size);
+  int i, mask;
+
+  if (count <= 0 || chosen_count (chosen, offset))
+    return 0;
+
+  if (chosen->n * 2 >= chosen->n_allocated)
+    {
+      int n_allocated = chosen->n_allocated ? chosen->n_allocated * 2 : 16;
+      int *offsets = arena_alloc (sel->arena, sizeof (int) * n_allocated);
+      int *counts = arena_alloc (sel->arena, sizeof (int) * n_allocated);
+
+      if (!offsets || !counts)
+	return -1;
+      memset (counts, 0, sizeof (int) * n_allocated);
+      for (i = 0; i < chosen->n_allocated; i++)
+	if (chosen->counts[i])
+	  {
+	    int j = ((uint32_t) chosen->offsets[i] * 2654435761U)
+	      & (n_allocated - 1);
+
+	    while (counts[j])
+	      j = (j + 1) & (n_allocated - 1);
+	    offsets[j] = chosen->offsets[i];
+	    counts[j] = chosen->counts[i];
+	  }
+      chosen->offsets = offsets;
+      chosen->counts = counts;
+      chosen->n_allocated = n_allocated;
+    }
+
+  mask = chosen->n_allocated - 1;
+  for (i = ((uint32_t) offset * 2654435761U) & mask; chosen->counts[i];
+       i = (i + 1) & mask)
+    ;
+  chosen->offsets[i] = offset;
+  chosen->counts[i] = count;
+  chosen->n++;
+  return 0;
+}
+
+/* Set SEL to rank the matches of CONTEXT by the choices learned, if
+   the table which ranks them has any.  Return 0, or -1 on error.  */
+static int
+init_chosen (TableContext *context, TableSelection *sel)
+{
+  Table *learned = learned_table (context);
+
+  if (!learned || !learned->n_learned)
+    return 0;
+  sel->chosen = arena_alloc (&context->arena, sizeof (TableChosen));
+  if (!sel->chosen)
+    return -1;
+  memset (sel->chosen, 0, sizeof (TableChosen));
+  sel->chosen->learned = learned;
+  return 0;
+}
+
+/* Order the matches A and B of SEL.  */
+static int
+cmp_selected (const TableSelection *sel, int a, int b)
+{
+  if (sel->chosen && sel->chosen->n)
+    {
+      int ca = chosen_count (sel->chosen, a);
+      int cb = chosen_count (sel->chosen, b);
+
+      if (ca != cb
+	  && (!sel->mlen
+	      || (*sel->mlen) (sel->table, a) == (*sel->mlen) (sel->table, b)))
+	return cb - ca;
+    }
+  return (*sel->cmp) (sel->table, a, b);
+}
+
+static void
+sift_down (TableSelection *sel, int i)
+{
+  while (1)
+    {
+      int worst = i, child = 2 * i + 1, tmp;
+
+      if (child < sel->n
+	  && cmp_selected (sel, sel->offsets[child], sel->offsets[worst]) > 0)
+	worst = child;
+      if (child + 1 < sel->n
+	  && cmp_selected (sel, sel->offsets[child + 1],
+			   sel->offsets[worst]) > 0)
+	worst = child + 1;
+      if (worst == i)
+	break;
+      tmp = sel->offsets[i];
+      sel->offsets[i] = sel->offsets[worst];
+      sel->offsets[worst] = tmp;
+      i = worst;
+    }
+}
+
+static int
+append_entry (TableSelection *sel, int offset)
+{
+  if (sel->n == sel->n_allocated)
+    {
+      int n_allocated = sel->n_allocated ? sel->n_allocated * 2 : 16;
+      int *offsets = arena_realloc (sel->arena, sel->offsets,
+				    sizeof (int) * sel->n_allocated,
+				    sizeof (int) * n_allocated);
+
+      if (!offsets)
+	return -1;
+      sel->offsets = offsets;
+      sel->n_allocated = n_allocated;
+    }
+  sel->offsets[sel->n++] = offset;
+  return 0;
+}
+
+static int
+select_entry (TableSelection *sel, int offset)
+{
+  int i;
+
+  if (sel->chosen && choose_entry (sel, offset) < 0)
+    return -1;
+  if (!sel->n_max)
+    return append_entry (sel, offset);
+
+  if (sel->n == sel->n_max)
+    {
+      if (cmp_selected (sel, offset, sel->offsets[0]) < 0)
+	{
+	  sel->offsets[0] = offset;
+	  sift_down (sel, 0);
+	}
+      return 0;
+    }
+
+  if (append_entry (sel, offset) < 0)
+    return -1;
+  for (i = sel->n - 1; i > 0
+	 && cmp_selected (sel, sel->offsets[(i - 1) / 2],
+			  sel->offsets[i]) < 0; i = (i - 1) / 2)
+    {
+      sel->offsets[i] = sel->offsets[(i - 1) / 2];
+      sel->offsets[(i - 1) / 2] = offset;
+    }
+  return 0;
+}
+
+static int
+cmp_offsets (const void *a, const void *b, void *data)
+{
+  TableSelection *sel = data;
+
+  return cmp_selected (sel, *(const int *) a, *(const int *) b);
+}
+
+/* The sorted keys of a scim-tables index or of a mimx table are walked
+   as a trie, each node being the range [LO, HI) of the keys which
+   share their first DEPTH bytes.  KEY_AT returns the length of the key
+   at a position and sets its bytes, SEARCH returns the first position
+   in a range whose key is not less than the first LEN bytes of PREFIX
+   if UPPER is zero, or which does not start with them otherwise, and
+   ENTRY_AT returns the entry to select for a position and sets the
+   length of its key.  */
+typedef struct _TableWalk TableWalk;
+struct _TableWalk {
+  TableContext *context;
+  int max_depth;
+  int ibus;			/* keys widened as in an ibus-table */
+  unsigned char prefix[256];
+  int (*key_at) (TableWalk *walk, int pos, const unsigned char **key);
+  int (*search) (TableWalk *walk, int len, int upper, int lo, int hi);
+  int (*entry_at) (TableWalk *walk, int pos, int *klen);
+
+  /* mimx: the key last decoded, at POS in the keys from P */
+  unsigned char key[256];
+  int pos, klen;
+  uint64_t p;
+
+  /* wildcard lookup: the nodes reached by a step */
+  TableNode *nodes;
+  int n_nodes, n_allocated_nodes;
+
+  /* fuzzy lookup: the matches at each distance from 1 */
+  const unsigned char *word;
+  int len, max_distance;
+  int *rows;
+  TableSelection sels[FUZZY_MAX_DISTANCE];
+};
+
+/* Select into SEL the entries of the N disjoint NODES.  The widening
+   by xlen is a filter on the length of their keys, as for a key of LEN
+   bytes: up to the longest of xlen and the shortest key, or for an
+   ibus-table, in the narrowest non-empty band "mlen < LEN + xlen".  */
+static int
+select_nodes (TableWalk *walk, const TableNode *nodes, int n, int len,
+	      TableSelection *sel)
+{
+  TableContext *context = walk->context;
+  int i, j, klen, kmin = INT_MAX, kmax;
+
+  for (i = 0; i < n; i++)
+    {
+      STATS_ADD (context, entries, nodes[i].hi - nodes[i].lo);
+      for (j = nodes[i].lo; j < nodes[i].hi; j++)
+	{
+	  (*walk->entry_at) (walk, j, &klen);
+	  kmin = MIN(kmin, klen);
+	}
+    }
+  if (kmin == INT_MAX)
+    return 0;
+  if (walk->ibus)
+    kmax = MAX(len + context->xlen, kmin + 1) - 1;
+  else
+    kmax = MAX(kmin, context->xlen);
+
+  for (i = 0; i < n; i++)
+    for (j = nodes[i].lo; j < nodes[i].hi; j++)
+      {
+	int entry = (*walk->entry_at) (walk, j, &klen);
+
+	if (klen <= kmax && select_entry (sel, entry) < 0)
+	  return -1;
+      }
+  return 0;
+}
+
+/* A fuzzy lookup also matches the keys which start with a string
+   within an edit distance of the preedit, for typos.  Each node of the
+   walk carries the row of the Levenshtein distances between WORD and
+   its prefix.  As the least distance of a row never decreases down the
+   trie, a subtree is left as soon as it cannot get closer to WORD, and
+   all of its keys are then as far from it as the closest prefix on the
+   way.  */
+
+/* Return the edit distance of a fuzzy lookup of LEN bytes: none for
+   the shortest keys, whose typos would match too many.  */
+static int
+fuzzy_distance (TableContext *context, int len)
+{
+  return MIN(context->fuzzy, len < 3 ? 0 : len < 6 ? 1 : 2);
+}
+
+static int
+fuzzy_select (TableWalk *walk, int depth, int lo, int hi, int distance)
+{
+  TableNode node;
+
+  node.depth = depth;
+  node.lo = lo;
+  node.hi = hi;
+  return select_nodes (walk, &node, 1, depth, &walk->sels[distance - 1]);
+}
+
+/* Walk the node at DEPTH over the keys in [LO, HI), whose prefix is
+   BEST away from the word at the closest.  */
+static int
+fuzzy_walk (TableWalk *walk, int depth, int lo, int hi, int best)
+{
+  int len = walk->len;
+  const int *row = walk->rows + depth * (len + 1);
+  int *next = walk->rows + (depth + 1) * (len + 1);
+  const unsigned char *key;
+  int pos, end, klen, j;
+
+  for (pos = lo; pos < hi; pos++)
+    {
+      klen = (*walk->key_at) (walk, pos, &key);
+      if (klen < 0)
+	return -1;
+      if (klen > depth)
+	break;
+    }
+  if (pos > lo && best <= walk->max_distance
+      && fuzzy_select (walk, depth, lo, pos, best) < 0)
+    return -1;
+
+  for (; pos < hi; pos = end)
+    {
+      int c, least, distance;
+
+      klen = (*walk->key_at) (walk, pos, &key);
+      if (klen < 0)
+	return -1;
+      memcpy (walk->prefix, key, depth + 1);
+      c = key[depth];
+      end = MAX((*walk->search) (walk, depth + 1, 1, pos, hi), pos + 1);
+
+      next[0] = least = row[0] + 1;
+      for (j = 1; j <= len; j++)
+	{
+	  next[j] = MIN(row[j - 1] + (walk->word[j - 1] != c),
+			MIN(row[j], next[j - 1]) + 1);
+	  least = MIN(least, next[j]);
+	}
+      distance = MIN(best, next[len]);
+
+      /* the exact matches, which the lookup has already selected */
+      if (distance == 0)
+	continue;
+      if (least < distance && least <= walk->max_distance
+	  && depth + 1 < walk->max_depth)
+	{
+	  if (fuzzy_walk (walk, depth + 1, pos, end, distance) < 0)
+	    return -1;
+	}
+      else if (distance <= walk->max_distance
+	       && fuzzy_select (walk, depth + 1, pos, end, distance) < 0)
+	return -1;
+    }
+  return 0;
+}
+
+/* Append to SEL, whose matches are sorted, the keys in the first N
+   positions of the table which are within the fuzzy distance of the
+   LEN bytes at WORD, the closest first.  SEL is cut down to its n_max
+   matches.  */
+static int
+lookup_fuzzy (TableWalk *walk, TableSelection *sel,
+	      const unsigned char *word, int len, int n)
+{
+  TableContext *context = walk->context;
+  uint64_t start;
+  int d, i;
+
+  walk->max_distance = fuzzy_distance (context, len);
+  if (walk->max_distance == 0)
+    return 0;
+  walk->word = word;
+  walk->len = len;
+  walk->rows = arena_alloc (&context->arena, sizeof (int) * (len + 1)
+			    * (walk->max_depth + 1));
+  if (!walk->rows)
+    return -1;
+  for (i = 0; i <= len; i++)
+    walk->rows[i] = i;
+  for (d = 0; d < walk->max_distance; d++)
+    {
+      walk->sels[d] = *sel;
+      walk->sels[d].offsets = NULL;
+      walk->sels[d].n = walk->sels[d].n_allocated = 0;
+    }
+
+  STATS_START (start);
+  if (fuzzy_walk (walk, 0, 0, n, walk->max_distance + 1) < 0)
+    return -1;
+  STATS_STOP (context, STATS_SCAN, start);
+
+  STATS_START (start);
+  for (d = 0; d < walk->max_distance; d++)
+    {
+      TableSelection *match = &walk->sels[d];
+
+      if (match->n > 0)
+	qsort_r (match->offsets, match->n, sizeof (int), cmp_offsets, match);
+      for (i = 0; i < match->n; i++)
+	if (append_entry (sel, match->offsets[i]) < 0)
+	  return -1;
+    }
+  if (sel->n_max && sel->n > sel->n_max)
+    sel->n = sel->n_max;
+  STATS_STOP (context, STATS_SORT, start);
+  return 0;
+}
+
+/* A key with wildcards is looked up by stepping the nodes which match
+   it so far by each of its codes: to the child for a code, found by a
+   search, or to every child for a single wildcard.  After a multi
+   wildcard, the step is taken from every node under them as well.  The
+   nodes are kept in the state of the lookup, so that the next
+   keystroke goes on from them rather than from the root, and a key
+   which matches more than WILDCARD_MAX_NODES nodes finds nothing.  */
+#define WILDCARD_MAX_NODES 16384
+
+static int
+add_node (TableWalk *walk, int depth, int lo, int hi)
+{
+  TableNode *node;
+
+  if (walk->n_nodes == WILDCARD_MAX_NODES)
+    return -1;
+  if (walk->n_nodes == walk->n_allocated_nodes)
+    {
+      int n_allocated = walk->n_allocated_nodes
+	? walk->n_allocated_nodes * 2 : 16;
+      TableNode *nodes =
+	arena_realloc (&walk->context->arena, walk->nodes,
+		       sizeof (TableNode) * walk->n_allocated_nodes,
+		       sizeof (TableNode) * n_allocated);
+
+      if (!nodes)
+	return -1;
+      walk->nodes = nodes;
+      walk->n_allocated_nodes = n_allocated;
+    }
+  node = &walk->nodes[walk->n_nodes++];
+  node->depth = depth;
+  node->lo = lo;
+  node->hi = hi;
+  return 0;
+}
+
+/* Add to the nodes of WALK the child for C of the node at DEPTH over
+   [LO, HI), or all its children if C is WILDCARD_ONE, and if ANY, the
+   ones of every node under it as well.  */
+static int
+step_node (TableWalk *walk, int depth, int lo, int hi, int c, int any)
+{
+  const unsigned char *key;
+  int pos, end, klen;
+
+  if (c != WILDCARD_ONE && !any)
+    {
+      klen = (*walk->key_at) (walk, lo, &key);
+      if (klen < depth)
+	return -1;
+      memcpy (walk->prefix, key, depth);
+      walk->prefix[depth] = c;
+      lo = (*walk->search) (walk, depth + 1, 0, lo, hi);
+      hi = (*walk->search) (walk, depth + 1, 1, lo, hi);
+      return lo < hi ? add_node (walk, depth + 1, lo, hi) : 0;
+    }
+
+  for (pos = lo; pos < hi; pos = end)
+    {
+      int match;
+
+      klen = (*walk->key_at) (walk, pos, &key);
+      if (klen < 0)
+	return -1;
+      if (klen <= depth)
+	{
+	  end = pos + 1;
+	  continue;
+	}
+      memcpy (walk->prefix, key, depth + 1);
+      match = c == WILDCARD_ONE || key[depth] == c;
+      end = MAX((*walk->search) (walk, depth + 1, 1, pos, hi), pos + 1);
+      if (match && add_node (walk, depth + 1, pos, end) < 0)
+	return -1;
+      if (any && depth + 1 < walk->max_depth
+	  && step_node (walk, depth + 1, pos, end, c, any) < 0)
+	return -1;
+    }
+  return 0;
+}
+
+static int
+cmp_nodes (const void *a, const void *b)
+{
+  const TableNode *na = a, *nb = b;
+
+  if (na->lo != nb->lo)
+    return na->lo - nb->lo;
+  return na->depth - nb->depth;
+}
+
+/* Sort the N NODES and drop those under another one.  Return the
+   number of nodes left.  */
+static int
+outer_nodes (TableNode *nodes, int n)
+{
+  int i, n_outer = 0;
+
+  qsort (nodes, n, sizeof (TableNode), cmp_nodes);
+  for (i = 0; i < n; i++)
+    if (n_outer == 0 || nodes[i].lo >= nodes[n_outer - 1].hi)
+      nodes[n_outer++] = nodes[i];
+  return n_outer;
+}
+
+/* Select into SEL the keys in the first N positions of the table which
+   match the LEN codes or bytes of PATTERN, the wildcards of the LEN
+   bytes of KEY.  The walk starts from the innermost state for a prefix
+   of KEY, and the nodes it reaches are kept in a state for KEY.  */
+static int
+lookup_wildcard (TableWalk *walk, const char *key, const int *pattern,
+		 int len, int n, TableSelection *sel)
+{
+  TableContext *context = walk->context;
+  TableState *state;
+  TableNode root, *nodes, *outer;
+  uint64_t start;
+  int n_nodes, any = 0, n_codes = 0, n_fixed = 0, i, j;
+
+  STATS_START (start);
+  state = find_state (context, key, len);
+  if (state && state->nodes)
+    {
+      nodes = state->nodes;
+      n_nodes = state->n_nodes;
+      any = state->any;
+    }
+  else
+    {
+      root.depth = state ? state->len : 0;
+      root.lo = state ? state->lo : 0;
+      root.hi = state ? state->hi : n;
+      nodes = &root;
+      n_nodes = root.lo < root.hi;
+    }
+
+  for (i = state ? state->len : 0; i < len; i++)
+    {
+      if (pattern[i] == WILDCARD_ANY)
+	{
+	  any = 1;
+	  continue;
+	}
+      walk->nodes = NULL;
+      walk->n_nodes = walk->n_allocated_nodes = 0;
+      if (any)
+	{
+	  /* the nodes under another one are walked from it */
+	  TableNode *copy = arena_alloc (&context->arena,
+					 sizeof (TableNode) * (n_nodes + 1));
+
+	  if (!copy)
+	    return -1;
+	  if (n_nodes > 0)
+	    memcpy (copy, nodes, sizeof (TableNode) * n_nodes);
+	  nodes = copy;
+	  n_nodes = outer_nodes (nodes, n_nodes);
+	}
+      for (j = 0; j < n_nodes; j++)
+	if (step_node (walk, nodes[j].depth, nodes[j].lo, nodes[j].hi,
+		       pattern[i], any) < 0)
+	  return -1;
+      nodes = walk->nodes;
+      n_nodes = walk->n_nodes;
+      any = 0;
+    }
+
+  for (i = 0; i < len; i++)
+    if (pattern[i] >= 0)
+      n_codes++;
+
+  /* without the multi wildcards at its end, the key may have none
+     left, and its state is then the range of the other lookups */
+  if (!state || state->len < len)
+    {
+      state = push_state (context, key, len);
+      if (state && n_codes == len)
+	{
+	  state->lo = n_nodes ? nodes[0].lo : 0;
+	  state->hi = n_nodes ? nodes[0].hi : 0;
+	}
+      else if (state)
+	{
+	  state->nodes = malloc (sizeof (TableNode) * (n_nodes + 1));
+	  if (!state->nodes)
+	    {
+	      free_state (state);
+	      context->n_states--;
+	    }
+	  else
+	    {
+	      if (n_nodes > 0)
+		memcpy (state->nodes, nodes, sizeof (TableNode) * n_nodes);
+	      state->n_nodes = n_nodes;
+	      state->any = any;
+	    }
+	}
+    }
+
+  outer = arena_alloc (&context->arena, sizeof (TableNode) * (n_nodes + 1));
+  if (!outer)
+    return -1;
+  if (n_nodes > 0)
+    memcpy (outer, nodes, sizeof (TableNode) * n_nodes);
+  n_nodes = outer_nodes (outer, n_nodes);
+  for (i = 0; i < len; i++)
+    if (pattern[i] != WILDCARD_ANY)
+      n_fixed++;
+  if (select_nodes (walk, outer, n_nodes, n_fixed, sel) < 0)
+    return -1;
+  STATS_STOP (context, STATS_SCAN, start);
+
+  STATS_START (start);
+  if (sel->n > 0)
+    qsort_r (sel->offsets, sel->n, sizeof (int), cmp_offsets, sel);
+  STATS_STOP (context, STATS_SORT, start);
+  return 0;
+}
+
+/* Find the range of the key index whose keys start with WORD.  The
+   matching keys form a contiguous range, found with two binary
+   searches within the range of the innermost state for a prefix of
+   WORD, which is then narrowed down.  */
+static int
+search_range (TableContext *context, const char *word, int len,
+	      int *lo, int *hi)
+{
+  const TableKeyIndex *index = &context->table->index;
+  uint64_t lo_key[(99 + KEY_CODES_PER_WORD - 1) / KEY_CODES_PER_WORD];
+  uint64_t hi_key[DIM (lo_key)];
+  TableState *state;
+
+  state = find_state (context, word, len);
+  if (state && state->len == len)
+    {
+      *lo = state->lo;
+      *hi = state->hi;
+      return 0;
+    }
+
+  if (index->n_words > DIM (lo_key))
+    return -1;
+
+  if (pack_key ((const unsigned char *) word, len, 0,
+		lo_key, index->n_words) < 0
+      || pack_key ((const unsigned char *) word, len, KEY_CODE_MAX,
+		   hi_key, index->n_words) < 0)
+    {
+      *lo = *hi = 0;
+      return 0;
+    }
+
+  *lo = search_index (index, lo_key, 0,
+		      state ? state->lo : 0, state ? state->hi : index->len);
+  *hi = search_index (index, hi_key, 1, *lo, state ? state->hi : index->len);
+
+  state = push_state (context, word, len);
+  if (state)
+    {
+      state->lo = *lo;
+      state->hi = *hi;
+    }
+  return 0;
+}
+
+/* Set the cursor over the phrases in the range [LO, HI) of the key
+   index, whose keys are LEN long.  The widening by xlen is a filter on
+   the key lengths in the range.  If the range is a group of the
+   postings, its entries are already in order and the cursor steps
+   through them, so that only the ones added to the candidates are
+   looked at.  Otherwise the matches are selected in SEL, which the
+   caller sorts.  */
+static int
+search_phrases (TableContext *context, int len, int lo, int hi,
+		TableSelection *sel)
+{
+  Table *table = context->table;
+  const TableKeyIndex *index = &table->index;
+  TableCursor *cursor = &context->cursor;
+  int i, kmax;
+
+  if (lo == hi)
+    return 0;
+
+  /* the postings are in the order of the table, and the matches the
+     user has chosen go before the others */
+  if (len > 0 && len <= POSTING_DEPTH && index->postings[len - 1]
+      && !fuzzy_distance (context, len) && !sel->chosen)
+    {
+      /* all the keys in the narrowest non-empty band [1, xlen] */
+      cursor->postings = index->postings[len - 1];
+      cursor->kmax = MAX(index->kmin[len - 1][lo], context->xlen);
+      cursor->pos = lo;
+      cursor->end = hi;
+      cursor->remaining = sel->n_max ? sel->n_max : -1;
+      return 0;
+    }
+
+  STATS_ADD (context, entries, hi - lo);
+  kmax = table->mlen;
+  for (i = lo; i < hi; i++)
+    {
+      int offset = index_entry (table, i);
+
+      if (offset >= 0)
+	kmax = MIN(kmax, entry_klen (table, offset));
+    }
+  kmax = MAX(kmax, context->xlen);
+
+  for (i = lo; i < hi; i++)
+    {
+      int offset = index_entry (table, i);
+
+      if (offset >= 0 && entry_klen (table, offset) <= kmax
+	  && select_entry (sel, offset) < 0)
+	return -1;
+    }
+  return 0;
+}
+
+static int
+index_key_at (TableWalk *walk, int pos, const unsigned char **key)
+{
+  const TableKeyIndex *index = &walk->context->table->index;
+  int i, code;
+
+  for (i = 0; i < index->n_words * KEY_CODES_PER_WORD; i++)
+    {
+      code = index_code (index, pos, i);
+      if (code == 0)
+	break;
+      walk->key[i] = phrase_dec_dict[code];
+    }
+  *key = walk->key;
+  return i;
+}
+
+static int
+index_search (TableWalk *walk, int len, int upper, int lo, int hi)
+{
+  const TableKeyIndex *index = &walk->context->table->index;
+  uint64_t key[(99 + KEY_CODES_PER_WORD - 1) / KEY_CODES_PER_WORD];
+
+  if (index->n_words > DIM (key)
+      || pack_key (walk->prefix, len, upper ? KEY_CODE_MAX : 0,
+		   key, index->n_words) < 0)
+    return hi;
+  return search_index (index, key, upper, lo, hi);
+}
+
+static int
+index_entry_at (TableWalk *walk, int pos, int *klen)
+{
+  Table *table = walk->context->table;
+  int offset = index_entry (table, pos);
+
+  /* longer than any key, so that the entry is not selected */
+  *klen = offset < 0 ? INT_MAX : entry_klen (table, offset);
+  return offset;
+}
+
+static void
+init_index_walk (TableContext *context, TableWalk *walk)
+{
+  walk->context = context;
+  walk->max_depth = MIN(context->table->mlen, DIM (walk->prefix) - 1);
+  walk->ibus = 0;
+  walk->key_at = index_key_at;
+  walk->search = index_search;
+  walk->entry_at = index_entry_at;
+}
+
+/* The scan of the entries whose keys are not in the key index is split
+   into chunks of SCAN_CHUNK_SIZE entries of a bucket of offsets, which
+   the threads of a pool take in turn.  The pool is started for the
+   first scan of at least SCAN_PARALLEL_MIN entries, and each thread
+   collects the matches into its own buffer, which are then selected
+   on the thread of the lookup.  */
+#define SCAN_MAX_THREADS 8
+#define SCAN_CHUNK_SIZE 16384
+#define SCAN_PARALLEL_MIN 65536
+
+/* a scan of the buckets from LO to HI - 1 */
+struct _ScanJob {
+  const Table *table;
+  const unsigned char *word;
+  int len, lo, hi;
+  int n_chunks, n_threads;
+  int next, failed;
+};
+typedef struct _ScanJob ScanJob;
+
+struct _ScanBuffer {
+  int *offsets;
+  int n, n_allocated;
+  unsigned int generation;	/* of the last job seen by the thread */
+};
+typedef struct _ScanBuffer ScanBuffer;
+
+/* Threads wait for START to run JOB when GENERATION changes, and the
+   last of the N_BUSY ones signals DONE.  BUFFERS[0] is the one of the
+   thread of the lookup.  */
+struct _ScanPool {
+  pthread_mutex_t mutex;
+  pthread_cond_t start, done;
+  pthread_t threads[SCAN_MAX_THREADS - 1];
+  int n_threads;
+  ScanJob *job;
+  unsigned int generation;
+  int n_busy, stop;
+  ScanBuffer buffers[SCAN_MAX_THREADS];
+};
+typedef struct _ScanPool ScanPool;
+
+static ScanPool scan_pool =
+  {
+    PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+    PTHREAD_COND_INITIALIZER
+  };
+
+/* Return the bucket of the chunk C of JOB, setting *START to its
+   first entry.  */
+static const TableOffsetArray *
+job_chunk (const ScanJob *job, int c, int *start)
+{
+  const TableOffsetArray *array = job->table->offsets;
+  int j;
+
+  for (j = job->lo; j < job->hi; j++)
+    {
+      int n = (array[j].len + SCAN_CHUNK_SIZE - 1) / SCAN_CHUNK_SIZE;
+
+      if (c < n)
+	{
+	  *start = c * SCAN_CHUNK_SIZE;
+	  return &array[j];
+	}
+      c -= n;
+    }
+  assert (0);
+  return NULL;
+}
+
+/* Set the bits of MATCHES for the entries of the chunk C of JOB whose
+   keys start with the word, and return the bucket of the chunk.  The
+   prefixes are compared in batches, and the rest of the word only
+   with the keys whose prefixes match.  */
+static const TableOffsetArray *
+match_chunk (const ScanJob *job, int c, int *start, int *end,
+	     uint64_t *matches)
+{
+  const TableOffsetArray *array = job_chunk (job, c, start);
+  int i, n;
+
+  *end = MIN(*start + SCAN_CHUNK_SIZE, array->len);
+  n = *end - *start;
+  (*match_prefixes) (array->prefixes + *start, n,
+		     mimx_match_prefix (job->word, job->len),
+		     mimx_match_mask (job->len), matches);
+  if (job->len <= MIMX_PREFIX_SIZE)
+    return array;
+
+  for (i = 0; i < n; i++)
+    if ((matches[i / 64] >> (i % 64) & 1)
+	&& memcmp (&job->table->content[array->data[*start + i] + 4
+					+ MIMX_PREFIX_SIZE],
+		   job->word + MIMX_PREFIX_SIZE,
+		   job->len - MIMX_PREFIX_SIZE) != 0)
+      matches[i / 64] &= ~((uint64_t) 1 << (i % 64));
+  return array;
+}
+
+/* Add the offsets of the entries whose keys start with the word of
+   JOB to BUFFER, from the chunks not yet taken by the other
+   threads.  */
+static void
+scan_chunks (ScanJob *job, ScanBuffer *buffer)
+{
+  uint64_t matches[SCAN_CHUNK_SIZE / 64];
+  int c, i, start, end;
+
+  while ((c = __atomic_fetch_add (&job->next, 1, __ATOMIC_RELAXED))
+	 < job->n_chunks)
+    {
+      const TableOffsetArray *array = match_chunk (job, c, &start, &end,
+						   matches);
+
+      for (i = 0; i < (end - start + 63) / 64; i++)
+	{
+	  uint64_t bits = matches[i];
+
+	  while (bits)
+	    {
+	      if (buffer->n == buffer->n_allocated)
+		{
+		  int n_allocated = buffer->n_allocated
+		    ? buffer->n_allocated * 2 : 16;
+		  int *offsets = realloc (buffer->offsets,
+					  sizeof (int) * n_allocated);
+
+		  if (!offsets)
+		    {
+		      __atomic_store_n (&job->failed, 1, __ATOMIC_RELAXED);
+		      return;
+		    }
+		  buffer->offsets = offsets;
+		  buffer->n_allocated = n_allocated;
+		}
+	      buffer->offsets[buffer->n++] =
+		array->data[start + i * 64 + __builtin_ctzll (bits)];
+	      bits &= bits - 1;
+	    }
+	}
+    }
+}
+
+static void *
+scan_worker (void *data)
+{
+  ScanPool *pool = &scan_pool;
+  ScanBuffer *buffer = data;
+
+  pthread_mutex_lock (&pool->mutex);
+  while (1)
+    {
+      ScanJob *job;
+
+      while (!pool->stop && pool->generation == buffer->generation)
+	pthread_cond_wait (&pool->start, &pool->mutex);
+      if (pool->stop)
+	break;
+      buffer->generation = pool->generation;
+      job = pool->job;
+      pthread_mutex_unlock (&pool->mutex);
+
+      if (buffer - pool->buffers < job->n_threads)
+	scan_chunks (job, buffer);
+
+      pthread_mutex_lock (&pool->mutex);
+      if (--pool->n_busy == 0)
+	pthread_cond_signal (&pool->done);
+    }
+  pthread_mutex_unlock (&pool->mutex);
+  return NULL;
+}
+
+/* Start threads so that the pool has N_THREADS, counting the thread
+   of the lookup, and return how many of them a scan may use.  */
+static int
+start_scan_pool (int n_threads)
+{
+  ScanPool *pool = &scan_pool;
+
+  n_threads = MIN(n_threads, SCAN_MAX_THREADS);
+  pthread_mutex_lock (&pool->mutex);
+  while (pool->n_threads + 1 < n_threads)
+    {
+      ScanBuffer *buffer = &pool->buffers[pool->n_threads + 1];
+
+      buffer->generation = pool->generation;
+      if (pthread_create (&pool->threads[pool->n_threads], NULL,
+			  scan_worker, buffer) != 0)
+	break;
+      pool->n_threads++;
+    }
+  pthread_mutex_unlock (&pool->mutex);
+  return MIN(n_threads, pool->n_threads + 1);
+}
+
+static void
+stop_scan_pool (void)
+{
+  ScanPool *pool = &scan_pool;
+  int i;
+
+  pthread_mutex_lock (&pool->mutex);
+  pool->stop = 1;
+  pthread_cond_broadcast (&pool->start);
+  pthread_mutex_unlock (&pool->mutex);
+
+  for (i = 0; i < pool->n_threads; i++)
+    pthread_join (pool->threads[i], NULL);
+  pool->n_threads = 0;
+  pool->stop = 0;
+
+  for (i = 0; i < SCAN_MAX_THREADS; i++)
+    {
+      free (pool->buffers[i].offsets);
+      memset (&pool->buffers[i], 0, sizeof (ScanBuffer));
+    }
+}
+
+/* Select the entries whose keys are at most KLEN long and start with
+   the LEN bytes of WORD, scanning the buckets of offsets on the
+   threads of the pool if there are enough of them.  The keys shorter
+   than WORD are not looked at.  */
+static int
+scan_entries (TableContext *context, const char *word, int len, int klen,
+	      TableSelection *sel)
+{
+  Table *table = context->table;
+  ScanPool *pool = &scan_pool;
+  ScanJob job;
+  int n_threads = context->scan_threads, n_entries = 0, i, j;
+
+  if (n_threads == 0)
+    n_threads = sysconf (_SC_NPROCESSORS_ONLN);
+
+  memset (&job, 0, sizeof job);
+  job.table = table;
+  job.word = (const unsigned char *) word;
+  job.len = len;
+  job.lo = MAX(len, 1) - 1;
+  job.hi = klen;
+  for (j = job.lo; j < job.hi; j++)
+    {
+      n_entries += table->offsets[j].len;
+      job.n_chunks += (table->offsets[j].len + SCAN_CHUNK_SIZE - 1)
+	/ SCAN_CHUNK_SIZE;
+    }
+  STATS_ADD (context, entries, n_entries);
+
+  if (n_threads <= 1 || n_entries < SCAN_PARALLEL_MIN
+      || (n_threads = start_scan_pool (n_threads)) <= 1)
+    {
+      uint64_t matches[SCAN_CHUNK_SIZE / 64];
+      int c, start, end;
+
+      for (c = 0; c < job.n_chunks; c++)
+	{
+	  const TableOffsetArray *array = match_chunk (&job, c, &start, &end,
+						       matches);
+
+	  for (i = 0; i < (end - start + 63) / 64; i++)
+	    {
+	      uint64_t bits = matches[i];
+
+	      for (; bits; bits &= bits - 1)
+		if (select_entry (sel, array->data[start + i * 64
+						   + __builtin_ctzll (bits)])
+		    < 0)
+		  return -1;
+	    }
+	}
+      return 0;
+    }
+
+  job.n_threads = n_threads;
+  for (i = 0; i < n_threads; i++)
+    pool->buffers[i].n = 0;
+
+  pthread_mutex_lock (&pool->mutex);
+  pool->job = &job;
+  pool->generation++;
+  pool->n_busy = pool->n_threads;
+  pthread_cond_broadcast (&pool->start);
+  pthread_mutex_unlock (&pool->mutex);
+
+  scan_chunks (&job, &pool->buffers[0]);
+
+  pthread_mutex_lock (&pool->mutex);
+  while (pool->n_busy > 0)
+    pthread_cond_wait (&pool->done, &pool->mutex);
+  pool->job = NULL;
+  pthread_mutex_unlock (&pool->mutex);
+
+  if (job.failed)
+    return -1;
+  for (i = 0; i < n_threads; i++)
+    for (j = 0; j < pool->buffers[i].n; j++)
+      if (select_entry (sel, pool->buffers[i].offsets[j]) < 0)
+	return -1;
+  return 0;
+}
+
+static int
+lookup_scim (TableContext *context)
+{
+  unsigned char buf[256];
+  Table *table = context->table;
+  TableCursor *cursor = &context->cursor;
+  const char *word = (const char *)buf;
+  int rc, len, xlen, *pattern;
+  TableSelection sel;
+  TableWalk walk;
+  uint64_t start;
+
+  memset (&sel, 0, sizeof sel);
+
+  rc = preedit_to_utf8 (context, buf, sizeof (buf));
+  if (rc < 0 || rc >= table->mlen)
+    return 0;
+  len = rc;
+
+  if (context->xlen > table->mlen)
+    return 0;
+
+  sel.table = table;
+  sel.cmp = cmp_entries;
+  sel.arena = &context->arena;
+  sel.n_max = context->max_candidates;
+  sel.phrase = entry_phrase;
+  if (init_chosen (context, &sel) < 0)
+    goto fail;
+
+  /* a key with wildcards is only looked up in the key index */
+  rc = encode_pattern (context, buf, len, 0, &pattern);
+  if (rc < 0 || (rc > 0 && !table->index.data))
+    return 0;
+  if (table->index.data)
+    init_index_walk (context, &walk);
+  if (rc > 0)
+    {
+      if (lookup_wildcard (&walk, word, pattern, rc, table->index.len,
+			   &sel) < 0)
+	goto fail;
+      goto done;
+    }
+
+  STATS_START (start);
+  if (table->index.data)
+    {
+      int lo, hi;
+
+      if (search_range (context, word, len, &lo, &hi) < 0
+	  || search_phrases (context, len, lo, hi, &sel) < 0)
+	goto fail;
+    }
+  else
+    {
+      for (xlen = context->xlen; xlen <= table->mlen && sel.n == 0; xlen++)
+	if (scan_entries (context, word, len, xlen, &sel) < 0)
+	  goto fail;
+    }
+  STATS_STOP (context, STATS_SCAN, start);
+
+  STATS_START (start);
+  if (sel.n > 0)
+    qsort_r (sel.offsets, sel.n, sizeof (int), cmp_offsets, &sel);
+  STATS_STOP (context, STATS_SORT, start);
+
+  /* the fuzzy lookup needs the key index */
+  if (table->index.data
+      && lookup_fuzzy (&walk, &sel, buf, len, table->index.len) < 0)
+    goto fail;
+
+ done:
+  if (!cursor->postings)
+    {
+      cursor->offsets = sel.offsets;
+      cursor->end = sel.n;
+      cursor->remaining = -1;
+    }
+  return 0;
+
+ fail:
+  return -1;
+}
+
+static int
+fetch_scim (TableContext *context, MPlist *candidates, int n)
+{
+  Table *table = context->table;
+  TableCursor *cursor = &context->cursor;
+  int count = 0;
+
+  while ((!n || count < n) && cursor->pos < cursor->end
+	 && cursor->remaining != 0)
+    {
+      unsigned char *data;
+      int offset;
+
+      if (cursor->postings)
+	{
+	  offset = index_entry (table, cursor->postings[cursor->pos++]);
+	  STATS_ADD (context, entries, 1);
+	  if (offset < 0 || entry_klen (table, offset) > cursor->kmax)
+	    continue;
+	}
+      else
+	offset = cursor->offsets[cursor->pos++];
+
+      data = &table->content[offset];
+      cursor->mlen = entry_klen (table, offset);
+      cursor->freq = entry_freq (table, offset);
+      add_candidate (context, offset, data + 4 + (*data & 0x3F),
+		     *(data + 1));
+      if (cursor->remaining > 0)
+	cursor->remaining--;
+      count++;
+    }
+  flush_candidates (context, candidates);
+  return count;
+}
+
+static void
+close_mimx (Table *table)
+{
+  if (table->mem)
+    munmap (table->mem, table->memlen);
+  if (table->fp)
+    fclose (table->fp);
+  table->mem = NULL;
+  table->fp = NULL;
+  table->mimx = NULL;
+}
+
+/* Return 1 if the part of SIZE bytes at OFFSET is in the file of LEN
+   bytes and aligned.  */
+static int
+mimx_part_valid (uint64_t offset, uint64_t size, uint64_t len)
+{
+  return offset % 8 == 0 && offset <= len && size <= len - offset;
+}
+
+static int
+open_mimx (Table *table)
+{
+  const MimxHeader *header;
+  uint64_t n_entries, block_size, n_blocks;
+  struct stat st;
+  void *mem;
+
+  table->fp = fopen (table->file, "rb");
+  if (!table->fp)
+    return -1;
+
+  if (fstat (fileno (table->fp), &st) < 0
+      || st.st_size < (off_t) sizeof (MimxHeader))
+    goto fail;
+  mem = mmap (0, st.st_size, PROT_READ, MAP_PRIVATE, fileno (table->fp), 0);
+  if (mem == MAP_FAILED)
+    goto fail;
+  table->mem = mem;
+  table->memlen = st.st_size;
+
+  header = mem;
+  n_entries = MIMX32 (header->n_entries);
+  block_size = MIMX32 (header->block_size);
+  n_blocks = MIMX32 (header->n_blocks);
+  if (memcmp (header->magic, MIMX_MAGIC, sizeof header->magic) != 0
+      || MIMX32 (header->version) != MIMX_VERSION
+      || n_entries > INT_MAX
+      || block_size == 0
+      || n_blocks != (n_entries + block_size - 1) / block_size
+      || !mimx_part_valid (MIMX64 (header->blocks),
+			   sizeof (uint32_t) * n_blocks, table->memlen)
+      || !mimx_part_valid (MIMX64 (header->keys),
+			   MIMX64 (header->keys_size), table->memlen)
+      || !mimx_part_valid (MIMX64 (header->entries),
+			   sizeof (MimxEntry) * n_entries, table->memlen)
+      || !mimx_part_valid (MIMX64 (header->pool),
+			   MIMX64 (header->pool_size), table->memlen))
+    goto fail;
+
+  table->mimx = header;
+  table->mimx_blocks = (const uint32_t *)
+    ((const char *) mem + MIMX64 (header->blocks));
+  table->mimx_keys = (const unsigned char *) mem + MIMX64 (header->keys);
+  table->mimx_entries = (const MimxEntry *)
+    ((const char *) mem + MIMX64 (header->entries));
+  table->mimx_pool = (const unsigned char *) mem + MIMX64 (header->pool);
+  table->mlen = CLAMP(MIMX32 (header->mlen), 1, 99);
+  return 0;
+
+ fail:
+  close_mimx (table);
+  return -1;
+}
+
+/* Decode the key at *P in the keys of a mimx table, following the
+   key of LEN bytes in KEY, which holds 256 bytes.  Return the length
+   of the key, or -1 if it is broken.  */
+static int
+mimx_next_key (const Table *table, uint64_t *p, unsigned char *key, int len)
+{
+  uint64_t keys_size = MIMX64 (table->mimx->keys_size);
+  const unsigned char *keys = table->mimx_keys;
+  int shared, n;
+
+  if (*p + 2 > keys_size)
+    return -1;
+  shared = keys[*p];
+  n = keys[*p + 1];
+  if (shared > len || shared + n > 255 || *p + 2 + n > keys_size)
+    return -1;
+  memcpy (key + shared, keys + *p + 2, n);
+  *p += 2 + n;
+  return shared + n;
+}
+
+/* Return 1 if the key of KLEN bytes at KEY comes after the keys
+   which are less than the LEN bytes at WORD, or if UPPER, after the
+   ones which start with them.  */
+static int
+mimx_key_past (const unsigned char *key, int klen,
+	       const unsigned char *word, int len, int upper)
+{
+  int rc = memcmp (key, word, MIN(klen, len));
+
+  if (rc != 0)
+    return rc > 0;
+  return !upper && klen >= len;
+}
+
+/* Return the first position in [LO, HI) of the keys of a mimx table
+   which is past the LEN bytes at WORD, as told by mimx_key_past, or
+   HI.  The first keys of the blocks are binary searched, and the
+   block before the first one past WORD is scanned.  */
+static int
+search_mimx (const Table *table, const unsigned char *word, int len,
+	     int upper, int lo, int hi)
+{
+  int block_size = MIMX32 (table->mimx->block_size);
+  unsigned char key[256];
+  int l, r, i, klen;
+  uint64_t p;
+
+  if (lo == hi)
+    return lo;
+
+  l = lo / block_size + 1;
+  r = (hi - 1) / block_size + 1;
+  while (l < r)
+    {
+      int m = l + (r - l) / 2;
+
+      p = MIMX32 (table->mimx_blocks[m]);
+      klen = mimx_next_key (table, &p, key, 0);
+      if (klen < 0 || mimx_key_past (key, klen, word, len, upper))
+	r = m;
+      else
+	l = m + 1;
+    }
+
+  p = MIMX32 (table->mimx_blocks[l - 1]);
+  for (i = (l - 1) * block_size, klen = 0; i < MIN(l * block_size, hi); i++)
+    {
+      klen = mimx_next_key (table, &p, key, klen);
+      if (klen < 0)
+	return MAX(i, lo);
+      if (i >= lo && mimx_key_past (key, klen, word, len, upper))
+	return i;
+    }
+  return MIN(l * block_size, hi);
+}
+
+static int
+mimx_entry_phrase (const Table *table, int i, const unsigned char **text)
+{
+  const MimxEntry *entry = &table->mimx_entries[i];
+  uint32_t phrase = MIMX32 (entry->phrase);
+  uint32_t plen = MIMX16 (entry->plen);
+
+  *text = table->mimx_pool;
+  if ((uint64_t) phrase + plen > MIMX64 (table->mimx->pool_size))
+    return 0;
+  *text += phrase;
+  return plen;
+}
+
+static int
+mimx_entry_mlen (const Table *table, int i)
+{
+  return table->mimx_entries[i].mlen;
+}
+
+static int
+cmp_mimx_entries (const Table *table, int a, int b)
+{
+  uint32_t ra = MIMX32 (table->mimx_entries[a].rank);
+  uint32_t rb = MIMX32 (table->mimx_entries[b].rank);
+
+  return ra < rb ? -1 : ra > rb;
+}
+
+/* Decode the keys forward from the last one decoded if it is in the
+   same block before POS, as a walk mostly goes through the keys in
+   order.  */
+static int
+mimx_key_at (TableWalk *walk, int pos, const unsigned char **key)
+{
+  const Table *table = walk->context->table;
+  int block_size = MIMX32 (table->mimx->block_size);
+
+  if (walk->pos < 0 || walk->pos > pos
+      || walk->pos / block_size != pos / block_size)
+    {
+      walk->p = MIMX32 (table->mimx_blocks[pos / block_size]);
+      walk->pos = pos / block_size * block_size;
+      walk->klen = mimx_next_key (table, &walk->p, walk->key, 0);
+    }
+  for (; walk->pos < pos && walk->klen >= 0; walk->pos++)
+    walk->klen = mimx_next_key (table, &walk->p, walk->key, walk->klen);
+  if (walk->klen < 0)
+    walk->pos = -1;
+  *key = walk->key;
+  return walk->klen;
+}
+
+static int
+mimx_search (TableWalk *walk, int len, int upper, int lo, int hi)
+{
+  return search_mimx (walk->context->table, walk->prefix, len, upper,
+		      lo, hi);
+}
+
+static int
+mimx_entry_at (TableWalk *walk, int pos, int *klen)
+{
+  *klen = walk->context->table->mimx_entries[pos].mlen;
+  return pos;
+}
+
+static void
+init_mimx_walk (TableContext *context, TableWalk *walk)
+{
+  walk->context = context;
+  walk->max_depth = MIN(context->table->mlen, DIM (walk->prefix) - 1);
+  walk->ibus = !(MIMX32 (context->table->mimx->flags) & MIMX_SCIM);
+  walk->key_at = mimx_key_at;
+  walk->search = mimx_search;
+  walk->entry_at = mimx_entry_at;
+  walk->pos = -1;
+}
+
+/* Select the matches as the source table of the mimx table does:
+   for a scim-tables, the keys up to the longest of xlen and the
+   shortest match, and for an ibus-table, the keys in the narrowest
+   non-empty band "mlen < len + xlen".  */
+static int
+lookup_mimx (TableContext *context)
+{
+  unsigned char buf[256];
+  Table *table = context->table;
+  const MimxEntry *entries = table->mimx_entries;
+  unsigned char *key;
+  TableCursor *cursor = &context->cursor;
+  TableSelection sel;
+  TableWalk walk;
+  TableState *state;
+  int scim = MIMX32 (table->mimx->flags) & MIMX_SCIM;
+  int rc, len, lo, hi, i, kmin, kmax, *pattern;
+  uint64_t start;
+
+  rc = preedit_to_utf8 (context, buf, sizeof (buf));
+  if (rc < 0)
+    return -1;
+  len = rc;
+
+  if (scim)
+    {
+      if (len >= table->mlen || context->xlen > table->mlen)
+	return 0;
+    }
+  else
+    {
+      len = MIN(len, table->mlen);
+      if (context->xlen > table->mlen - len + 2)
+	return 0;
+    }
+
+  memset (&sel, 0, sizeof sel);
+  sel.table = table;
+  sel.cmp = cmp_mimx_entries;
+  sel.arena = &context->arena;
+  sel.n_max = context->max_candidates;
+  sel.phrase = mimx_entry_phrase;
+  if (!scim)
+    sel.mlen = mimx_entry_mlen;
+  if (init_chosen (context, &sel) < 0)
+    return -1;
+  init_mimx_walk (context, &walk);
+
+  rc = encode_pattern (context, buf, len, !scim, &pattern);
+  if (rc < 0)
+    return 0;
+  if (rc > 0)
+    {
+      if (lookup_wildcard (&walk, (const char *)buf, pattern, rc,
+			   MIMX32 (table->mimx->n_entries), &sel) < 0)
+	return -1;
+      goto done;
+    }
+
+  if (scim)
+    key = buf;
+  else
+    {
+      int *m;
+
+      if (encode_phrase (&context->arena, buf, &m) < 0)
+	return -1;
+      key = arena_alloc (&context->arena, len + 1);
+      if (!key)
+	return -1;
+      for (i = 0; i < len; i++)
+	key[i] = m[i];
+    }
+
+  STATS_START (start);
+  state = find_state (context, (const char *)buf, len);
+  if (state && state->len == len)
+    {
+      lo = state->lo;
+      hi = state->hi;
+    }
+  else
+    {
+      lo = search_mimx (table, key, len, 0, state ? state->lo : 0,
+			state ? state->hi : MIMX32 (table->mimx->n_entries));
+      hi = search_mimx (table, key, len, 1, lo,
+			state ? state->hi : MIMX32 (table->mimx->n_entries));
+      state = push_state (context, (const char *)buf, len);
+      if (state)
+	{
+	  state->lo = lo;
+	  state->hi = hi;
+	}
+    }
+
+  if (lo < hi)
+    {
+      STATS_ADD (context, entries, hi - lo);
+      kmin = entries[lo].mlen;
+      for (i = lo + 1; i < hi; i++)
+	kmin = MIN(kmin, entries[i].mlen);
+      if (scim)
+	kmax = MAX(kmin, context->xlen);
+      else
+	kmax = MAX(len + context->xlen, kmin + 1) - 1;
+
+      for (i = lo; i < hi; i++)
+	if (entries[i].mlen <= kmax && select_entry (&sel, i) < 0)
+	  return -1;
+    }
+  STATS_STOP (context, STATS_SCAN, start);
+
+  STATS_START (start);
+  if (sel.n > 0)
+    qsort_r (sel.offsets, sel.n, sizeof (int), cmp_offsets, &sel);
+  STATS_STOP (context, STATS_SORT, start);
+
+  if (lookup_fuzzy (&walk, &sel, key, len,
+		    MIMX32 (table->mimx->n_entries)) < 0)
+    return -1;
+
+ done:
+  cursor->offsets = sel.offsets;
+  cursor->end = sel.n;
+  cursor->remaining = -1;
+  return 0;
+}
+
+static int
+fetch_mimx (TableContext *context, MPlist *candidates, int n)
+{
+  Table *table = context->table;
+  TableCursor *cursor = &context->cursor;
+  uint64_t pool_size = MIMX64 (table->mimx->pool_size);
+  int count = 0;
+
+  while ((!n || count < n) && cursor->pos < cursor->end)
+    {
+      int i = cursor->offsets[cursor->pos++];
+      const MimxEntry *entry = &table->mimx_entries[i];
+      uint32_t phrase = MIMX32 (entry->phrase);
+      uint32_t plen = MIMX16 (entry->plen);
+
+      if ((uint64_t) phrase + plen > pool_size)
+	continue;
+      cursor->mlen = entry->mlen;
+      cursor->freq = MIMX32 (entry->freq);
+      add_candidate (context, i, table->mimx_pool + phrase, plen);
+      count++;
+    }
+  flush_candidates (context, candidates);
+  return count;
+}
+
+/* Wait for the tables of CONTEXT to be loaded, up to load_wait in
+   all, and mark the sources whose tables are ready.  Return 1 if any
+   is, and set *COMPLETE to whether all are.  */
+static int
+wait_tables (TableContext *context, int *complete)
+{
+  TableContext *source;
+  uint64_t start;
+  int ready = 0;
+
+  *complete = 1;
+  if (!context->sources)
+    return wait_table (context->table, context->load_wait);
+
+  start = clock_ns ();
+  for (source = context->sources; source; source = source->next)
+    {
+      long elapsed = (clock_ns () - start) / 1000000;
+
+      source->ready = wait_table (source->table,
+				  MAX(context->load_wait - elapsed, 0));
+      if (source->ready)
+	ready = 1;
+      else
+	*complete = 0;
+    }
+  return ready;
+}
+
+/* Add MT, whose text has HASH, to the texts seen by CONTEXT.  Return 1
+   if it is new, 0 if it has been seen, and -1 on error.  */
+static int
+add_seen (TableContext *context, uint64_t hash, MText *mt)
+{
+  TableSeen *seen;
+  int i, mask;
+
+  if (context->n_seen * 2 >= context->n_allocated_seen)
+    {
+      int n_allocated = context->n_allocated_seen
+	? context->n_allocated_seen * 2 : 64;
+
+      seen = arena_alloc (&context->arena, sizeof (TableSeen) * n_allocated);
+      if (!seen)
+	return -1;
+      memset (seen, 0, sizeof (TableSeen) * n_allocated);
+      for (i = 0; i < context->n_allocated_seen; i++)
+	if (context->seen[i].mt)
+	  {
+	    int j = context->seen[i].hash & (n_allocated - 1);
+
+	    while (seen[j].mt)
+	      j = (j + 1) & (n_allocated - 1);
+	    seen[j] = context->seen[i];
+	  }
+      context->seen = seen;
+      context->n_allocated_seen = n_allocated;
+    }
+
+  mask = context->n_allocated_seen - 1;
+  for (i = hash & mask; context->seen[i].mt; i = (i + 1) & mask)
+    if (context->seen[i].hash == hash
+	&& mtext_cmp (context->seen[i].mt, mt) == 0)
+      return 0;
+  context->seen[i].hash = hash;
+  context->seen[i].mt = mt;
+  context->n_seen++;
+  return 1;
+}
+
+/* Order the merged candidates A and B as an ibus-table orders its
+   rows, whichever table they come from: those of shorter keys first,
+   then those chosen more often by the user, then the more frequent,
+   then by the order of the tables and the order they were taken in.  */
+static int
+cmp_merged (const void *a, const void *b)
+{
+  const TableMerged *ma = a, *mb = b;
+
+  if (ma->mlen != mb->mlen)
+    return ma->mlen - mb->mlen;
+  if (ma->count != mb->count)
+    return mb->count - ma->count;
+  if (ma->freq != mb->freq)
+    return mb->freq > ma->freq ? 1 : -1;
+  if (ma->source != mb->source)
+    return ma->source - mb->source;
+  return ma->pos - mb->pos;
+}
+
+/* Add up to N more candidates of SOURCE (all if N is 0), the INDEX-th
+   source of CONTEXT, to the merged ones, leaving out the texts which
+   the sources before have given.  Return 0, or -1 on error.  */
+static int
+merge_source (TableContext *context, TableContext *source, int index, int n)
+{
+  TableCursor *cursor = &context->cursor;
+  int i;
+
+  for (i = 0; !n || i < n; i++)
+    {
+      MPlist *plist = mplist ();
+      TableMerged *merged;
+      MText *mt;
+      int rc;
+
+      if ((*source->table->desc->fetch) (source, plist, 1) <= 0)
+	{
+	  m17n_object_unref (plist);
+	  return 0;
+	}
+      if (mplist_key (plist) != Mtext)
+	{
+	  m17n_object_unref (plist);
+	  continue;
+	}
+
+      mt = mplist_value (plist);
+      rc = add_seen (context, source->cursor.hash, mt);
+      if (rc > 0 && (cursor->end & (cursor->end - 1)) == 0)
+	{
+	  size_t size = sizeof (TableMerged) * cursor->end;
+
+	  merged = arena_realloc (&context->arena, context->merged, size,
+				  cursor->end ? size * 2
+				  : sizeof (TableMerged));
+	  if (!merged)
+	    rc = -1;
+	  else
+	    context->merged = merged;
+	}
+      if (rc > 0)
+	{
+	  merged = &context->merged[cursor->end];
+	  merged->mt = mt;
+	  m17n_object_ref (mt);
+	  merged->count = source->cursor.count;
+	  merged->freq = source->cursor.freq;
+	  merged->mlen = source->cursor.mlen;
+	  merged->source = index;
+	  merged->pos = cursor->end++;
+	}
+      m17n_object_unref (plist);
+      if (rc < 0)
+	return -1;
+    }
+  return 0;
+}
+
+/* Take up to N more candidates (all if N is 0) from each source of
+   CONTEXT which has some left, and rank them with those taken before
+   which have yet to be fetched.  The tables do not order their
+   candidates alike, so that they cannot be merged one by one as they
+   are fetched; each gives them in its own order, and a source is
+   closed as soon as it has no more.  Return 0, or -1 on error.  */
+static int
+merge_sources (TableContext *context, int n)
+{
+  TableCursor *cursor = &context->cursor;
+  TableContext *source;
+  int index, rc = 0;
+
+  for (source = context->sources, index = 0; source;
+       source = source->next, index++)
+    {
+      if (cursor_done (source))
+	continue;
+      if (merge_source (context, source, index, n) < 0)
+	rc = -1;
+      if (rc < 0 || cursor_done (source))
+	clear_cursor (source);
+      if (rc < 0)
+	break;
+    }
+
+  if (cursor->end - cursor->pos > 1)
+    qsort (context->merged + cursor->pos, cursor->end - cursor->pos,
+	   sizeof (TableMerged), cmp_merged);
+  return rc;
+}
+
+/* Look up the preedit in each table of CONTEXT which is ready, leaving
+   out those which fail; their candidates are merged as they are
+   fetched.  Each table gives up to max_candidates, and in the paging
+   mode only a group of them at a time, so that a lookup neither takes
+   all the matches of a short preedit nor sorts them.  The tables are looked up one after another
+   on the thread of the input context, as m17n-lib is not thread-safe;
+   the scans of scim-tables are split among the threads of the scan
+   pool anyway.  */
+static int
+lookup_union (TableContext *context)
+{
+  TableCursor *cursor = &context->cursor;
+  TableContext *source;
+
+  for (source = context->sources; source; source = source->next)
+    {
+      if (!source->ready)
+	continue;
+      arena_reset (&source->arena);
+      if ((*source->table->desc->lookup) (source) < 0)
+	clear_cursor (source);
+    }
+  cursor->remaining = context->max_candidates
+    ? context->max_candidates : -1;
+  return 0;
+}
+
+/* Add up to N of the merged candidates of CONTEXT (all if N is 0) to
+   CANDIDATES, taking more from the sources when those taken so far
+   have all been added.  */
+static int
+fetch_union (TableContext *context, MPlist *candidates, int n)
+{
+  TableCursor *cursor = &context->cursor;
+  int count = 0;
+
+  while ((!n || count < n) && cursor->remaining != 0)
+    {
+      TableMerged *merged;
+
+      if (cursor->pos == cursor->end
+	  && (merge_sources (context, context->paging ? PAGE_SIZE : 0) < 0
+	      || cursor->pos == cursor->end))
+	break;
+      merged = &context->merged[cursor->pos++];
+      mplist_add (candidates, Mtext, merged->mt);
+      if (cursor->remaining > 0)
+	cursor->remaining--;
+      count++;
+    }
+  return count;
+}
+
+static int
+lookup_tables (TableContext *context)
+{
+  if (context->sources)
+    return lookup_union (context);
+  return (*context->table->desc->lookup) (context);
+}
+
+static int
+fetch_tables (TableContext *context, MPlist *candidates, int n)
+{
+  if (context->sources)
+    return fetch_union (context, candidates, n);
+  return (*context->table->desc->fetch) (context, candidates, n);
+}
+
+/* A prefetch looks up ahead the keys which the next keystroke most
+   likely makes, while the user has yet to type it: after a lookup, the
+   prefetch thread takes the characters which follow the preedit in
+   the most keys of the key index, and looks up the preedit followed by
+   each of them, until its CPU time reaches the budget of the context.
+   It only keeps the matches, as the M-texts of the candidates are
+   made on the thread of the lookups; the next lookup takes those of
+   its preedit, if any, and fetches them as its own.  */
+
+/* Return 1 if the keys of TABLE can be walked in order.  */
+static int
+has_key_index (const Table *table)
+{
+  return table->desc->lookup == lookup_mimx
+    || (table->desc->lookup == lookup_scim && table->index.data);
+}
+
+/* Set NEXT to the characters which follow the LEN bytes of KEY in the
+   most keys of the table of CONTEXT, the most first, up to
+   PREFETCH_KEYS of them.  Return how many there are.  */
+static int
+next_keys (TableContext *context, const unsigned char *key, int len,
+	   int *next)
+{
+  Table *table = context->table;
+  TableWalk walk;
+  const unsigned char *k;
+  int counts[PREFETCH_KEYS];
+  int i, n, n_next = 0, lo, hi, pos, end, klen;
+
+  memset (&walk, 0, sizeof walk);
+  if (table->desc->lookup == lookup_mimx)
+    {
+      init_mimx_walk (context, &walk);
+      n = MIMX32 (table->mimx->n_entries);
+    }
+  else
+    {
+      init_index_walk (context, &walk);
+      n = table->index.len;
     }
-
-  if (!context->mem)
+  if (len >= walk.max_depth)
+    return 0;
+  for (i = 0; i < len; i++)
     {
-      free (file);
-      return NULL;
+      if (wildcard (context, key[i])
+	  || key[i] >= 128 || phrase_enc_dict[key[i]] <= 0)
+	return 0;
+      walk.prefix[i] = walk.ibus ? phrase_enc_dict[key[i]] : key[i];
     }
 
-  if (!context->offsets)
+  lo = (*walk.search) (&walk, len, 0, 0, n);
+  hi = (*walk.search) (&walk, len, 1, lo, n);
+  for (pos = lo; pos < hi; pos = end)
     {
-      int offset;
+      int c, count;
 
-      if (!context->mlen)
-	context->mlen = MLEN;
-      context->offsets = calloc (sizeof (TableOffsetArray), context->mlen);
-      
-      for (offset = 0; offset < context->content_size;)
+      klen = (*walk.key_at) (&walk, pos, &k);
+      if (klen < 0)
+	break;
+      if (klen <= len)
+	{
+	  end = pos + 1;
+	  continue;
+	}
+      c = k[len];
+      walk.prefix[len] = c;
+      end = MAX((*walk.search) (&walk, len + 1, 1, pos, hi), pos + 1);
+      count = end - pos;
+      if (n_next == PREFETCH_KEYS && counts[n_next - 1] >= count)
+	continue;
+      i = n_next < PREFETCH_KEYS ? n_next++ : PREFETCH_KEYS - 1;
+      for (; i > 0 && counts[i - 1] < count; i--)
 	{
-	  int klen = context->content[offset] & 0x3F;
-	  int plen = context->content[offset + 1];
-	  TableOffsetArray *array;
+	  counts[i] = counts[i - 1];
+	  next[i] = next[i - 1];
+	}
+      counts[i] = count;
+      next[i] = walk.ibus ? phrase_dec_dict[c] : c;
+    }
+  return n_next;
+}
 
-	  assert (klen > 0);
-	  if (klen > context->mlen)
-	    continue;
+/* Look up the LEN bytes of KEY in the shadow of CONTEXT, and keep the
+   matches for CONTEXT unless the prefetch is cancelled.  */
+static void
+prefetch_key (TablePrefetcher *prefetcher, TableContext *context,
+	      const unsigned char *key, int len)
+{
+  TableContext *shadow = context->shadow;
+  TableCursor *cursor = &shadow->cursor;
+  int *offsets = NULL;
 
-	  array = &context->offsets[klen - 1];
-	  if (array->cap < array->len + 1)
-	    {
-	      if (array->cap == 0)
-		{
-		  array->cap = 1;
-		  array->data = calloc (sizeof (int), array->cap);
-		  if (!array->data)
-		    return NULL;
-		}
-	      else
-		{
-		  array->cap *= 2;
-		  array->data = realloc (array->data,
-					 sizeof (int) * array->cap);
-		  if (!array->data)
-		    return NULL;
-		  memset (array->data + array->len, 0, array->cap - array->len);
-		}
-	    }
-	  *(array->data + array->len++) = offset;
-	  offset += 4 + klen + plen;
-	}
+  memcpy (shadow->key, key, len);
+  shadow->key_len = len;
+  clear_cursor (shadow);
+  arena_reset (&shadow->arena);
+  if ((*shadow->table->desc->lookup) (shadow) < 0)
+    return;
+  if (cursor->offsets && cursor->end > 0)
+    {
+      offsets = malloc (sizeof (int) * cursor->end);
+      if (!offsets)
+	return;
+      memcpy (offsets, cursor->offsets, sizeof (int) * cursor->end);
     }
 
-  return NULL;
-}
+  pthread_mutex_lock (&prefetcher->mutex);
+  if (!prefetcher->cancelled && context->n_prefetched < PREFETCH_KEYS)
+    {
+      TablePrefetched *prefetched =
+	&context->prefetched[context->n_prefetched++];
 
-#define DIM(x) (sizeof (x) / sizeof (*x))
-#define CLAMP(x, low, high)  (((x) > (high)) ? (high) : (((x) < (low)) ? (low) : (x)))
+      memcpy (prefetched->key, key, len);
+      prefetched->len = len;
+      prefetched->serial = shadow->table->serial;
+      prefetched->cursor = *cursor;
+      prefetched->offsets = offsets;
+      offsets = NULL;
+    }
+  pthread_mutex_unlock (&prefetcher->mutex);
+  free (offsets);
+}
 
-MPlist *
-open (MPlist *args)
+static void *
+prefetch_next_keys (void *data)
 {
-  MInputContext *ic;
-  TableContext *context;
-  MSymbol type;
-  int i;
+  TablePrefetcher *prefetcher = data;
 
-  ic = mplist_value (args);
-  context = get_context (ic);
-
-  args = mplist_next (args);
-  type = (MSymbol) mplist_value (args);
-  args = mplist_next (args);
+  pthread_mutex_lock (&prefetcher->mutex);
+  while (1)
+    {
+      TableContext *context;
+      unsigned char key[256];
+      int next[PREFETCH_KEYS], len, n, i;
+      uint64_t start, budget;
 
-  for (i = 0; i < DIM(table_descriptions); i++)
-    if (strcmp (table_descriptions[i].name, msymbol_name (type)) == 0)
-      {
-	context->desc = &table_descriptions[i];
+      while (!prefetcher->stop && !prefetcher->pending)
+	pthread_cond_wait (&prefetcher->cond, &prefetcher->mutex);
+      if (prefetcher->stop)
 	break;
-      }
+      context = prefetcher->busy = prefetcher->pending;
+      prefetcher->pending = NULL;
+      prefetcher->cancelled = 0;
+      len = prefetcher->len;
+      memcpy (key, prefetcher->key, len);
+      pthread_mutex_unlock (&prefetcher->mutex);
 
-  if (context->desc)
-    (*context->desc->open) (context, args);
+      start = thread_cpu_ns ();
+      budget = (uint64_t) context->prefetch * 1000;
+      n = next_keys (context->shadow, key, len, next);
+      for (i = 0; i < n; i++)
+	{
+	  if (__atomic_load_n (&prefetcher->cancelled, __ATOMIC_RELAXED)
+	      || thread_cpu_ns () - start >= budget)
+	    break;
+	  key[len] = next[i];
+	  prefetch_key (prefetcher, context, key, len + 1);
+	}
 
+      pthread_mutex_lock (&prefetcher->mutex);
+      prefetcher->busy = NULL;
+      pthread_cond_broadcast (&prefetcher->cond);
+    }
+  pthread_mutex_unlock (&prefetcher->mutex);
   return NULL;
 }
 
-static MPlist *
-lookup_ibus (TableContext *context, MPlist *args)
+/* Drop the prefetched matches of CONTEXT, with the mutex of the
+   prefetch thread held.  */
+static void
+drop_prefetched (TableContext *context)
 {
-  unsigned char buf[256];
-  char *word = NULL, *sql = NULL, *msql = NULL;
-  MPlist *candidates = mplist ();
-  int len, xlen, wlen, mlen;
-  int i, rc;
-  int *m = NULL;
-  sqlite3_stmt *stmt;
-  MText *mt;
-
-  if (!context->db)
-    goto out;
+  int i;
 
-  rc = mtext_to_utf8 (context, context->ic->preedit, buf, sizeof (buf));
-  if (rc < 0)
-    goto out;
-  word = strdup ((const char *)buf);
-  len = rc;
+  for (i = 0; i < context->n_prefetched; i++)
+    free (context->prefetched[i].offsets);
+  context->n_prefetched = 0;
+}
 
-  mlen = CLAMP(context->mlen, 0, 99);
+/* Start looking up ahead the keys which follow the preedit KEY of LEN
+   bytes, just looked up in CONTEXT.  */
+static void
+start_prefetch (TableContext *context, const char *key, int len)
+{
+  TablePrefetcher *prefetcher = &table_prefetcher;
+  TableContext *shadow;
 
-  rc = encode_phrase ((const unsigned char *)word, &m);
-  if (rc)
-    goto out;
+  if (context->prefetch <= 0 || context->sources || !context->table
+      || len <= 0 || len + 1 >= sizeof prefetcher->key
+      || !wait_table (context->table, 0)
+      || !has_key_index (context->table))
+    return;
 
-  /* strlen(" AND mXX = XX") = 13 */
-  if (len > mlen)
-    len = mlen;
-  msql = calloc (sizeof (char), 13 * len + 1);
-  if (!msql)
-    goto out;
-  for (i = 0; i < len; i++)
+  /* the shadow goes with the table, so stop_prefetch frees it */
+  if (!context->shadow)
     {
-      char s[14];
-      sqlite3_snprintf (13, s, " AND m%d = %d", i, m[i]);
-      strcat (msql, s);
-    }
-
-  sql = calloc (sizeof (char), 128 + strlen (msql) + 1);
-  if (!sql)
-    goto out;
-
-  /* issue query repeatedly until at least one candidates are found or
-     the key length is exceeds mlen */
-  xlen = context->xlen;
-  wlen = mlen - len + 1;
-  for (; xlen <= wlen + 1; xlen++)
-    {
-      sqlite3_snprintf (128,
-			sql,
-			"SELECT id, phrase FROM phrases WHERE mlen < %lu",
-			len + xlen);
-      strcat (sql, msql);
-      strcat (sql, " ORDER BY mlen ASC, user_freq DESC, freq DESC, id ASC");
-      if (context->max_candidates)
-	sqlite3_snprintf (128,
-			  sql + strlen (sql),
-			  " LIMIT %lu",
-			  context->max_candidates);
-
-#ifdef DEBUG
-      fprintf (stderr, "%s\n", sql);
-#endif
-      rc = sqlite3_prepare (context->db, sql, strlen (sql), &stmt, NULL);
-      if (rc != SQLITE_OK)
-	{
-	  sqlite3_finalize (stmt);
-	  goto out;
-	}
-
-      while (sqlite3_step (stmt) == SQLITE_ROW)
+      shadow = make_context (NULL);
+      context->prefetched = calloc (PREFETCH_KEYS, sizeof (TablePrefetched));
+      if (!shadow || !context->prefetched)
 	{
-	  const unsigned char *text;
-
-	  text = sqlite3_column_text (stmt, 1);
-#ifdef DEBUG
-	  fprintf (stderr, " %s\n", text);
-#endif
-	  mt = mtext_from_utf8 (context, text, strlen ((const char *)text));
-	  mplist_add (candidates, Mtext, mt);
-	  m17n_object_unref (mt);
+	  if (shadow)
+	    free_context (shadow);
+	  free (context->prefetched);
+	  context->prefetched = NULL;
+	  return;
 	}
-      sqlite3_finalize (stmt);
-      if (mplist_length (candidates) > 0)
-	break;
+      shadow->table = context->table;
+      shadow->table->refcount++;
+      shadow->xlen = context->xlen;
+      shadow->max_candidates = context->max_candidates;
+      shadow->fuzzy = context->fuzzy;
+      shadow->single_wildcard = context->single_wildcard;
+      shadow->multi_wildcard = context->multi_wildcard;
+      shadow->speculative = 1;
+      context->shadow = shadow;
     }
 
- out:
-  if (word)
-    free (word);
-  if (m)
-    free (m);
-  if (sql)
-    free (sql);
-  if (msql)
-    free (msql);
-
-  return candidates;
+  pthread_mutex_lock (&prefetcher->mutex);
+  drop_prefetched (context);
+  if (!prefetcher->running)
+    prefetcher->running = pthread_create (&prefetcher->thread, NULL,
+					  prefetch_next_keys,
+					  prefetcher) == 0;
+  if (prefetcher->running)
+    {
+      prefetcher->pending = context;
+      memcpy (prefetcher->key, key, len);
+      prefetcher->len = len;
+      pthread_cond_broadcast (&prefetcher->cond);
+    }
+  pthread_mutex_unlock (&prefetcher->mutex);
 }
 
-struct _TablePhrase {
-  char *text;
-  int freq;
-};
-typedef struct _TablePhrase TablePhrase;
-
-static int
-cmp_phrases_by_freq (const void *a, const void *b)
+/* Stop the prefetch for the previous keystroke, as a lookup starts.  */
+static void
+cancel_prefetch (void)
 {
-  const TablePhrase *pa = a, *pb = b;
+  TablePrefetcher *prefetcher = &table_prefetcher;
 
-  return pb->freq - pa->freq;
+  if (!prefetcher->running)
+    return;
+  pthread_mutex_lock (&prefetcher->mutex);
+  prefetcher->pending = NULL;
+  __atomic_store_n (&prefetcher->cancelled, 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock (&prefetcher->mutex);
 }
 
-static MPlist *
-lookup_scim (TableContext *context, MPlist *args)
+/* Cancel the prefetch, wait for the thread to stop, and drop the
+   matches prefetched for all the input contexts, as the choices which
+   rank them are about to change.  */
+static void
+drain_prefetch (void)
 {
-  unsigned char buf[256];
-  char *word = NULL;
-  MPlist *candidates = mplist ();
-  MText *mt;
-  int rc, len, xlen;
-  TablePhrase *phrases;
-  int n_phrases, n_allocated_phrases;
+  TablePrefetcher *prefetcher = &table_prefetcher;
+  TableContext *context;
 
-  if (!context->content || !context->offsets)
-    goto out;
+  if (!prefetcher->running)
+    return;
+  pthread_mutex_lock (&prefetcher->mutex);
+  prefetcher->pending = NULL;
+  __atomic_store_n (&prefetcher->cancelled, 1, __ATOMIC_RELAXED);
+  while (prefetcher->busy)
+    pthread_cond_wait (&prefetcher->cond, &prefetcher->mutex);
+  for (context = contexts; context; context = context->next_context)
+    drop_prefetched (context);
+  pthread_mutex_unlock (&prefetcher->mutex);
+}
 
-  rc = mtext_to_utf8 (context, context->ic->preedit, buf, sizeof (buf));
-  if (rc < 0 || rc >= context->mlen)
-    goto out;
-  word = strdup ((const char *)buf);
-  len = rc;
+/* Set the cursor of CONTEXT to the prefetched matches of the preedit
+   KEY of LEN bytes, and drop the others.  Return 1 if there were.  */
+static int
+take_prefetched (TableContext *context, const char *key, int len)
+{
+  TablePrefetcher *prefetcher = &table_prefetcher;
+  TableCursor *cursor = &context->cursor;
+  int i, found = 0;
 
-  n_allocated_phrases = 2;
-  phrases = calloc (sizeof (TablePhrase), n_allocated_phrases);
-  for (n_phrases = 0, xlen = context->xlen; xlen <= context->mlen
-	 && n_phrases == 0; xlen++)
+  if (!context->prefetched)
+    return 0;
+  pthread_mutex_lock (&prefetcher->mutex);
+  for (i = 0; i < context->n_prefetched && !found; i++)
     {
-      int j;
+      TablePrefetched *prefetched = &context->prefetched[i];
 
-      for (j = xlen; j > 0; j--)
+      if (prefetched->len != len || memcmp (prefetched->key, key, len)
+	  || prefetched->serial != context->table->serial)
+	continue;
+      *cursor = prefetched->cursor;
+      if (prefetched->offsets)
 	{
-	  TableOffsetArray *array = &context->offsets[j - 1];
-	  int i;
-
-	  for (i = 0; i < array->len; i++)
-	    {
-	      unsigned char *data = &context->content[array->data[i]];
-	      int klen = *data & 0x3F;
-	      int plen = *(data + 1);
-
-	      if (strncmp ((const char *)(data + 4), word, len) == 0)
-		{
-		  int freq = scim_bytestouint16 (data + 2);
-
-		  if (++n_phrases > n_allocated_phrases)
-		    {
-		      n_allocated_phrases *= 2;
-		      phrases = realloc (phrases,
-					 sizeof (TablePhrase)
-					 * n_allocated_phrases);
-		    }
-		  phrases[n_phrases - 1].text =
-		    strndup ((const char *)(data + 4 + klen), plen);
-		  phrases[n_phrases - 1].freq = freq;
-		}
-	    }
+	  cursor->offsets = arena_alloc (&context->arena,
+					 sizeof (int) * cursor->end);
+	  if (cursor->offsets)
+	    memcpy (cursor->offsets, prefetched->offsets,
+		    sizeof (int) * cursor->end);
+	  else
+	    memset (cursor, 0, sizeof *cursor);
 	}
+      found = cursor->end > 0 || !prefetched->offsets;
     }
+  drop_prefetched (context);
+  pthread_mutex_unlock (&prefetcher->mutex);
+  if (found)
+    STATS_ADD (context, prefetch_hits, 1);
+  return found;
+}
 
-  qsort (phrases, n_phrases, sizeof (TablePhrase), cmp_phrases_by_freq);
-  while (n_phrases--)
-    {
-      mt = mtext_from_utf8 (context,
-			    (const unsigned char *)phrases[n_phrases].text,
-			    strlen (phrases[n_phrases].text));
-      free (phrases[n_phrases].text);
+/* Wait for the prefetch thread to leave CONTEXT, and drop its
+   prefetched matches and its shadow, as its table or its options are
+   about to change.  */
+static void
+stop_prefetch (TableContext *context)
+{
+  TablePrefetcher *prefetcher = &table_prefetcher;
 
-      if (!context->max_candidates
-	  || mplist_length (candidates) < context->max_candidates)
-	{
-	  mplist_push (candidates, Mtext, mt);
-#ifdef DEBUG
-	  mdebug_dump_mtext (mt, 0, 0);
-#endif
-	  m17n_object_unref (mt);
-	}
+  if (!context->shadow)
+    return;
+  pthread_mutex_lock (&prefetcher->mutex);
+  if (prefetcher->pending == context)
+    prefetcher->pending = NULL;
+  if (prefetcher->busy == context)
+    {
+      __atomic_store_n (&prefetcher->cancelled, 1, __ATOMIC_RELAXED);
+      while (prefetcher->busy == context)
+	pthread_cond_wait (&prefetcher->cond, &prefetcher->mutex);
     }
-  free (phrases);
+  drop_prefetched (context);
+  pthread_mutex_unlock (&prefetcher->mutex);
 
- out:
-  if (word)
-    free (word);
+  free (context->prefetched);
+  context->prefetched = NULL;
+  free_context (context->shadow);
+  context->shadow = NULL;
+}
+
+static void
+stop_prefetcher (void)
+{
+  TablePrefetcher *prefetcher = &table_prefetcher;
+
+  pthread_mutex_lock (&prefetcher->mutex);
+  if (!prefetcher->running)
+    {
+      pthread_mutex_unlock (&prefetcher->mutex);
+      return;
+    }
+  prefetcher->stop = 1;
+  pthread_cond_broadcast (&prefetcher->cond);
+  pthread_mutex_unlock (&prefetcher->mutex);
 
-  return candidates;
+  pthread_join (prefetcher->thread, NULL);
+  prefetcher->running = 0;
+  prefetcher->stop = 0;
 }
 
 static MPlist *
@@ -760,7 +6421,7 @@ paginate (MPlist *candidates)
   for (i = 0; mplist_key (p) == Mtext; p = mplist_next (p), i++)
     {
       mplist_add (pl, Mtext, mplist_value (p));
-      if (i % 10 == 9)
+      if (i % PAGE_SIZE == PAGE_SIZE - 1)
 	{
 	  mplist_add (plist, Mplist, pl);
 	  m17n_object_unref (pl);
@@ -774,6 +6435,180 @@ paginate (MPlist *candidates)
   return plist;
 }
 
+static void
+unlink_result (TableResult *result)
+{
+  TableResultCache *cache = &result_cache;
+
+  if (result->lru_prev)
+    result->lru_prev->lru_next = result->lru_next;
+  else
+    cache->lru_head = result->lru_next;
+  if (result->lru_next)
+    result->lru_next->lru_prev = result->lru_prev;
+  else
+    cache->lru_tail = result->lru_prev;
+  result->lru_prev = result->lru_next = NULL;
+}
+
+static void
+link_result (TableResult *result)
+{
+  TableResultCache *cache = &result_cache;
+
+  result->lru_next = cache->lru_head;
+  if (cache->lru_head)
+    cache->lru_head->lru_prev = result;
+  else
+    cache->lru_tail = result;
+  cache->lru_head = result;
+}
+
+static void
+remove_result (TableResult *result)
+{
+  TableResultCache *cache = &result_cache;
+  TableResult **p;
+
+  for (p = &cache->buckets[result->hash % RESULT_CACHE_BUCKETS]; *p;
+       p = &(*p)->next)
+    if (*p == result)
+      {
+	*p = result->next;
+	break;
+      }
+  unlink_result (result);
+  cache->n_candidates -= result->n + 1;
+  m17n_object_unref (result->candidates);
+  free (result->key);
+  free (result);
+}
+
+/* Drop the results of the table of SERIAL, which is closed.  */
+static void
+purge_results (unsigned int serial)
+{
+  TableResult *result, *next;
+  int i;
+
+  for (result = result_cache.lru_head; result; result = next)
+    {
+      next = result->lru_next;
+      for (i = 0; i < result->n_serials; i++)
+	if (result->serials[i] == serial)
+	  {
+	    remove_result (result);
+	    break;
+	  }
+    }
+}
+
+/* Set SERIALS to those of the tables of CONTEXT, and return how many
+   they are.  */
+static int
+table_serials (TableContext *context, unsigned int *serials)
+{
+  TableContext *source;
+  int n = 0;
+
+  if (!context->sources)
+    serials[n++] = context->table->serial;
+  for (source = context->sources; source; source = source->next)
+    serials[n++] = source->table->serial;
+  return n;
+}
+
+static uint64_t
+hash_result (TableContext *context, const char *key, int len)
+{
+  unsigned int params[MAX_SOURCES + 5];
+  int n;
+
+  n = table_serials (context, params);
+  params[n++] = context->xlen;
+  params[n++] = context->max_candidates;
+  params[n++] = context->fuzzy;
+  params[n++] = context->single_wildcard;
+  params[n++] = context->multi_wildcard;
+  return hash_bytes ((const unsigned char *) key, len)
+    ^ hash_bytes ((const unsigned char *) params, sizeof (int) * n);
+}
+
+/* Return the result of the lookup of KEY in CONTEXT, if cached.  */
+static TableResult *
+find_result (TableContext *context, const char *key, int len)
+{
+  TableResultCache *cache = &result_cache;
+  uint64_t hash = hash_result (context, key, len);
+  unsigned int serials[MAX_SOURCES];
+  int n_serials = table_serials (context, serials);
+  TableResult *result;
+
+  for (result = cache->buckets[hash % RESULT_CACHE_BUCKETS]; result;
+       result = result->next)
+    if (result->hash == hash
+	&& result->n_serials == n_serials
+	&& memcmp (result->serials, serials,
+		   sizeof (unsigned int) * n_serials) == 0
+	&& result->xlen == context->xlen
+	&& result->max_candidates == context->max_candidates
+	&& result->fuzzy == context->fuzzy
+	&& result->single_wildcard == context->single_wildcard
+	&& result->multi_wildcard == context->multi_wildcard
+	&& result->len == len && memcmp (result->key, key, len) == 0)
+      {
+	cache->hits++;
+	unlink_result (result);
+	link_result (result);
+	return result;
+      }
+  cache->misses++;
+  return NULL;
+}
+
+/* Keep the N CANDIDATES of the lookup of KEY in CONTEXT, dropping the
+   least recently used results to make room for them.  */
+static void
+add_result (TableContext *context, const char *key, int len,
+	    MPlist *candidates, int n)
+{
+  TableResultCache *cache = &result_cache;
+  TableResult *result;
+
+  /* an empty result counts as one candidate */
+  if (n + 1 > RESULT_CACHE_MAX_CANDIDATES)
+    return;
+  while (cache->lru_tail
+	 && cache->n_candidates + n + 1 > RESULT_CACHE_MAX_CANDIDATES)
+    remove_result (cache->lru_tail);
+
+  result = calloc (sizeof (TableResult), 1);
+  if (!result)
+    return;
+  result->key = malloc (len + 1);
+  if (!result->key)
+    {
+      free (result);
+      return;
+    }
+  memcpy (result->key, key, len);
+  result->len = len;
+  result->n_serials = table_serials (context, result->serials);
+  result->xlen = context->xlen;
+  result->max_candidates = context->max_candidates;
+  result->fuzzy = context->fuzzy;
+  result->single_wildcard = context->single_wildcard;
+  result->multi_wildcard = context->multi_wildcard;
+  result->hash = hash_result (context, key, len);
+  result->candidates = mplist_copy (candidates);
+  result->n = n;
+
+  result->next = cache->buckets[result->hash % RESULT_CACHE_BUCKETS];
+  cache->buckets[result->hash % RESULT_CACHE_BUCKETS] = result;
+  link_result (result);
+  cache->n_candidates += n + 1;
+}
+
 MPlist *
 lookup (MPlist *args)
 {
@@ -783,22 +6618,77 @@ lookup (MPlist *args)
   MSymbol select_state;
   TableContext *context;
   MText *mt;
+  uint64_t start, lookup_start;
+  char key[256];
+  int n = 0, len = -1, complete;
 
   ic = mplist_value (args);
   context = get_context (ic);
+  STATS_START (lookup_start);
 
   args = mplist_next (args);
   init_state = (MSymbol) mplist_value (args);
   args = mplist_next (args);
   select_state = (MSymbol) mplist_value (args);
 
-  if (context->desc)
-    candidates = (*context->desc->lookup) (context, args);
-  else
+  /* In the paging mode, only the first group and a candidate of the
+     next one are added; the candidate makes the next group exist, so
+     that moving to it does not wrap around to the first group before
+     "more" adds the rest.  */
+  clear_cursor (context);
+  arena_reset (&context->arena);
+  refresh_tables (context);
+  restore_tables (context);
+  cancel_prefetch ();
+  candidates = NULL;
+  if (context->table && wait_tables (context, &complete))
+    {
+      /* only complete results are cached, which excludes a first group
+	 of the paging mode with more candidates to come, and those of
+	 some of the tables before the others are loaded */
+      TableResult *result;
+
+      len = mtext_to_utf8 (context, ic->preedit, (unsigned char *) key,
+			   sizeof key);
+      result = len < 0 || !complete ? NULL : find_result (context, key, len);
+
+      if (result)
+	{
+	  candidates = mplist_copy (result->candidates);
+	  n = result->n;
+	  STATS_ADD (context, cache_hits, 1);
+	}
+      else
+	{
+	  candidates = mplist ();
+	  if (take_prefetched (context, key, len)
+	      || lookup_tables (context) == 0)
+	    {
+	      n = fetch_tables (context, candidates,
+				context->paging ? PAGE_SIZE : 0);
+	      if (len >= 0 && complete && cursor_done (context))
+		add_result (context, key, len, candidates, n);
+	    }
+	}
+    }
+  if (!candidates)
     candidates = mplist ();
+#ifdef DEBUG
+  fprintf (stderr, "lookup used %zu bytes of the arena, "
+	   "%lu cache hits and %lu misses\n", context->arena.used,
+	   result_cache.hits, result_cache.misses);
+#endif
+
+  if (!context->paging || cursor_done (context))
+    clear_cursor (context);
+  trim_tables (context);
+  start_prefetch (context, key, len);
 
-  if (mplist_length (candidates) == 0) {
+  STATS_ADD (context, lookups, 1);
+  STATS_ADD (context, candidates, n);
+  if (n == 0) {
     m17n_object_unref (candidates);
+    STATS_STOP (context, STATS_LOOKUP, lookup_start);
     return NULL;
   }
 
@@ -825,8 +6715,13 @@ lookup (MPlist *args)
   mt = mtext_dup (ic->preedit);
   mplist_push (candidates, Mtext, mt);
   m17n_object_unref (mt);
+  STATS_START (start);
   plist = paginate (candidates);
-  m17n_object_unref (candidates);
+  STATS_STOP (context, STATS_PAGINATE, start);
+  if (context->paging && !cursor_done (context))
+    context->candidates = candidates;
+  else
+    m17n_object_unref (candidates);
 
   add_action (actions, msymbol ("delete"), Msymbol,  msymbol ("@<"));
   mplist_add (actions, Mplist, plist);
@@ -835,5 +6730,131 @@ lookup (MPlist *args)
   add_action (actions, msymbol ("show"), Mnil, NULL);
   add_action (actions, msymbol ("shift"), Msymbol, select_state);
 
+  STATS_STOP (context, STATS_LOOKUP, lookup_start);
+  return actions;
+}
+
+/* In the paging mode, add the next group of candidates when the
+   selected candidate is in the last group added, and replace the
+   candidate list, keeping the selection.  The MIM calls this after
+   moving the selection, as in:
+
+   (select
+    (change-candidate (call libmimx-table more))
+    ...)  */
+MPlist *
+more (MPlist *args)
+{
+  MInputContext *ic;
+  TableContext *context;
+  MPlist *actions, *plist, *tail;
+  uint64_t start, more_start;
+  int index, len, n, i;
+
+  ic = mplist_value (args);
+  context = get_context (ic);
+
+  if (!context || !context->candidates || !ic->candidate_list)
+    return NULL;
+
+  index = ic->candidate_index;
+  len = mplist_length (context->candidates);
+  if (index / PAGE_SIZE < (len - 1) / PAGE_SIZE)
+    return NULL;
+  STATS_START (more_start);
+
+  /* fill the group and add a candidate of the next one */
+  for (tail = context->candidates; mplist_key (tail) != Mnil;
+       tail = mplist_next (tail))
+    ;
+  n = ((len - 1) / PAGE_SIZE + 1) * PAGE_SIZE + 1 - len;
+  n = fetch_tables (context, tail, n);
+
+  actions = NULL;
+  if (n > 0)
+    {
+      STATS_ADD (context, candidates, n);
+      actions = mplist ();
+      STATS_START (start);
+      plist = paginate (context->candidates);
+      STATS_STOP (context, STATS_PAGINATE, start);
+      add_action (actions, msymbol ("delete"), Msymbol,  msymbol ("@<"));
+      mplist_add (actions, Mplist, plist);
+      m17n_object_unref (plist);
+      for (i = 0; i < index / PAGE_SIZE; i++)
+	add_action (actions, msymbol ("select"), Msymbol, msymbol ("@]"));
+      add_action (actions, msymbol ("select"), Minteger,
+		  (void *)(long) (index % PAGE_SIZE));
+    }
+
+  if (cursor_done (context))
+    clear_cursor (context);
+  STATS_STOP (context, STATS_MORE, more_start);
   return actions;
 }
+
+/* Record that the user has chosen the candidate in the preedit, so
+   that it comes first in the lookups which find it.  */
+MPlist *
+learn (MPlist *args)
+{
+  MInputContext *ic;
+  TableContext *context;
+  unsigned char buf[256];
+  int len;
+
+  ic = mplist_value (args);
+  context = get_context (ic);
+
+  /* the counts of an evicted table are kept */
+  if (!context || !context->table
+      || (!wait_table (context->table, 0) && !table_evicted (context->table)))
+    return NULL;
+
+  len = mtext_to_utf8 (context, ic->preedit, buf, sizeof (buf));
+  if (len <= 0 || memchr (buf, '\n', len))
+    return NULL;
+
+  /* the prefetch thread reads the counts, and what has been looked up
+     is ranked by them */
+  drain_prefetch ();
+  if (add_learned (context->table, (const char *) buf, len, 1) < 0)
+    return NULL;
+  context->table->learn_serial++;
+  purge_results (context->table->serial);
+  if (context->table->learn_log)
+    queue_learned (context->table, (const char *) buf, len);
+  return NULL;
+}
+
+/* Write the counters of the input context and of its table, or of
+   each of its sources and their tables if it has several, as "fini"
+   does when MIMX_TABLE_STATS is set, to the file it names (stderr if
+   it is empty or "-", or not set).  If the counters are not collected
+   yet, the first call starts collecting them and writes zeros.  A MIM
+   can bind it to a key:
+
+   (module
+    (libmimx-table open lookup init fini stats))
+   ...
+    (init
+     ((C-F12) (call libmimx-table stats)))  */
+MPlist *
+stats (MPlist *args)
+{
+  MInputContext *ic = mplist_value (args);
+  TableContext *context = get_context (ic), *source;
+
+  if (!context)
+    return NULL;
+  stats_enabled = 1;
+  write_stats ("context", context->table, &context->stats);
+  for (source = context->sources; source; source = source->next)
+    {
+      write_stats ("source", source->table, &source->stats);
+      write_stats ("table", source->table, &source->table->stats);
+    }
+  if (!context->sources && context->table)
+    write_stats ("table", context->table, &context->table->stats);
+  return NULL;
+}